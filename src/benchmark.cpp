@@ -24,6 +24,8 @@
 #include "usi.hpp"
 #include "position.hpp"
 #include "search.hpp"
+#include "generateMoves.hpp"
+#include "evaluate.hpp"
 
 // 今はベンチマークというより、PGO ビルドの自動化の為にある。
 void benchmark(Position& pos) {
@@ -37,6 +39,7 @@ void benchmark(Position& pos) {
         pos.searcher()->setOption(is);
     }
 
+    pos.searcher()->threads.resetEvalHashStats();
     std::ifstream ifs("benchmark.sfen");
     std::string sfen;
     while (std::getline(ifs, sfen)) {
@@ -47,4 +50,1203 @@ void benchmark(Position& pos) {
         go(pos, ss_go);
         pos.searcher()->threads.main()->waitForSearchFinished();
     }
+    const s64 hits = pos.searcher()->threads.evalHashHits();
+    const s64 misses = pos.searcher()->threads.evalHashMisses();
+    std::cout << "eval hash hits: " << hits << ", misses: " << misses << std::endl;
+}
+
+namespace {
+    // ベンチマークで使う 1 局分の棋譜。
+    struct BenchGame {
+        std::string position; // position コマンドの引数
+        std::vector<Move> moves;
+    };
+
+    // 平手の初期局面と benchmark.sfen の各局面。
+    std::vector<std::string> benchRoots() {
+        std::vector<std::string> roots = {"startpos"};
+        std::ifstream ifs("benchmark.sfen");
+        std::string line;
+        while (std::getline(ifs, line))
+            if (!line.empty())
+                roots.push_back(line);
+        return roots;
+    }
+
+    // benchmark.sfen の各局面と平手の初期局面から、ランダムに gameNum 局、最大 maxPly 手指した棋譜を作る。
+    // 乱数の seed が同じなら毎回同じ棋譜になる。
+    std::vector<BenchGame> makeBenchGames(Position& pos, const int gameNum, const int maxPly, const u64 seed, size_t& positionNum) {
+        const std::vector<std::string> roots = benchRoots();
+
+        std::mt19937_64 mt(seed);
+        std::vector<BenchGame> games(gameNum);
+        positionNum = 0;
+        for (int g = 0; g < gameNum; ++g) {
+            BenchGame& game = games[g];
+            game.position = roots[g % roots.size()];
+            std::istringstream ss(game.position);
+            setPosition(pos, ss);
+            std::deque<StateInfo> states(maxPly);
+            for (int ply = 0; ply < maxPly; ++ply) {
+                MoveList<Legal> ml(pos);
+                if (ml.size() == 0)
+                    break;
+                const Move move = ml.begin()[std::uniform_int_distribution<size_t>(0, ml.size() - 1)(mt)].move;
+                game.moves.push_back(move);
+                pos.doMove(move, states[ply]);
+            }
+            positionNum += game.moves.size() + 1;
+        }
+        return games;
+    }
+
+    // game の開始局面と、各指し手を指した後の局面で func(pos, ply) を呼ぶ。
+    template <typename T>
+    void replayBenchGame(Position& pos, const BenchGame& game, T func) {
+        std::istringstream ss(game.position);
+        setPosition(pos, ss);
+        std::deque<StateInfo> states(game.moves.size());
+        func(pos, 0);
+        for (size_t i = 0; i < game.moves.size(); ++i) {
+            pos.doMove(game.moves[i], states[i]);
+            func(pos, static_cast<int>(i + 1));
+        }
+    }
+
+    // pos が解放済みの StateInfo を指したままにならないよう、初期局面に戻しておく。
+    void resetBenchPosition(Position& pos) {
+        std::istringstream ss("startpos");
+        setPosition(pos, ss);
+    }
+
+    // [games] [plies] [seed] の引数を読んで、makeBenchGames() で棋譜を作る。
+    std::vector<BenchGame> readBenchGames(Position& pos, std::istringstream& ssCmd, size_t& positionNum, int gameNum = 200) {
+        int maxPly = 256;
+        u64 seed = 0;
+        ssCmd >> gameNum >> maxPly >> seed;
+        maxPly = std::max(0, std::min(maxPly, static_cast<int>(MaxPly)));
+        return makeBenchGames(pos, gameNum, maxPly, seed, positionNum);
+    }
+
+    // games の全ての局面のうち、filter(pos) が true を返す局面のコピーを集める。
+    template <typename T>
+    std::vector<Position> collectBenchPositions(Position& pos, const std::vector<BenchGame>& games, const size_t positionNum, T filter) {
+        std::vector<Position> positions;
+        positions.reserve(positionNum);
+        for (auto& game : games)
+            replayBenchGame(pos, game, [&](Position& p, const int) {
+                    if (filter(p))
+                        positions.push_back(p);
+                });
+        return positions;
+    }
+    std::vector<Position> collectBenchPositions(Position& pos, const std::vector<BenchGame>& games, const size_t positionNum) {
+        return collectBenchPositions(pos, games, positionNum, [](const Position&) { return true; });
+    }
+
+    // 参照実装などと結果が一致しなかった数を表示する。
+    void reportMismatches(const s64 mismatches) {
+        std::cout << "mismatches: " << mismatches << (mismatches == 0 ? " (ok)" : " (NG)") << std::endl;
+    }
+
+    // num 回の処理に elapsed [msec] 掛かった時の、1 秒あたりの処理数を表示する。note は行末に付け加える。
+    void reportRate(const std::string& name, const s64 num, const int elapsed, const char* unit, const std::string& note = "") {
+        std::cout << std::left << std::setw(28) << name << std::right
+                  << "elapsed = " << std::setw(6) << elapsed << " [msec], "
+                  << std::setw(10) << (elapsed ? num * 1000 / elapsed : 0) << " [" << unit << "/sec]" << note << std::endl;
+    }
+
+    // [first0, last0) と [first1, last1) の指し手の集合が一致するか。並び順は問わない。
+    bool sameMoveSet(const ExtMove* first0, const ExtMove* last0, const ExtMove* first1, const ExtMove* last1) {
+        auto toMoves = [](const ExtMove* first, const ExtMove* last) {
+            std::vector<u32> moves;
+            for (const ExtMove* it = first; it != last; ++it)
+                moves.push_back(it->move.value());
+            std::sort(std::begin(moves), std::end(moves));
+            return moves;
+        };
+        return toMoves(first0, last0) == toMoves(first1, last1);
+    }
+}
+
+// 評価関数のベンチマークと検証。
+// bench_eval [games] [plies] [seed]
+// benchmark.sfen の各局面と平手の初期局面からランダムに games 局、最大 plies 手指した局面を使い、
+// 全計算、差分計算、ハッシュテーブル参照、まとめて評価(evaluateBatch())の速度を測る。
+// 全ての結果を SIMD を使わない evaluateUnUseDiff() と比較し、一致しない局面があれば表示する。
+void benchmarkEval(Position& pos, std::istringstream& ssCmd) {
+    size_t positionNum;
+    const std::vector<BenchGame> games = readBenchGames(pos, ssCmd, positionNum);
+
+#if defined USE_AVX2_EVAL
+    const std::string simd = "AVX2";
+#elif defined USE_SSE_EVAL
+    const std::string simd = "SSE";
+#else
+    const std::string simd = "none";
+#endif
+    std::cout << "simd: " << simd << std::endl;
+    std::cout << "games: " << games.size() << ", positions: " << positionNum << std::endl;
+
+    // 局面の並びは全ての計測で同じなので、結果を添字で突き合わせる。
+    std::vector<Score> scalarScores;
+    std::vector<Score> fullScores;
+    std::vector<Score> diffScores;
+    std::vector<Score> missScores;
+    std::vector<Score> hitScores;
+    std::vector<Score> batchScores(positionNum);
+    std::vector<std::array<s32, 6> > fullRaws;
+    std::vector<std::array<s32, 6> > diffRaws;
+    for (auto* v : {&scalarScores, &fullScores, &diffScores, &missScores, &hitScores})
+        v->reserve(positionNum);
+    fullRaws.reserve(positionNum);
+    diffRaws.reserve(positionNum);
+    auto toRaw = [](const EvalSum& sum) {
+        return std::array<s32, 6>{{sum.p[0][0], sum.p[0][1], sum.p[1][0], sum.p[1][1], sum.p[2][0], sum.p[2][1]}};
+    };
+    // EvalSum は 32 byte 境界に置く必要があるので、std::vector ではなく配列で持つ。
+    SearchStack stack[MaxPly + 2];
+    SearchStack* const ss = &stack[1];
+
+    auto report = [positionNum](const std::string& name, const int elapsed, const int baseElapsed) {
+        const int net = std::max(0, elapsed - baseElapsed);
+        std::cout << std::left << std::setw(28) << name << std::right
+                  << "elapsed = " << std::setw(6) << elapsed << " [msec], "
+                  << std::setw(8) << (positionNum ? static_cast<s64>(net) * 1000000 / static_cast<s64>(positionNum) : 0)
+                  << " [nsec/pos]" << std::endl;
+    };
+
+    // 局面を進めるだけの時間。以下の計測からはこれを差し引いて 1 局面あたりの時間を出す。
+    Timer t = Timer::currentTime();
+    s64 dummy = 0;
+    for (auto& game : games)
+        replayBenchGame(pos, game, [&](Position& p, const int) { dummy += p.getKey() & 1; });
+    const int baseElapsed = t.elapsed();
+    report("doMove only", baseElapsed, 0);
+
+    t.restart();
+    for (auto& game : games)
+        replayBenchGame(pos, game, [&](Position& p, const int) { scalarScores.push_back(evaluateUnUseDiff(p) / FVScale); });
+    report("scalar (evaluateUnUseDiff)", t.elapsed(), baseElapsed);
+
+    t.restart();
+    for (auto& game : games)
+        replayBenchGame(pos, game, [&](Position& p, const int) {
+                (ss-1)->staticEvalRaw.p[0][0] = ScoreNotEvaluated;
+                fullScores.push_back(evaluateWithoutHash(p, ss));
+                fullRaws.push_back(toRaw(ss->staticEvalRaw));
+            });
+    report("full", t.elapsed(), baseElapsed);
+
+    t.restart();
+    for (auto& game : games)
+        replayBenchGame(pos, game, [&](Position& p, const int ply) {
+                if (ply == 0)
+                    (ss-1)->staticEvalRaw.p[0][0] = ScoreNotEvaluated;
+                else
+                    (ss+ply-1)->currentMove = game.moves[ply-1];
+                diffScores.push_back(evaluateWithoutHash(p, ss+ply));
+                diffRaws.push_back(toRaw((ss+ply)->staticEvalRaw));
+            });
+    report("diff", t.elapsed(), baseElapsed);
+
+    // 評価値のハッシュテーブルを空にしてから 2 回評価する。1 回目はほぼ全てミス、2 回目はほぼ全てヒットする。
+    Searcher* s = pos.searcher();
+    g_evalTable.clear();
+    s->threads.clearEvalHashShards();
+    s->threads.resetEvalHashStats();
+    for (auto* scores : {&missScores, &hitScores}) {
+        t.restart();
+        for (auto& game : games)
+            replayBenchGame(pos, game, [&](Position& p, const int) {
+                    (ss-1)->staticEvalRaw.p[0][0] = ScoreNotEvaluated;
+                    ss->staticEvalRaw.p[0][0] = ScoreNotEvaluated;
+                    scores->push_back(evaluate(p, ss));
+                });
+        report(scores == &missScores ? "eval hash (1st, store)" : "eval hash (2nd, probe)", t.elapsed(), baseElapsed);
+    }
+    const s64 hits = s->threads.evalHashHits();
+    const s64 misses = s->threads.evalHashMisses();
+    std::cout << "eval hash hits: " << hits << ", misses: " << misses << std::endl;
+
+    // evaluateBatch() は局面を並べておく必要があるので、局面のコピーを作ってからその部分だけ計る。
+    {
+        const std::vector<Position> positions = collectBenchPositions(pos, games, positionNum);
+        std::vector<const Position*> ps;
+        for (auto& p : positions)
+            ps.push_back(&p);
+        t.restart();
+        evaluateBatch(ps.data(), ps.size(), batchScores.data());
+        report("batch", t.elapsed(), 0);
+    }
+
+    // SIMD を使う各経路の結果を SIMD を使わない計算と突き合わせる。
+    s64 mismatches = 0;
+    size_t index = 0;
+    for (auto& game : games) {
+        replayBenchGame(pos, game, [&](Position& p, const int ply) {
+                const Score ref = scalarScores[index];
+                const bool ok = (fullScores[index] == ref && diffScores[index] == ref
+                                 && missScores[index] == ref && hitScores[index] == ref
+                                 && batchScores[index] == ref && fullRaws[index] == diffRaws[index]);
+                if (!ok && mismatches++ < 10) {
+                    std::cout << "mismatch: " << game.position << " ply " << ply << " " << p.toSFEN()
+                              << "\n    scalar " << ref << ", full " << fullScores[index] << ", diff " << diffScores[index]
+                              << ", hash " << missScores[index] << " " << hitScores[index]
+                              << ", batch " << batchScores[index] << std::endl;
+                }
+                ++index;
+            });
+    }
+    reportMismatches(mismatches);
+    if (dummy == -1) std::cout << std::endl; // dummy の計算を消させない為。
+}
+
+namespace {
+    // 以前の実装と同じく BitStream で 1 bit ずつ読み書きし、std::unordered_map で符号を引く参照実装。
+    // 表引きの実装と結果が bit 単位で一致することの確認と、速度の比較に使う。
+    struct ReferenceHuffmanDecoded {
+        Color turn;
+        Piece board[SquareNum];
+        Hand hand[ColorNum];
+    };
+
+    u16 huffmanCodeKey(const HuffmanCode hc) { return static_cast<u16>(hc.code | (hc.numOfBits << 8)); }
+
+    HuffmanCodedPos referenceHuffmanEncode(const Position& pos) {
+        HuffmanCodedPos result;
+        result.clear();
+        BitStream bs(result.data);
+        bs.putBit(pos.turn());
+        bs.putBits(pos.kingSquare(Black), 7);
+        bs.putBits(pos.kingSquare(White), 7);
+        for (Square sq = SQ11; sq < SquareNum; ++sq) {
+            const Piece pc = pos.piece(sq);
+            if (pieceToPieceType(pc) == King)
+                continue;
+            const auto hc = HuffmanCodedPos::boardCodeTable[pc];
+            bs.putBits(hc.code, hc.numOfBits);
+        }
+        for (Color c = Black; c < ColorNum; ++c) {
+            const Hand h = pos.hand(c);
+            for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp) {
+                const auto hc = HuffmanCodedPos::handCodeTable[hp][c];
+                for (u32 n = 0; n < h.numOf(hp); ++n)
+                    bs.putBits(hc.code, hc.numOfBits);
+            }
+        }
+        result.ply = pos.gamePly();
+        return result;
+    }
+
+    bool referenceHuffmanDecode(const HuffmanCodedPos& hcp, ReferenceHuffmanDecoded& result) {
+        static std::unordered_map<u16, Piece> boardCodeToPiece;
+        static std::unordered_map<u16, Piece> handCodeToPiece;
+        if (boardCodeToPiece.empty()) {
+            for (Piece pc = Empty; pc < PieceNone; ++pc)
+                if (HuffmanCodedPos::boardCodeTable[pc].numOfBits != 0)
+                    boardCodeToPiece[huffmanCodeKey(HuffmanCodedPos::boardCodeTable[pc])] = pc;
+            for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp)
+                for (Color c = Black; c < ColorNum; ++c)
+                    handCodeToPiece[huffmanCodeKey(HuffmanCodedPos::handCodeTable[hp][c])] = colorAndPieceTypeToPiece(c, handPieceToPieceType(hp));
+        }
+        auto decode = [](BitStream& bs, const std::unordered_map<u16, Piece>& codeToPiece) {
+            HuffmanCode hc = {0, 0};
+            while (hc.numOfBits <= 8) {
+                hc.code |= bs.getBit() << hc.numOfBits++;
+                const auto it = codeToPiece.find(huffmanCodeKey(hc));
+                if (it != std::end(codeToPiece))
+                    return it->second;
+            }
+            return PieceNone;
+        };
+
+        HuffmanCodedPos tmp = hcp;
+        BitStream bs(tmp.data);
+        result.turn = static_cast<Color>(bs.getBit());
+        std::fill(std::begin(result.board), std::end(result.board), Empty);
+        result.hand[Black] = result.hand[White] = Hand(0);
+        result.board[bs.getBits(7)] = BKing;
+        result.board[bs.getBits(7)] = WKing;
+        for (Square sq = SQ11; sq < SquareNum; ++sq) {
+            if (pieceToPieceType(result.board[sq]) == King)
+                continue;
+            const Piece pc = decode(bs, boardCodeToPiece);
+            if (pc == PieceNone)
+                return false;
+            result.board[sq] = pc;
+        }
+        while (bs.data() != std::end(tmp.data)) {
+            const Piece pc = decode(bs, handCodeToPiece);
+            if (pc == PieceNone)
+                return false;
+            result.hand[pieceToColor(pc)].plusOne(pieceTypeToHandPiece(pieceToPieceType(pc)));
+        }
+        return true;
+    }
+}
+
+// HuffmanCodedPos の符号化と復号の速度を計測し、参照実装と結果が一致するか確認する。
+// bench_hcp [games] [plies] [seed]
+void benchmarkHuffmanCodedPos(Position& pos, std::istringstream& ssCmd) {
+    size_t positionNum;
+    const std::vector<BenchGame> games = readBenchGames(pos, ssCmd, positionNum);
+    const std::vector<Position> positions = collectBenchPositions(pos, games, positionNum);
+    std::vector<HuffmanCodedPos> hcps;
+    std::vector<HuffmanCodedPos> refHcps;
+    hcps.reserve(positionNum);
+    refHcps.reserve(positionNum);
+    for (auto& p : positions) {
+        hcps.push_back(p.toHuffmanCodedPos());
+        refHcps.push_back(referenceHuffmanEncode(p));
+    }
+    std::cout << "positions: " << positionNum << std::endl;
+
+    // 符号化、復号の結果を参照実装と突き合わせる。
+    s64 mismatches = 0;
+    resetBenchPosition(pos); // replayBenchGame() の StateInfo は解放済みなので、コピーする前に戻しておく。
+    Position decoded(pos);
+    ReferenceHuffmanDecoded ref;
+    for (size_t i = 0; i < hcps.size(); ++i) {
+        bool ok = (std::memcmp(hcps[i].data, refHcps[i].data, sizeof(hcps[i].data)) == 0 && hcps[i].ply == refHcps[i].ply);
+        ok = ok && decoded.set(hcps[i], pos.searcher()->threads.main()) && referenceHuffmanDecode(hcps[i], ref);
+        if (ok) {
+            ok = (decoded.turn() == ref.turn && decoded.gamePly() == hcps[i].ply
+                  && decoded.hand(Black) == ref.hand[Black] && decoded.hand(White) == ref.hand[White]);
+            for (Square sq = SQ11; sq < SquareNum; ++sq)
+                ok = ok && decoded.piece(sq) == ref.board[sq];
+            ok = ok && decoded.toHuffmanCodedPos().ply == hcps[i].ply
+                && std::memcmp(decoded.toHuffmanCodedPos().data, hcps[i].data, sizeof(hcps[i].data)) == 0;
+        }
+        if (!ok && mismatches++ < 10)
+            std::cout << "mismatch: index " << i << std::endl;
+    }
+    reportMismatches(mismatches);
+
+    const int loop = 10;
+    u64 dummy = 0;
+
+    Timer t = Timer::currentTime();
+    for (int l = 0; l < loop; ++l)
+        for (auto& p : positions)
+            dummy += p.toHuffmanCodedPos().data[l & 31];
+    reportRate("encode (table)", positionNum * loop, t.elapsed(), "positions");
+
+    t.restart();
+    for (int l = 0; l < loop; ++l)
+        for (auto& p : positions)
+            dummy += referenceHuffmanEncode(p).data[l & 31];
+    reportRate("encode (reference)", positionNum * loop, t.elapsed(), "positions");
+
+    t.restart();
+    for (int l = 0; l < loop; ++l)
+        for (auto& hcp : hcps)
+            dummy += decoded.set(hcp, pos.searcher()->threads.main());
+    reportRate("Position::set(hcp)", positionNum * loop, t.elapsed(), "positions");
+
+    t.restart();
+    for (int l = 0; l < loop; ++l)
+        for (auto& hcp : hcps)
+            dummy += referenceHuffmanDecode(hcp, ref);
+    reportRate("decode only (reference)", positionNum * loop, t.elapsed(), "positions");
+
+    if (dummy == 1) std::cout << std::endl; // dummy の計算を消させない為。
+}
+
+namespace {
+    // std::stringstream で組み立てる、SFEN 文字列の参照実装。
+    std::string referenceSFEN(const Position& pos, const Ply ply) {
+        const char* pieceToCharUSI[PieceNone] = {
+            "", "P", "L", "N", "S", "B", "R", "G", "K", "+P", "+L", "+N", "+S", "+B", "+R", "", "",
+            "p", "l", "n", "s", "b", "r", "g", "k", "+p", "+l", "+n", "+s", "+b", "+r"
+        };
+        std::stringstream ss;
+        int space = 0;
+        for (Rank rank = Rank1; rank != Rank9Wall; rank += RankDeltaS) {
+            for (File file = File9; file != File1Wall; file += FileDeltaE) {
+                const Piece pc = pos.piece(makeSquare(file, rank));
+                if (pc == Empty)
+                    ++space;
+                else {
+                    if (space)
+                        ss << space;
+                    space = 0;
+                    ss << pieceToCharUSI[pc];
+                }
+            }
+            if (space)
+                ss << space;
+            space = 0;
+            if (rank != Rank9)
+                ss << "/";
+        }
+        ss << (pos.turn() == Black ? " b " : " w ");
+        std::string hand;
+        for (Color color = Black; color < ColorNum; ++color) {
+            for (HandPiece hp : {HRook, HBishop, HGold, HSilver, HKnight, HLance, HPawn}) {
+                const int num = pos.hand(color).numOf(hp);
+                if (num == 0)
+                    continue;
+                if (num != 1)
+                    hand += std::to_string(num);
+                hand += pieceToCharUSI[colorAndHandPieceToPiece(color, hp)];
+            }
+        }
+        ss << (hand.empty() ? "-" : hand) << " " << ply;
+        return ss.str();
+    }
+
+    // 以前の実装と同じく std::istringstream から 1 文字ずつ読み、std::map で駒を引く、SFEN 文字列の読み込みの参照実装。
+    // 局面は作らず盤面、手番、持ち駒、手数だけを読むので、以前の Position::set() より軽い。
+    struct ReferenceSFENDecoded {
+        Color turn;
+        Piece board[SquareNum];
+        Hand hand[ColorNum];
+        Ply ply;
+    };
+
+    const std::map<char, Piece>& referenceCharToPieceUSI() {
+        static const std::map<char, Piece> charToPiece = {
+            {'P', BPawn}, {'L', BLance}, {'N', BKnight}, {'S', BSilver}, {'B', BBishop}, {'R', BRook}, {'G', BGold}, {'K', BKing},
+            {'p', WPawn}, {'l', WLance}, {'n', WKnight}, {'s', WSilver}, {'b', WBishop}, {'r', WRook}, {'g', WGold}, {'k', WKing}
+        };
+        return charToPiece;
+    }
+
+    bool referenceReadSFEN(const std::string& sfen, ReferenceSFENDecoded& result) {
+        const std::map<char, Piece>& charToPiece = referenceCharToPieceUSI();
+        std::istringstream ss(sfen);
+        char token;
+        Piece promoteFlag = UnPromoted;
+        Square sq = SQ91;
+        std::fill(std::begin(result.board), std::end(result.board), Empty);
+        result.hand[Black] = result.hand[White] = Hand(0);
+
+        while (ss.get(token) && token != ' ') {
+            if (isdigit(token))
+                sq += DeltaE * (token - '0');
+            else if (token == '/')
+                sq += (DeltaW * 9) + DeltaS;
+            else if (token == '+')
+                promoteFlag = Promoted;
+            else if (charToPiece.find(token) != std::end(charToPiece) && isInSquare(sq)) {
+                result.board[sq] = charToPiece.find(token)->second + promoteFlag;
+                promoteFlag = UnPromoted;
+                sq += DeltaE;
+            }
+            else
+                return false;
+        }
+        while (ss.get(token) && token != ' ') {
+            if (token == 'b')
+                result.turn = Black;
+            else if (token == 'w')
+                result.turn = White;
+            else
+                return false;
+        }
+        for (int digits = 0; ss.get(token) && token != ' '; ) {
+            if (token == '-')
+                continue;
+            else if (isdigit(token))
+                digits = digits * 10 + token - '0';
+            else if (charToPiece.find(token) != std::end(charToPiece)) {
+                const Piece pc = charToPiece.find(token)->second;
+                const HandPiece hp = pieceTypeToHandPiece(pieceToPieceType(pc));
+                for (int i = 0; i < (digits == 0 ? 1 : digits); ++i)
+                    result.hand[pieceToColor(pc)].plusOne(hp);
+                digits = 0;
+            }
+            else
+                return false;
+        }
+        result.ply = 0;
+        ss >> result.ply;
+        return true;
+    }
+
+    // 以前の実装と同じく、std::string の指し手を添字で読む USI 形式の指し手の参照実装。
+    Move referenceUSIToMove(const Position& pos, const std::string& moveStr) {
+        const std::map<char, Piece>& charToPiece = referenceCharToPieceUSI();
+        Move move;
+        if (charToPiece.find(moveStr[0]) != std::end(charToPiece)) {
+            const PieceType ptTo = pieceToPieceType(charToPiece.find(moveStr[0])->second);
+            if (moveStr[1] != '*')
+                return Move::moveNone();
+            const File toFile = charUSIToFile(moveStr[2]);
+            const Rank toRank = charUSIToRank(moveStr[3]);
+            if (!isInSquare(toFile, toRank))
+                return Move::moveNone();
+            move = makeDropMove(ptTo, makeSquare(toFile, toRank));
+        }
+        else {
+            const File fromFile = charUSIToFile(moveStr[0]);
+            const Rank fromRank = charUSIToRank(moveStr[1]);
+            if (!isInSquare(fromFile, fromRank))
+                return Move::moveNone();
+            const Square from = makeSquare(fromFile, fromRank);
+            const File toFile = charUSIToFile(moveStr[2]);
+            const Rank toRank = charUSIToRank(moveStr[3]);
+            if (!isInSquare(toFile, toRank))
+                return Move::moveNone();
+            const Square to = makeSquare(toFile, toRank);
+            if (moveStr[4] == '\0')
+                move = makeNonPromoteMove<Capture>(pieceToPieceType(pos.piece(from)), from, to, pos);
+            else if (moveStr[4] == '+') {
+                if (moveStr[5] != '\0')
+                    return Move::moveNone();
+                move = makePromoteMove<Capture>(pieceToPieceType(pos.piece(from)), from, to, pos);
+            }
+            else
+                return Move::moveNone();
+        }
+
+        if (pos.moveIsPseudoLegal<false>(move)
+            && pos.pseudoLegalMoveIsLegal<false, false>(move, pos.pinnedBB()))
+        {
+            return move;
+        }
+        return Move::moveNone();
+    }
+
+    // 以前の実装と同じく、std::istringstream から語を 1 つずつ取り出す position コマンドの参照実装。
+    void referenceSetPosition(Position& pos, std::istringstream& ssCmd) {
+        std::string token;
+        std::string sfen;
+        ssCmd >> token;
+        if (token == "startpos") {
+            sfen = DefaultStartPositionSFEN;
+            ssCmd >> token; // "moves" が入力されるはず。
+        }
+        else if (token == "sfen") {
+            while (ssCmd >> token && token != "moves")
+                sfen += token + " ";
+        }
+        else
+            return;
+
+        // SFEN は 1 棋譜に 1 回しか読まないので、今の Position::set() を使う。
+        pos.set(sfen, pos.searcher()->threads.main());
+        pos.searcher()->states = StateListPtr(new std::deque<StateInfo>(1));
+        Ply currentPly = pos.gamePly();
+        while (ssCmd >> token) {
+            const Move move = referenceUSIToMove(pos, token);
+            if (!move) break;
+            pos.searcher()->states->emplace_back();
+            pos.doMove(move, pos.searcher()->states->back());
+            ++currentPly;
+        }
+        pos.setStartPosPly(currentPly);
+    }
+}
+
+// SFEN 文字列の読み書きと、position コマンドの棋譜の読み込みの速度を計測し、結果を確認する。
+// bench_sfen [games] [plies] [seed]
+// 書いた SFEN が参照実装と一致し、読み直した局面が元の局面と一致するか確認する。
+// 棋譜の読み込みは、各棋譜を "sfen ... moves ..." の position コマンドにして最後の局面まで進める。
+// 速度は、以前の実装と同じく std::istringstream と std::map で読む参照実装と比べる。
+void benchmarkSFEN(Position& pos, std::istringstream& ssCmd) {
+    size_t positionNum;
+    const std::vector<BenchGame> games = readBenchGames(pos, ssCmd, positionNum);
+    const std::vector<Position> positions = collectBenchPositions(pos, games, positionNum);
+    std::vector<HuffmanCodedPos> hcps;
+    std::vector<std::string> sfens;
+    hcps.reserve(positionNum);
+    sfens.reserve(positionNum);
+    for (auto& p : positions) {
+        hcps.push_back(p.toHuffmanCodedPos());
+        sfens.push_back(referenceSFEN(p, p.gamePly()));
+    }
+    // 全局面の SFEN を改行区切りで 1 つの文字列に並べておく。大量の局面を一括で読む時の形。
+    std::string sfenText;
+    for (auto& sfen : sfens)
+        sfenText += sfen + "\n";
+    // 各棋譜の position コマンドの引数。
+    std::vector<std::string> commands;
+    size_t moveNum = 0;
+    for (auto& game : games) {
+        std::istringstream ss(game.position);
+        setPosition(pos, ss);
+        std::string command = "sfen " + referenceSFEN(pos, pos.gamePly()) + " moves";
+        for (const Move move : game.moves)
+            command += " " + move.toUSI();
+        commands.push_back(command);
+        moveNum += game.moves.size();
+    }
+    std::cout << "positions: " << positionNum << ", moves: " << moveNum << std::endl;
+
+    s64 mismatches = 0;
+    Position decoded(pos);
+    auto samePosition = [](const Position& p, const HuffmanCodedPos& hcp) {
+        return p.gamePly() == hcp.ply && std::memcmp(p.toHuffmanCodedPos().data, hcp.data, sizeof(hcp.data)) == 0;
+    };
+    for (size_t i = 0; i < positions.size(); ++i) {
+        char buf[MaxSFENLength];
+        bool ok = (std::string(buf, positions[i].writeSFEN(buf, positions[i].gamePly())) == sfens[i]);
+        ok = ok && positions[i].toSFEN() == "sfen " + sfens[i];
+        ok = ok && decoded.set(sfens[i].data(), sfens[i].data() + sfens[i].size(), pos.searcher()->threads.main());
+        ok = ok && samePosition(decoded, hcps[i]) && decoded.getKey() == positions[i].getKey();
+        ReferenceSFENDecoded ref;
+        ok = ok && referenceReadSFEN(sfens[i], ref) && ref.turn == positions[i].turn() && ref.ply == positions[i].gamePly();
+        for (Square sq = SQ11; ok && sq < SquareNum; ++sq)
+            ok = (ref.board[sq] == positions[i].piece(sq));
+        for (Color c = Black; ok && c < ColorNum; ++c)
+            ok = (ref.hand[c].value() == positions[i].hand(c).value());
+        if (!ok && mismatches++ < 10)
+            std::cout << "mismatch: " << sfens[i] << std::endl;
+    }
+    size_t positionIndex = 0;
+    for (size_t g = 0; g < games.size(); ++g) {
+        positionIndex += games[g].moves.size() + 1;
+        // setPosition() は指した手の数だけ手数を進めるが、replayBenchGame() の局面は手数を進めないので、手数は比べない。
+        auto sameLastPosition = [&] {
+            return std::memcmp(pos.toHuffmanCodedPos().data, hcps[positionIndex - 1].data, sizeof(hcps[0].data)) == 0
+                && pos.getKey() == positions[positionIndex - 1].getKey();
+        };
+        setPosition(pos, commands[g].data(), commands[g].data() + commands[g].size());
+        bool ok = sameLastPosition();
+        std::istringstream ss(commands[g]);
+        referenceSetPosition(pos, ss);
+        ok = ok && sameLastPosition();
+        if (!ok && mismatches++ < 10)
+            std::cout << "mismatch: position " << commands[g] << std::endl;
+    }
+    reportMismatches(mismatches);
+
+    const int loop = 10;
+    u64 dummy = 0;
+
+    Timer t = Timer::currentTime();
+    for (int l = 0; l < loop; ++l)
+        for (auto& p : positions)
+            dummy += referenceSFEN(p, p.gamePly()).size();
+    reportRate("write (reference)", positionNum * loop, t.elapsed(), "positions");
+
+    t.restart();
+    for (int l = 0; l < loop; ++l)
+        for (auto& p : positions)
+            dummy += p.toSFEN().size();
+    reportRate("toSFEN()", positionNum * loop, t.elapsed(), "positions");
+
+    t.restart();
+    {
+        std::vector<char> buf(positionNum * MaxSFENLength);
+        for (int l = 0; l < loop; ++l) {
+            char* p = &buf[0];
+            for (auto& position : positions) {
+                p = position.writeSFEN(p, position.gamePly());
+                *p++ = '\n';
+            }
+            dummy += p - &buf[0];
+        }
+    }
+    reportRate("writeSFEN()", positionNum * loop, t.elapsed(), "positions");
+
+    t.restart();
+    for (int l = 0; l < loop; ++l)
+        for (auto& sfen : sfens) {
+            ReferenceSFENDecoded ref;
+            referenceReadSFEN(sfen, ref);
+            dummy += ref.ply;
+        }
+    reportRate("read (reference)", positionNum * loop, t.elapsed(), "positions");
+
+    t.restart();
+    for (int l = 0; l < loop; ++l) {
+        const char* first = sfenText.data();
+        const char* const end = first + sfenText.size();
+        while (first != end) {
+            const char* last = std::find(first, end, '\n');
+            decoded.set(first, last, pos.searcher()->threads.main());
+            dummy += decoded.getKey();
+            first = last + 1;
+        }
+    }
+    reportRate("set(char*, char*)", positionNum * loop, t.elapsed(), "positions");
+
+    // 棋譜の読み込みは速く終わるので、多めに繰り返す。
+    const int commandLoop = loop * 10;
+    t.restart();
+    for (int l = 0; l < commandLoop; ++l)
+        for (auto& command : commands) {
+            std::istringstream ss(command);
+            referenceSetPosition(pos, ss);
+            dummy += pos.getKey();
+        }
+    reportRate("position (reference)", moveNum * commandLoop, t.elapsed(), "moves");
+
+    t.restart();
+    for (int l = 0; l < commandLoop; ++l)
+        for (auto& command : commands) {
+            setPosition(pos, command.data(), command.data() + command.size());
+            dummy += pos.getKey();
+        }
+    reportRate("position (char*, char*)", moveNum * commandLoop, t.elapsed(), "moves");
+
+    if (dummy == 1) std::cout << std::endl; // dummy の計算を消させない為。
+}
+
+namespace {
+    // depth 手で到達する局面の数を数える。不成も含めた全ての合法手(LegalAll)を使う。
+    // BULK が true なら末端の局面は指し手の数を数えるだけにし、false なら末端でも doMove(), undoMove() を行う。
+    template <bool BULK>
+    s64 perft(Position& pos, const int depth) {
+        if (depth <= 0)
+            return 1;
+        MoveList<LegalAll> ml(pos);
+        if (BULK && depth == 1)
+            return static_cast<s64>(ml.size());
+        s64 nodes = 0;
+        StateInfo st;
+        for (const ExtMove* it = ml.begin(); it != ml.begin() + ml.size(); ++it) {
+            pos.doMove(it->move, st);
+            nodes += (depth == 1 ? 1 : perft<BULK>(pos, depth - 1));
+            pos.undoMove(it->move);
+        }
+        return nodes;
+    }
+}
+
+// 指し手生成と doMove(), undoMove() の速度を perft で計測する。
+// bench_perft [depth] [full]
+// 平手の初期局面と benchmark.sfen の各局面について depth 手の perft を行う。
+// full を付けると末端の局面でも doMove(), undoMove() を行うので、局面の更新の速度を主に測る。
+// 平手の初期局面は既知の値と比較するので、ビルドの種類(bmi2, sse, nosse 等)による結果の違いを確認出来る。
+void benchmarkPerft(Position& pos, std::istringstream& ssCmd) {
+    int depth = 3;
+    std::string mode;
+    ssCmd >> depth >> mode;
+    depth = std::max(1, depth);
+    const bool full = (mode == "full");
+    const s64 startposPerft[] = {1, 30, 900, 25470, 719731, 19861490};
+
+    s64 totalNodes = 0;
+    bool ok = true;
+    Timer t = Timer::currentTime();
+    for (auto& root : benchRoots()) {
+        std::istringstream ss(root);
+        setPosition(pos, ss);
+        const s64 nodes = (full ? perft<false>(pos, depth) : perft<true>(pos, depth));
+        totalNodes += nodes;
+        std::cout << "perft " << depth << " = " << std::setw(12) << nodes << " : " << root;
+        if (root == "startpos" && depth < static_cast<int>(sizeof(startposPerft) / sizeof(startposPerft[0]))) {
+            ok = (nodes == startposPerft[depth]);
+            std::cout << (ok ? " (ok)" : " (NG)");
+        }
+        std::cout << std::endl;
+    }
+    const int elapsed = t.elapsed();
+    std::cout << "nodes = " << totalNodes << ", elapsed = " << elapsed << " [msec], "
+              << (elapsed ? totalNodes * 1000 / elapsed : 0) << " [nodes/sec]" << (ok ? "" : ", startpos NG") << std::endl;
+}
+
+// 探索の速度を計測する。
+// bench_search [depth]
+// 平手の初期局面と benchmark.sfen の各局面を、1 スレッドで置換表を空にしてから depth まで探索し、
+// 探索局面数の合計と、1 秒あたりの探索局面数を表示する。探索局面数は同じビルドなら毎回同じになる。
+void benchmarkSearch(Position& pos, std::istringstream& ssCmd) {
+    int depth = 12;
+    ssCmd >> depth;
+    std::string options[] = {"name Threads value 1",
+                             "name MultiPV value 1",
+                             "name OwnBook value false",
+                             "name Max_Random_Score_Diff value 0"};
+    for (auto& str : options) {
+        std::istringstream is(str);
+        pos.searcher()->setOption(is);
+    }
+
+    s64 totalNodes = 0;
+    int totalElapsed = 0;
+    for (auto& root : benchRoots()) {
+        std::istringstream ss(root);
+        setPosition(pos, ss);
+        pos.searcher()->tt.clear();
+        Timer t = Timer::currentTime();
+        std::istringstream ssGo("depth " + std::to_string(depth));
+        go(pos, ssGo);
+        pos.searcher()->threads.main()->waitForSearchFinished();
+        totalElapsed += t.elapsed();
+        totalNodes += pos.searcher()->threads.nodesSearched();
+    }
+    std::cout << "nodes = " << totalNodes << ", elapsed = " << totalElapsed << " [msec], "
+              << (totalElapsed ? totalNodes * 1000 / totalElapsed : 0) << " [nodes/sec]" << std::endl;
+}
+
+// 定跡を探索中に使う時と使わない時で、各局面を固定の深さで探索した結果を比べる。
+// 点数を持たない定跡は探索で使わないので、その時は最善手と点数が変わらない筈である。
+// bench_book_search [定跡ファイル] [depth] [Book_In_Search_Depth]
+void benchmarkBookInSearch(Position& pos, std::istringstream& ssCmd) {
+    std::string fileName = pos.searcher()->options["Book_File"];
+    int depth = 10;
+    int bookDepth = pos.searcher()->options["Book_In_Search_Depth"];
+    ssCmd >> fileName >> depth >> bookDepth;
+    std::string options[] = {"name Threads value 1",
+                             "name MultiPV value 1",
+                             "name OwnBook value false",
+                             "name Max_Random_Score_Diff value 0"};
+    for (auto& str : options) {
+        std::istringstream is(str);
+        pos.searcher()->setOption(is);
+    }
+
+    Book book;
+    if (!book.open(fileName)) {
+        std::cout << "Error: cannot open book file " << fileName << std::endl;
+        return;
+    }
+    BookHash bookHash;
+    const Ply maxPly = std::min<int>(pos.searcher()->options["Max_Book_Ply"], MaxPly);
+    const size_t num = bookHash.init(book, pos, maxPly, static_cast<Depth>(bookDepth * OnePly));
+    std::cout << "book positions: " << num << std::endl;
+
+    auto search = [&](const std::string& root) {
+        std::istringstream ss(root);
+        setPosition(pos, ss);
+        pos.searcher()->clear(); // 前の探索の置換表や history が結果を変えないようにする。
+        std::istringstream ssGo("depth " + std::to_string(depth));
+        go(pos, ssGo);
+        pos.searcher()->threads.main()->waitForSearchFinished();
+        return pos.searcher()->threads.main()->rootMoves[0];
+    };
+    s64 changed = 0;
+    for (auto& root : benchRoots()) {
+        const RootMove withoutBook = search(root);
+        std::swap(pos.searcher()->bookHash, bookHash);
+        const RootMove withBook = search(root);
+        std::swap(pos.searcher()->bookHash, bookHash);
+        const bool same = (withoutBook.pv[0] == withBook.pv[0] && withoutBook.score == withBook.score);
+        changed += !same;
+        std::cout << "without book: " << withoutBook.pv[0].toUSI() << " " << withoutBook.score
+                  << ", with book: " << withBook.pv[0].toUSI() << " " << withBook.score
+                  << (same ? "" : " (changed)") << std::endl;
+    }
+    std::cout << "changed: " << changed;
+    if (num == 0)
+        std::cout << (changed == 0 ? " (ok)" : " (NG)");
+    std::cout << std::endl;
+}
+
+namespace {
+    // 擬似合法手を生成してから 1 手ずつ pseudoLegalMoveIsLegal() で調べる、合法手生成の参照実装。
+    // ALL == true なら LegalAll の参照実装で、歩、飛、角の不成、香の2段目の不成、香の3段目の駒を取らない不成を、
+    // 生成した成る手から作って、まだ無ければ加える。(Evasion はこれらを生成しない。)
+    template <bool ALL>
+    ExtMove* referenceLegalMoves(ExtMove* moveList, const Position& pos) {
+        ExtMove* last = (pos.inCheck() ? generateMoves<Evasion>(moveList, pos) : generateMoves<NonEvasion>(moveList, pos));
+        if (ALL) {
+            const Color us = pos.turn();
+            for (ExtMove* it = moveList, * promoLast = last; it != promoLast; ++it) {
+                const Move move = it->move;
+                if (move.isDrop() || !move.isPromotion())
+                    continue;
+                const Rank toRank = makeRank(move.to());
+                const int relativeRank = (us == Black ? toRank - Rank1 : Rank9 - toRank); // 1段目が 0
+                const PieceType pt = move.pieceTypeFrom();
+                const bool add = (pt == Pawn ? relativeRank != 0 :
+                                  pt == Lance ? relativeRank == 1 || (relativeRank == 2 && !move.isCapture()) :
+                                  pt == Bishop || pt == Rook);
+                const Move nonPromote = Move(move.value() & ~Move::PromoteFlag);
+                if (add && std::none_of(moveList, last, [nonPromote](const ExtMove& m) { return m.move == nonPromote; }))
+                    (*last++).move = nonPromote;
+            }
+        }
+        const Bitboard pinned = pos.pinnedBB();
+        ExtMove* curr = moveList;
+        while (curr != last) {
+            if (!pos.pseudoLegalMoveIsLegal<false, false>(curr->move, pinned))
+                curr->move = (--last)->move;
+            else
+                ++curr;
+        }
+        return last;
+    }
+}
+
+// 合法手生成の速度を計測し、参照実装と生成する指し手の集合が一致するか確認する。LegalAll も参照実装と比べる。
+// bench_movegen [games] [plies] [seed]
+void benchmarkMoveGeneration(Position& pos, std::istringstream& ssCmd) {
+    size_t positionNum;
+    const std::vector<BenchGame> games = readBenchGames(pos, ssCmd, positionNum);
+    const std::vector<Position> positions = collectBenchPositions(pos, games, positionNum);
+    std::cout << "positions: " << positionNum << std::endl;
+
+    s64 mismatches = 0;
+    ExtMove legal[MaxLegalMoves];
+    ExtMove ref[MaxLegalMoves];
+    for (size_t i = 0; i < positions.size(); ++i) {
+        const ExtMove* legalLast = generateMoves<Legal>(legal, positions[i]);
+        const ExtMove* refLast = referenceLegalMoves<false>(ref, positions[i]);
+        if (!sameMoveSet(legal, legalLast, ref, refLast) && mismatches++ < 10)
+            std::cout << "mismatch: " << positions[i].toSFEN() << std::endl;
+        legalLast = generateMoves<LegalAll>(legal, positions[i]);
+        refLast = referenceLegalMoves<true>(ref, positions[i]);
+        if (!sameMoveSet(legal, legalLast, ref, refLast) && mismatches++ < 10)
+            std::cout << "mismatch (LegalAll): " << positions[i].toSFEN() << std::endl;
+    }
+    reportMismatches(mismatches);
+
+    const int loop = 20;
+    s64 moves = 0;
+    Timer t = Timer::currentTime();
+    for (int l = 0; l < loop; ++l)
+        for (auto& p : positions)
+            moves += generateMoves<Legal>(legal, p) - legal;
+    reportRate("Legal", positionNum * loop, t.elapsed(), "positions", ", moves = " + std::to_string(moves));
+
+    moves = 0;
+    t.restart();
+    for (int l = 0; l < loop; ++l)
+        for (auto& p : positions)
+            moves += referenceLegalMoves<false>(ref, p) - ref;
+    reportRate("pseudo legal + filter", positionNum * loop, t.elapsed(), "positions", ", moves = " + std::to_string(moves));
+}
+
+namespace {
+    // 駒を取らない手と駒打ちを全て生成してから moveGivesCheck() で調べる、QuietChecks の参照実装。
+    ExtMove* referenceQuietChecks(ExtMove* moveList, const Position& pos) {
+        ExtMove* last = generateMoves<NonCaptureMinusPro>(moveList, pos);
+        last = generateMoves<Drop>(last, pos);
+        const CheckInfo ci(pos);
+        ExtMove* curr = moveList;
+        while (curr != last) {
+            if (!pos.moveGivesCheck(curr->move, ci))
+                curr->move = (--last)->move;
+            else
+                ++curr;
+        }
+        return last;
+    }
+}
+
+// 駒を取らない王手の生成の速度を計測し、参照実装と生成する指し手の集合が一致するか確認する。
+// bench_checks [games] [plies] [seed]
+// 王手が掛かっている局面は QuietChecks の対象外なので除く。
+void benchmarkQuietChecks(Position& pos, std::istringstream& ssCmd) {
+    size_t positionNum;
+    const std::vector<BenchGame> games = readBenchGames(pos, ssCmd, positionNum);
+    const std::vector<Position> positions = collectBenchPositions(pos, games, positionNum, [](const Position& p) { return !p.inCheck(); });
+    std::cout << "positions: " << positions.size() << std::endl;
+
+    s64 mismatches = 0;
+    ExtMove checks[MaxLegalMoves];
+    ExtMove ref[MaxLegalMoves];
+    for (auto& p : positions) {
+        const ExtMove* checksLast = generateMoves<QuietChecks>(checks, p);
+        const ExtMove* refLast = referenceQuietChecks(ref, p);
+        if (!sameMoveSet(checks, checksLast, ref, refLast) && mismatches++ < 10)
+            std::cout << "mismatch: " << p.toSFEN() << std::endl;
+    }
+    reportMismatches(mismatches);
+
+    const int loop = 20;
+    s64 moves = 0;
+    Timer t = Timer::currentTime();
+    for (int l = 0; l < loop; ++l)
+        for (auto& p : positions)
+            moves += generateMoves<QuietChecks>(checks, p) - checks;
+    reportRate("QuietChecks", positions.size() * loop, t.elapsed(), "positions", ", moves = " + std::to_string(moves));
+
+    moves = 0;
+    t.restart();
+    for (int l = 0; l < loop; ++l)
+        for (auto& p : positions)
+            moves += referenceQuietChecks(ref, p) - ref;
+    reportRate("generate + moveGivesCheck", positions.size() * loop, t.elapsed(), "positions", ", moves = " + std::to_string(moves));
+}
+
+namespace {
+    // 定跡ファイルを seekg(), read() で二分探索する、以前の Book::probe() と同じ探索の参照実装。
+    // 以前と同じく、定跡ファイルが key でソート済みである事を前提とする。
+    size_t referenceBookCount(std::ifstream& ifs, const size_t size, const Key key) {
+        size_t low = 0;
+        size_t high = size - 1;
+        BookEntry entry;
+        while (low < high) {
+            const size_t mid = (low + high) / 2;
+            ifs.seekg(mid * sizeof(BookEntry), std::ios_base::beg);
+            ifs.read(reinterpret_cast<char*>(&entry), sizeof(entry));
+            if (key <= entry.key)
+                high = mid;
+            else
+                low = mid + 1;
+        }
+        ifs.seekg(low * sizeof(BookEntry), std::ios_base::beg);
+        size_t count = 0;
+        while (ifs.read(reinterpret_cast<char*>(&entry), sizeof(entry)) && entry.key == key)
+            ++count;
+        ifs.clear();
+        return count;
+    }
+}
+
+// 定跡の検索の速度を計測し、参照実装と見つかる定跡手の数が一致するか確認する。
+// bench_book [file] [loop] [compact file]
+// 定跡にある全ての key と、同じ数の定跡に無い key を検索する。file を省略すると Book_File の定跡を使う。
+// file は book.bin の形式であること。compact file を指定すると、file を convert_book で変換したものとして、
+// 見つかる定跡手が全て一致するか確認し、検索の速度を比べる。
+void benchmarkBook(Position& pos, std::istringstream& ssCmd) {
+    std::string fileName = pos.searcher()->options["Book_File"];
+    int loop = 10;
+    std::string compactFileName;
+    ssCmd >> fileName >> loop >> compactFileName;
+
+    Book book;
+    Timer t = Timer::currentTime();
+    if (!book.open(fileName)) {
+        std::cout << "Error: cannot open book file " << fileName << std::endl;
+        return;
+    }
+    const int openElapsed = t.elapsed();
+    Book compactBook;
+    t.restart();
+    if (!compactFileName.empty() && !compactBook.open(compactFileName)) {
+        std::cout << "Error: cannot open book file " << compactFileName << std::endl;
+        return;
+    }
+    const int compactOpenElapsed = t.elapsed();
+    std::ifstream ifs(fileName.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    const size_t size = static_cast<size_t>(ifs.tellg()) / sizeof(BookEntry);
+    std::vector<Key> keys;
+    {
+        std::vector<BookEntry> entries(size);
+        ifs.seekg(0, std::ios_base::beg);
+        ifs.read(reinterpret_cast<char*>(entries.data()), size * sizeof(BookEntry));
+        for (auto& entry : entries)
+            keys.push_back(entry.key);
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    const size_t existNum = keys.size();
+    std::mt19937_64 mt(0);
+    for (size_t i = 0; i < existNum; ++i)
+        keys.push_back(mt());
+    std::shuffle(keys.begin(), keys.end(), mt);
+    std::cout << "entries: " << size << ", keys: " << existNum << ", open: " << openElapsed << " [msec]";
+    if (!compactFileName.empty())
+        std::cout << ", compact open: " << compactOpenElapsed << " [msec]";
+    std::cout << std::endl;
+
+    BookEntry moves[MaxLegalMoves];
+    BookEntry compactMoves[MaxLegalMoves];
+    s64 mismatches = 0;
+    for (const Key key : keys) {
+        const size_t num = book.find(key, moves);
+        bool ok = (num == referenceBookCount(ifs, size, key));
+        for (size_t i = 0; i < num; ++i)
+            ok = ok && moves[i].key == key;
+        if (!compactFileName.empty()) {
+            ok = ok && compactBook.find(key, compactMoves) == num;
+            for (size_t i = 0; i < num; ++i)
+                ok = ok && std::memcmp(&moves[i], &compactMoves[i], sizeof(BookEntry)) == 0;
+        }
+        if (!ok && mismatches++ < 10)
+            std::cout << "mismatch: key " << key << std::endl;
+    }
+    reportMismatches(mismatches);
+
+    auto report = [&keys](const std::string& name, const s64 num, const s64 elapsedNs) {
+        std::cout << std::left << std::setw(28) << name << std::right
+                  << "elapsed = " << std::setw(6) << elapsedNs / 1000000 << " [msec], "
+                  << std::setw(8) << (num ? elapsedNs / num : 0) << " [nsec/probe]" << std::endl;
+    };
+    size_t dummy = 0;
+    auto benchFind = [&](const std::string& name, const Book& b) {
+        const auto start = std::chrono::steady_clock::now();
+        for (int l = 0; l < loop; ++l)
+            for (const Key key : keys)
+                dummy += b.find(key, moves);
+        report(name, static_cast<s64>(keys.size()) * loop,
+               std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    };
+    benchFind("Book::find()", book);
+    if (!compactFileName.empty())
+        benchFind("Book::find() (compact)", compactBook);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (const Key key : keys)
+        dummy += referenceBookCount(ifs, size, key);
+    report("seekg + read (reference)", static_cast<s64>(keys.size()),
+           std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+    if (dummy == 1) std::cout << std::endl; // dummy の計算を消させない為。
+}
+
+// 学習の勾配の足し込みの速度を、スレッド数毎に計測する。
+// bench_gradient [max threads] [games] [plies] [seed]
+// EvaluatorGradient::incParam() で全てのスレッドから CAS で足し込む場合と、
+// スレッド毎の EvaluatorGradientBuffer に溜めてから区間毎のロックを取って足し込む場合を比べる。
+// 両者が同じ要素に同じ値を足し込むか確認する為、CAS で足した値を EvaluatorGradientBuffer で引いて 0 に戻るか調べる。
+// 勾配 (EvaluatorGradient) を 1 つ確保するので、その分のメモリが必要。
+void benchmarkGradient(Position& pos, std::istringstream& ssCmd) {
+    int maxThreadNum = std::max<int>(1, std::thread::hardware_concurrency());
+    ssCmd >> maxThreadNum;
+    maxThreadNum = std::max(1, maxThreadNum);
+
+    size_t positionNum;
+    const std::vector<BenchGame> games = readBenchGames(pos, ssCmd, positionNum, 100);
+    const std::vector<Position> positions = collectBenchPositions(pos, games, positionNum);
+    auto dinc = [](const size_t i, const float sign) {
+        const std::array<float, 2> d = {{sign * static_cast<float>(static_cast<int>(i % 7) - 3), sign * static_cast<float>(static_cast<int>(i % 5) - 2)}};
+        return d;
+    };
+    std::cout << "positions: " << positionNum << std::endl;
+
+    std::unique_ptr<EvaluatorGradient> grad(new EvaluatorGradient);
+    EvaluatorGradientLocks locks;
+    grad->clear();
+    // threadNum のスレッドで全ての局面の勾配を足し込み、経過時間を返す。
+    // buffered の時はスレッド毎のバッファに溜め、最後に EvaluatorGradientBuffer::mergeAll() で足し込むまでの時間を計る。
+    auto run = [&](const int threadNum, const bool buffered, const float sign) {
+        std::vector<std::unique_ptr<EvaluatorGradientBuffer> > buffers;
+        const int tableShift = EvaluatorGradientBuffer::tableShiftFor((positions.size() + threadNum - 1) / threadNum);
+        if (buffered)
+            for (int i = 0; i < threadNum; ++i)
+                buffers.emplace_back(new EvaluatorGradientBuffer(*grad, locks, EvaluatorGradientLocks::Num * i / threadNum, nullptr, tableShift));
+        std::atomic<size_t> idx(0);
+        auto work = [&](const int threadIndex) {
+            const size_t Chunk = 64;
+            for (size_t first; (first = idx.fetch_add(Chunk)) < positions.size();) {
+                for (size_t i = first; i < std::min(first + Chunk, positions.size()); ++i) {
+                    if (buffered)
+                        buffers[threadIndex]->incParam(positions[i], dinc(i, sign));
+                    else
+                        grad->incParam(positions[i], dinc(i, sign));
+                }
+            }
+        };
+        Timer t = Timer::currentTime();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < threadNum; ++i)
+            threads.emplace_back(work, i);
+        for (auto& th : threads)
+            th.join();
+        if (buffered)
+            EvaluatorGradientBuffer::mergeAll(buffers);
+        return t.elapsed();
+    };
+    auto maxAbs = [&grad] {
+        const float* p = reinterpret_cast<const float*>(grad.get());
+        float m = 0.0f;
+        for (size_t i = 0; i < EvaluatorGradientLocks::FloatNum; ++i)
+            m = std::max(m, std::abs(p[i]));
+        return m;
+    };
+
+    run(1, false, 1.0f);
+    const float maxValue = maxAbs();
+    run(maxThreadNum, true, -1.0f);
+    const float residual = maxAbs();
+    const bool ok = residual <= 1e-4f * std::max(1.0f, maxValue);
+    std::cout << "max |gradient|: " << maxValue << ", max |residual|: " << residual << (ok ? " (ok)" : " (NG)") << std::endl;
+
+    for (int threadNum = 1; ; threadNum = std::min(threadNum * 2, maxThreadNum)) {
+        const int atomicElapsed = run(threadNum, false, 1.0f);
+        const int bufferedElapsed = run(threadNum, true, 1.0f);
+        std::cout << "threads: " << std::setw(3) << threadNum
+                  << ", atomic: " << std::setw(8) << (atomicElapsed ? static_cast<s64>(positionNum) * 1000 / atomicElapsed : 0) << " [positions/sec]"
+                  << ", buffered: " << std::setw(8) << (bufferedElapsed ? static_cast<s64>(positionNum) * 1000 / bufferedElapsed : 0) << " [positions/sec]" << std::endl;
+        if (threadNum == maxThreadNum)
+            break;
+    }
 }
@@ -26,5 +26,15 @@
 
 class Position;
 void benchmark(Position& pos);
+void benchmarkEval(Position& pos, std::istringstream& ssCmd);
+void benchmarkHuffmanCodedPos(Position& pos, std::istringstream& ssCmd);
+void benchmarkSFEN(Position& pos, std::istringstream& ssCmd);
+void benchmarkBook(Position& pos, std::istringstream& ssCmd);
+void benchmarkPerft(Position& pos, std::istringstream& ssCmd);
+void benchmarkSearch(Position& pos, std::istringstream& ssCmd);
+void benchmarkBookInSearch(Position& pos, std::istringstream& ssCmd);
+void benchmarkMoveGeneration(Position& pos, std::istringstream& ssCmd);
+void benchmarkQuietChecks(Position& pos, std::istringstream& ssCmd);
+void benchmarkGradient(Position& pos, std::istringstream& ssCmd);
 
 #endif // #ifndef APERY_BENCHMARK_HPP
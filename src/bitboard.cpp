@@ -246,8 +246,9 @@ const Bitboard InFrontMask[ColorNum][RankNum] = {
     { InFrontOfRank1White, InFrontOfRank2White, InFrontOfRank3White, InFrontOfRank4White, InFrontOfRank5White, InFrontOfRank6White, InFrontOfRank7White, InFrontOfRank8White, InFrontOfRank9White }
 };
 
-// これらは一度値を設定したら二度と変更しない。
-// 本当は const 化したい。
+#if defined GENERATE_ATTACK_TABLES
+// tablegen でテーブルを計算する時だけ使う。
+// 通常のビルドでは、tablegen が生成した const なテーブルの定義を使う。
 #if defined HAVE_BMI2
 Bitboard RookAttack[495616];
 #else
@@ -258,7 +259,7 @@ Bitboard RookBlockMask[SquareNum];
 Bitboard BishopAttack[20224];
 int BishopAttackIndex[SquareNum];
 Bitboard BishopBlockMask[SquareNum];
-Bitboard LanceAttack[ColorNum][SquareNum][128];
+u16 LanceAttackFile[ColorNum][RankNum][128];
 
 Bitboard KingAttack[SquareNum];
 Bitboard GoldAttack[ColorNum][SquareNum];
@@ -278,3 +279,4 @@ Bitboard KnightCheckTable[ColorNum][SquareNum];
 Bitboard LanceCheckTable[ColorNum][SquareNum];
 
 Bitboard Neighbor5x5Table[SquareNum]; // 25 近傍
+#endif
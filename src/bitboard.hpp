@@ -41,10 +41,8 @@ public:
     }
 #endif
     Bitboard() {}
-    Bitboard(const u64 v0, const u64 v1) {
-        this->p_[0] = v0;
-        this->p_[1] = v1;
-    }
+    // constexpr にして、テーブルを定数で初期化出来るようにする。
+    constexpr Bitboard(const u64 v0, const u64 v1) : p_{v0, v1} {}
     u64 p(const int index) const { return p_[index]; }
     void set(const int index, const u64 val) { p_[index] = val; }
     u64 merge() const { return this->p(0) | this->p(1); }
@@ -230,6 +228,7 @@ public:
     static int part(const Square sq) { return static_cast<int>(SQ79 < sq); }
 
 private:
+    friend class Bitboard256;
 #if defined (HAVE_SSE2) || defined (HAVE_SSE4)
     union {
         u64 p_[2];
@@ -247,6 +246,63 @@ inline Bitboard setMaskBB(const Square sq) { return SetMaskBB[sq]; }
 inline Bitboard allOneBB() { return Bitboard(UINT64_C(0x7fffffffffffffff), UINT64_C(0x000000000003ffff)); }
 inline Bitboard allZeroBB() { return Bitboard(0, 0); }
 
+// 独立した 2 つの Bitboard の組。AVX2 が使えるなら 1 命令で 2 つの Bitboard を演算する。
+// 先後の利きや、異なる駒種の利きを同時に計算する為に使う。
+// AVX2 が無い場合は Bitboard 2 つで同じ事をする。
+class Bitboard256 {
+public:
+    Bitboard256() {}
+#if defined HAVE_AVX2
+    // 同じ Bitboard を 2 つ並べる。
+    explicit Bitboard256(const Bitboard& bb) : m_(_mm256_broadcastsi128_si256(bb.m_)) {}
+    Bitboard256(const Bitboard& bb0, const Bitboard& bb1)
+        : m_(_mm256_inserti128_si256(_mm256_castsi128_si256(bb0.m_), bb1.m_, 1)) {}
+    // 連続する 2 つの Bitboard を読み書きする。
+    static Bitboard256 load(const Bitboard* bbs) {
+        Bitboard256 tmp;
+        tmp.m_ = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bbs));
+        return tmp;
+    }
+    void store(Bitboard* bbs) const { _mm256_storeu_si256(reinterpret_cast<__m256i*>(bbs), m_); }
+    Bitboard256& operator &= (const Bitboard256& rhs) { m_ = _mm256_and_si256(m_, rhs.m_); return *this; }
+    Bitboard256& operator |= (const Bitboard256& rhs) { m_ = _mm256_or_si256 (m_, rhs.m_); return *this; }
+    Bitboard256& operator ^= (const Bitboard256& rhs) { m_ = _mm256_xor_si256(m_, rhs.m_); return *this; }
+    Bitboard256& andEqualNot(const Bitboard256& rhs) { m_ = _mm256_andnot_si256(rhs.m_, m_); return *this; }
+    // 2 つの Bitboard を取り出す。
+    void toBitboards(Bitboard& bb0, Bitboard& bb1) const {
+        bb0.m_ = _mm256_castsi256_si128(m_);
+        bb1.m_ = _mm256_extracti128_si256(m_, 1);
+    }
+    // 2 つの Bitboard の or を返す。
+    Bitboard merge() const {
+        Bitboard tmp;
+        tmp.m_ = _mm_or_si128(_mm256_castsi256_si128(m_), _mm256_extracti128_si256(m_, 1));
+        return tmp;
+    }
+#else
+    explicit Bitboard256(const Bitboard& bb) : bb_{bb, bb} {}
+    Bitboard256(const Bitboard& bb0, const Bitboard& bb1) : bb_{bb0, bb1} {}
+    static Bitboard256 load(const Bitboard* bbs) { return Bitboard256(bbs[0], bbs[1]); }
+    void store(Bitboard* bbs) const { bbs[0] = bb_[0]; bbs[1] = bb_[1]; }
+    Bitboard256& operator &= (const Bitboard256& rhs) { bb_[0] &= rhs.bb_[0]; bb_[1] &= rhs.bb_[1]; return *this; }
+    Bitboard256& operator |= (const Bitboard256& rhs) { bb_[0] |= rhs.bb_[0]; bb_[1] |= rhs.bb_[1]; return *this; }
+    Bitboard256& operator ^= (const Bitboard256& rhs) { bb_[0] ^= rhs.bb_[0]; bb_[1] ^= rhs.bb_[1]; return *this; }
+    Bitboard256& andEqualNot(const Bitboard256& rhs) { bb_[0].andEqualNot(rhs.bb_[0]); bb_[1].andEqualNot(rhs.bb_[1]); return *this; }
+    void toBitboards(Bitboard& bb0, Bitboard& bb1) const { bb0 = bb_[0]; bb1 = bb_[1]; }
+    Bitboard merge() const { return bb_[0] | bb_[1]; }
+#endif
+    Bitboard256 operator & (const Bitboard256& rhs) const { return Bitboard256(*this) &= rhs; }
+    Bitboard256 operator | (const Bitboard256& rhs) const { return Bitboard256(*this) |= rhs; }
+    Bitboard256 operator ^ (const Bitboard256& rhs) const { return Bitboard256(*this) ^= rhs; }
+
+private:
+#if defined HAVE_AVX2
+    __m256i m_;
+#else
+    Bitboard bb_[2];
+#endif
+};
+
 extern const int RookBlockBits[SquareNum];
 extern const int BishopBlockBits[SquareNum];
 extern const int RookShiftBits[SquareNum];
@@ -379,44 +435,58 @@ template <Color C, Rank R> inline Bitboard inFrontMask() {
                : /*R == Rank9 ?*/ InFrontOfRank9White));
 }
 
+// 以下のテーブルは tablegen がビルド時に生成したソースファイルで定義する。
 // メモリ節約の為、1次元配列にして無駄が無いようにしている。
 #if defined HAVE_BMI2
-extern Bitboard RookAttack[495616];
+extern TABLE_CONST Bitboard RookAttack[495616];
 #else
-extern Bitboard RookAttack[512000];
+extern TABLE_CONST Bitboard RookAttack[512000];
 #endif
-extern int RookAttackIndex[SquareNum];
+extern TABLE_CONST int RookAttackIndex[SquareNum];
 // メモリ節約の為、1次元配列にして無駄が無いようにしている。
-extern Bitboard BishopAttack[20224];
-extern int BishopAttackIndex[SquareNum];
-extern Bitboard RookBlockMask[SquareNum];
-extern Bitboard BishopBlockMask[SquareNum];
-// メモリ節約をせず、無駄なメモリを持っている。
-extern Bitboard LanceAttack[ColorNum][SquareNum][128];
+extern TABLE_CONST Bitboard BishopAttack[20224];
+extern TABLE_CONST int BishopAttackIndex[SquareNum];
+extern TABLE_CONST Bitboard RookBlockMask[SquareNum];
+extern TABLE_CONST Bitboard BishopBlockMask[SquareNum];
+// 香車の利きは筋の中だけなので、段と筋の 2～8 段目の駒の有無(7bit)から、筋の中の利き(9bit)を引く。
+// 筋の位置には関係しないので、Bitboard で全てのマスについて持つより小さく、キャッシュに収まる。
+extern TABLE_CONST u16 LanceAttackFile[ColorNum][RankNum][128];
 
-extern Bitboard KingAttack[SquareNum];
-extern Bitboard GoldAttack[ColorNum][SquareNum];
-extern Bitboard SilverAttack[ColorNum][SquareNum];
-extern Bitboard KnightAttack[ColorNum][SquareNum];
-extern Bitboard PawnAttack[ColorNum][SquareNum];
+extern TABLE_CONST Bitboard KingAttack[SquareNum];
+extern TABLE_CONST Bitboard GoldAttack[ColorNum][SquareNum];
+extern TABLE_CONST Bitboard SilverAttack[ColorNum][SquareNum];
+extern TABLE_CONST Bitboard KnightAttack[ColorNum][SquareNum];
+extern TABLE_CONST Bitboard PawnAttack[ColorNum][SquareNum];
 
-extern Bitboard BetweenBB[SquareNum][SquareNum];
+extern TABLE_CONST Bitboard BetweenBB[SquareNum][SquareNum];
 
-extern Bitboard RookAttackToEdge[SquareNum];
-extern Bitboard BishopAttackToEdge[SquareNum];
-extern Bitboard LanceAttackToEdge[ColorNum][SquareNum];
+extern TABLE_CONST Bitboard RookAttackToEdge[SquareNum];
+extern TABLE_CONST Bitboard BishopAttackToEdge[SquareNum];
+extern TABLE_CONST Bitboard LanceAttackToEdge[ColorNum][SquareNum];
 
-extern Bitboard GoldCheckTable[ColorNum][SquareNum];
-extern Bitboard SilverCheckTable[ColorNum][SquareNum];
-extern Bitboard KnightCheckTable[ColorNum][SquareNum];
-extern Bitboard LanceCheckTable[ColorNum][SquareNum];
+extern TABLE_CONST Bitboard GoldCheckTable[ColorNum][SquareNum];
+extern TABLE_CONST Bitboard SilverCheckTable[ColorNum][SquareNum];
+extern TABLE_CONST Bitboard KnightCheckTable[ColorNum][SquareNum];
+extern TABLE_CONST Bitboard LanceCheckTable[ColorNum][SquareNum];
 
-extern Bitboard Neighbor5x5Table[SquareNum]; // 25 近傍
+extern TABLE_CONST Bitboard Neighbor5x5Table[SquareNum]; // 25 近傍
 
 #if defined HAVE_BMI2
 // PEXT bitboard.
 inline u64 occupiedToIndex(const Bitboard& block, const Bitboard& mask) {
+#if defined GENERATE_ATTACK_TABLES
+    // tablegen はビルドするマシンで動かすので、BMI2 の命令を使わずに _pext_u64() と同じ値を求める。
+    const u64 b = block.merge();
+    u64 m = mask.merge();
+    u64 result = 0;
+    for (u64 bit = 1; m; bit <<= 1, m &= m - 1) {
+        if (b & m & -m)
+            result |= bit;
+    }
+    return result;
+#else
     return _pext_u64(block.merge(), mask.merge());
+#endif
 }
 
 inline Bitboard rookAttack(const Square sq, const Bitboard& occupied) {
@@ -443,17 +513,24 @@ inline Bitboard bishopAttack(const Square sq, const Bitboard& occupied) {
     return BishopAttack[BishopAttackIndex[sq] + occupiedToIndex(block, BishopMagic[sq], BishopShiftBits[sq])];
 }
 #endif
-// todo: 香車の筋がどこにあるか先に分かっていれば、Bitboard の片方の変数だけを調べれば良くなる。
+// sq の筋の 2～8 段目の駒の有無を 7bit で返す。LanceAttackFile の index に使う。
+inline int fileOccupiedIndex(const Square sq, const Bitboard& occupied) {
+    return (occupied.p(Bitboard::part(sq)) >> Slide[sq]) & 127;
+}
+// 筋の中の 9bit の利きを、sq の筋の位置に置いた Bitboard にする。
+inline Bitboard fileBitsToBB(const Square sq, const u64 fileBits) {
+    const u64 v = fileBits << (Slide[sq] - 1);
+    const u64 isLeft = -static_cast<u64>(Bitboard::part(sq)); // p_[1] 側なら全ての bit が 1
+    return Bitboard(v & ~isLeft, v & isLeft);
+}
 inline Bitboard lanceAttack(const Color c, const Square sq, const Bitboard& occupied) {
-    const int part = Bitboard::part(sq);
-    const int index = (occupied.p(part) >> Slide[sq]) & 127;
-    return LanceAttack[c][sq][index];
+    return fileBitsToBB(sq, LanceAttackFile[c][makeRank(sq)][fileOccupiedIndex(sq, occupied)]);
 }
 // 飛車の縦だけの利き。香車の利きを使い、index を共通化することで高速化している。
 inline Bitboard rookAttackFile(const Square sq, const Bitboard& occupied) {
-    const int part = Bitboard::part(sq);
-    const int index = (occupied.p(part) >> Slide[sq]) & 127;
-    return LanceAttack[Black][sq][index] | LanceAttack[White][sq][index];
+    const Rank r = makeRank(sq);
+    const int index = fileOccupiedIndex(sq, occupied);
+    return fileBitsToBB(sq, LanceAttackFile[Black][r][index] | LanceAttackFile[White][r][index]);
 }
 inline Bitboard goldAttack(const Color c, const Square sq) { return GoldAttack[c][sq]; }
 inline Bitboard silverAttack(const Color c, const Square sq) { return SilverAttack[c][sq]; }
@@ -25,6 +25,13 @@
 #include "usi.hpp"
 #include "thread.hpp"
 #include "search.hpp"
+#include "generateMoves.hpp"
+#include <sys/stat.h>
+#if !defined _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 MT64bit Book::mt64bit_; // 定跡のhash生成用なので、seedは固定でデフォルト値を使う。
 Key Book::ZobPiece[PieceNone][SquareNum];
@@ -43,53 +50,389 @@ void Book::init() {
     ZobTurn = mt64bit_.random();
 }
 
-bool Book::open(const char* fName) {
-    fileName_ = "";
+namespace {
+    // 昇順に並んだ keys を、k を根とする部分木に Eytzinger 順に並べる。i は次に置く keys の位置。
+    size_t makeEytzinger(const std::vector<Key>& keys, const std::vector<u32>& firsts,
+                         std::vector<Key>& indexKeys, std::vector<u32>& indexEntries, size_t i, const size_t k)
+    {
+        if (k < indexKeys.size()) {
+            i = makeEytzinger(keys, firsts, indexKeys, indexEntries, i, 2 * k);
+            indexKeys[k] = keys[i];
+            indexEntries[k] = firsts[i];
+            ++i;
+            i = makeEytzinger(keys, firsts, indexKeys, indexEntries, i, 2 * k + 1);
+        }
+        return i;
+    }
+}
+
+namespace {
+    bool bookFileStamp(const std::string& fName, BookFileStamp& stamp) {
+        struct stat st;
+        if (stat(fName.c_str(), &st) != 0)
+            return false;
+        stamp.size = static_cast<u64>(st.st_size);
+        stamp.mtime = static_cast<s64>(st.st_mtime);
+#if defined __linux__
+        stamp.mtimeNsec = static_cast<s64>(st.st_mtim.tv_nsec);
+#else
+        stamp.mtimeNsec = 0;
+#endif
+        stamp.inode = static_cast<u64>(st.st_ino);
+        return true;
+    }
+}
+
+bool Book::open(const std::string& fName) {
+    BookFileStamp stamp;
+    if (!bookFileStamp(fName, stamp)) {
+        close();
+        return false;
+    }
+    // 同じファイル名でも、別のプロセスなどで書き換えられていれば読み込み直す。
+    if ((entries_ != nullptr || compact_ != nullptr) && fileName_ == fName && fileStamp_ == stamp)
+        return true;
+    close();
+
+    size_t bytes = 0;
+    const char* data = nullptr;
+#if !defined _WIN32
+    // 読み込み専用で共有して mmap するので、同じ定跡ファイルを使う他のプロセスとメモリを共有出来る。
+    const int fd = ::open(fName.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && 0 < st.st_size) {
+        bytes = static_cast<size_t>(st.st_size);
+        void* p = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            mapped_ = p;
+            mappedSize_ = bytes;
+            data = static_cast<const char*>(p);
+        }
+    }
+    ::close(fd);
+#endif
+    if (mapped_ == nullptr) {
+        std::ifstream ifs(fName.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+        if (!ifs)
+            return false;
+        bytes = static_cast<size_t>(ifs.tellg());
+        buffer_.resize((bytes + sizeof(u64) - 1) / sizeof(u64));
+        ifs.seekg(0, std::ios_base::beg);
+        ifs.read(reinterpret_cast<char*>(buffer_.data()), bytes);
+        if (!ifs) {
+            std::cerr << "Failed to open book file " << fName  << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        data = reinterpret_cast<const char*>(buffer_.data());
+    }
+    fileName_ = fName;
+    fileStamp_ = stamp;
+
+    if (CompactBookHeaderV1Size <= bytes && std::equal(std::begin(CompactBookMagic), std::end(CompactBookMagic), data)) {
+        if (!openCompact(data, bytes)) {
+            std::cerr << "Error: broken book file " << fName << std::endl;
+            close();
+            return false;
+        }
+        return true;
+    }
 
-    if (is_open())
+    entries_ = reinterpret_cast<const BookEntry*>(data);
+    size_ = bytes / sizeof(BookEntry);
+    if (!buildIndex()) {
         close();
+        return false;
+    }
+    return true;
+}
+
+void Book::close() {
+#if !defined _WIN32
+    if (mapped_ != nullptr)
+        munmap(mapped_, mappedSize_);
+#endif
+    mapped_ = nullptr;
+    mappedSize_ = 0;
+    std::vector<u64>().swap(buffer_);
+    std::vector<Key>().swap(indexKeys_);
+    std::vector<u32>().swap(indexEntries_);
+    entries_ = nullptr;
+    size_ = 0;
+    keyType_ = BookKeyBook;
+    compact_ = nullptr;
+    fileName_ = "";
+}
+
+bool Book::buildIndex() {
+    if (std::numeric_limits<u32>::max() < size_) {
+        std::cerr << "Error: book file " << fileName_ << " has too many entries." << std::endl;
+        return false;
+    }
+    auto keyLess = [](const BookEntry& lhs, const BookEntry& rhs) { return lhs.key < rhs.key; };
+    if (!std::is_sorted(entries_, entries_ + size_, keyLess)) {
+        // makeBook() で作った定跡は key の順に並んでいるが、そうでなければメモリ上で並べ替える。
+        // 同じ key の定跡手の順番は変えない。
+        if (mapped_ != nullptr) {
+            buffer_.resize(size_ * sizeof(BookEntry) / sizeof(u64));
+            std::copy(entries_, entries_ + size_, reinterpret_cast<BookEntry*>(buffer_.data()));
+#if !defined _WIN32
+            munmap(mapped_, mappedSize_);
+#endif
+            mapped_ = nullptr;
+            mappedSize_ = 0;
+        }
+        BookEntry* first = reinterpret_cast<BookEntry*>(buffer_.data());
+        std::stable_sort(first, first + size_, keyLess);
+        entries_ = first;
+    }
 
-    std::ifstream::open(fName, std::ifstream::in | std::ifstream::binary | std::ios::ate);
+    std::vector<Key> keys;
+    std::vector<u32> firsts;
+    for (size_t i = 0; i < size_; ++i) {
+        if (i == 0 || entries_[i].key != entries_[i - 1].key) {
+            keys.push_back(entries_[i].key);
+            firsts.push_back(static_cast<u32>(i));
+        }
+    }
+    indexKeys_.resize(keys.size() + 1);
+    indexEntries_.resize(keys.size() + 1);
+    makeEytzinger(keys, firsts, indexKeys_, indexEntries_, 0, 1);
+    return true;
+}
 
-    if (!is_open())
+namespace {
+    // p から end の手前までに LEB128 で書かれた値を value に読み、p を次の値に進める。
+    // end までに終わらない時や 64 bit に収まらない時は false を返す。
+    inline bool readLEB128(const u8*& p, const u8* end, u64& value) {
+        value = 0;
+        for (int shift = 0; p != end && shift < 64; shift += 7) {
+            const u8 byte = *p++;
+            value |= static_cast<u64>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
         return false;
+    }
+}
 
-    size_ = tellg() / sizeof(BookEntry);
+bool Book::openCompact(const char* data, const size_t bytes) {
+    const CompactBookHeader* header = reinterpret_cast<const CompactBookHeader*>(data);
+    if ((header->version != 1 && header->version != CompactBookVersion) || std::numeric_limits<u32>::max() < header->moveNum)
+        return false;
+    const u64 keysOffset = (header->version == 1 ? CompactBookHeaderV1Size : sizeof(CompactBookHeader));
+    if (bytes < keysOffset)
+        return false;
+    const BookKeyType keyType = (header->version == 1 ? BookKeyBook : static_cast<BookKeyType>(header->keyType));
+    if (keyType != BookKeyBook && keyType != BookKeyPosition)
+        return false;
+    // 以下の offset の計算が桁溢れしないよう、先にファイルの大きさで抑えておく。
+    if (bytes < header->positionNum || bytes < header->blockNum || bytes < header->keyBytes)
+        return false;
+    u64 movesOffset;
+    if (header->blockSize == 0) {
+        movesOffset = keysOffset + header->positionNum * sizeof(Key) + (header->positionNum + 1) * sizeof(u32);
+        if (header->blockNum != 0 || header->keyBytes != 0)
+            return false;
+    }
+    else {
+        movesOffset = (keysOffset + header->blockNum * sizeof(CompactBookBlock) + header->keyBytes + 1) & ~static_cast<u64>(1);
+        if (header->blockNum != (header->positionNum + header->blockSize - 1) / header->blockSize)
+            return false;
+    }
+    if (bytes != movesOffset + header->moveNum * (sizeof(u16) + sizeof(u16) + sizeof(s16)))
+        return false;
 
-    if (!good()) {
-        std::cerr << "Failed to open book file " << fName  << std::endl;
-        exit(EXIT_FAILURE);
+    // 検索では、局面の定跡手の位置と数がファイルの範囲内にあることを確かめないので、ここで全て確かめる。
+    if (header->blockSize == 0) {
+        const Key* keys = reinterpret_cast<const Key*>(data + keysOffset);
+        const u32* moveBegins = reinterpret_cast<const u32*>(keys + header->positionNum);
+        if (moveBegins[0] != 0 || moveBegins[header->positionNum] != header->moveNum)
+            return false;
+        for (u64 i = 0; i < header->positionNum; ++i) {
+            if (moveBegins[i + 1] < moveBegins[i] || (0 < i && keys[i] <= keys[i - 1]))
+                return false;
+        }
+    }
+    else {
+        const CompactBookBlock* blocks = reinterpret_cast<const CompactBookBlock*>(data + keysOffset);
+        const u8* first = reinterpret_cast<const u8*>(blocks + header->blockNum);
+        const u8* end = first + header->keyBytes;
+        const u8* p = first;
+        Key current = 0;
+        u64 moveIndex = 0;
+        for (u64 i = 0; i < header->positionNum; ++i) {
+            const bool blockHead = (i % header->blockSize == 0);
+            if (blockHead) {
+                const CompactBookBlock& block = blocks[i / header->blockSize];
+                if (block.keyOffset != static_cast<u64>(p - first) || block.firstMove != moveIndex
+                    || (0 < i && block.firstKey <= current))
+                {
+                    return false;
+                }
+                current = block.firstKey;
+            }
+            u64 diff;
+            u64 moveNum;
+            if (!readLEB128(p, end, diff) || !readLEB128(p, end, moveNum)
+                || (blockHead ? diff != 0 : (diff == 0 || current + diff < current))
+                || header->moveNum - moveIndex < moveNum)
+            {
+                return false;
+            }
+            current += diff;
+            moveIndex += moveNum;
+        }
+        if (p != end || moveIndex != header->moveNum)
+            return false;
     }
 
-    fileName_ = fName;
+    compact_ = header;
+    keyType_ = keyType;
+    fromToPros_ = reinterpret_cast<const u16*>(data + movesOffset);
+    counts_ = fromToPros_ + header->moveNum;
+    scores_ = reinterpret_cast<const s16*>(counts_ + header->moveNum);
+
+    std::vector<Key> keys;
+    std::vector<u32> indices;
+    if (header->blockSize == 0) {
+        keys_ = reinterpret_cast<const Key*>(data + keysOffset);
+        moveBegins_ = reinterpret_cast<const u32*>(keys_ + header->positionNum);
+        keys.assign(keys_, keys_ + header->positionNum);
+    }
+    else {
+        blocks_ = reinterpret_cast<const CompactBookBlock*>(data + keysOffset);
+        keyBytes_ = reinterpret_cast<const u8*>(blocks_ + header->blockNum);
+        for (u64 i = 0; i < header->blockNum; ++i)
+            keys.push_back(blocks_[i].firstKey);
+    }
+    for (size_t i = 0; i < keys.size(); ++i)
+        indices.push_back(static_cast<u32>(i));
+    indexKeys_.resize(keys.size() + 1);
+    indexEntries_.resize(keys.size() + 1);
+    makeEytzinger(keys, indices, indexKeys_, indexEntries_, 0, 1);
     return true;
 }
 
-void Book::binary_search(const Key key) {
-    size_t low = 0;
-    size_t high = size_ - 1;
-    size_t mid;
-    BookEntry entry;
+namespace {
+    inline u8* writeLEB128(u8* p, u64 value) {
+        while (0x80 <= value) {
+            *p++ = static_cast<u8>(value | 0x80);
+            value >>= 7;
+        }
+        *p++ = static_cast<u8>(value);
+        return p;
+    }
+}
 
-    while (low < high && good()) {
-        mid = (low + high) / 2;
+// indexKeys_ から key を探し、その位置を返す。無ければ 0 を返す。
+size_t Book::findIndex(const Key key) const {
+    const size_t n = (indexKeys_.empty() ? 0 : indexKeys_.size() - 1);
+    // key 以上の最小の key を探す。右の子へ進んだ回数だけ k の下位 bit に 1 が並ぶので、
+    // 最後に左の子へ進んだ位置まで戻る。
+    size_t k = 1;
+    while (k <= n)
+        k = 2 * k + (indexKeys_[k] < key);
+    while (k & 1)
+        k >>= 1;
+    k >>= 1;
+    return (k != 0 && indexKeys_[k] == key ? k : 0);
+}
 
-        assert(mid >= low && mid < high);
+size_t Book::findCompact(const Key key, BookEntry* moves) const {
+    u64 moveIndex = 0;
+    u64 moveNum = 0;
+    if (compact_->blockSize == 0) {
+        const size_t k = findIndex(key);
+        if (k == 0)
+            return 0;
+        const u32 i = indexEntries_[k];
+        moveIndex = moveBegins_[i];
+        moveNum = moveBegins_[i + 1] - moveBegins_[i];
+    }
+    else {
+        // key 以下の最大の key から始まるブロックを探す。右の子へ進んだ最後の位置がそのブロック。
+        const size_t n = indexKeys_.size() - 1;
+        size_t k = 1;
+        size_t found = 0;
+        while (k <= n) {
+            const bool right = (indexKeys_[k] <= key);
+            found = (right ? k : found);
+            k = 2 * k + right;
+        }
+        if (found == 0)
+            return 0;
 
-        // std::ios_base::beg はストリームの開始位置を指す。
-        // よって、ファイルの開始位置から mid * sizeof(BookEntry) バイト進んだ位置を指す。
-        seekg(mid * sizeof(BookEntry), std::ios_base::beg);
-        read(reinterpret_cast<char*>(&entry), sizeof(entry));
+        const u64 blockIndex = indexEntries_[found];
+        const CompactBookBlock& block = blocks_[blockIndex];
+        const u64 positionNum = std::min<u64>(compact_->blockSize, compact_->positionNum - blockIndex * compact_->blockSize);
+        const u8* p = keyBytes_ + block.keyOffset;
+        const u8* end = keyBytes_ + compact_->keyBytes;
+        Key current = block.firstKey;
+        moveIndex = block.firstMove;
+        u64 i = 0;
+        for (; i < positionNum; ++i) {
+            u64 diff;
+            if (!readLEB128(p, end, diff) || !readLEB128(p, end, moveNum))
+                return 0;
+            current += diff;
+            if (key <= current)
+                break;
+            moveIndex += moveNum;
+        }
+        if (i == positionNum || current != key)
+            return 0;
+    }
 
-        if (key <= entry.key)
-            high = mid;
-        else
-            low = mid + 1;
+    const size_t num = std::min<size_t>(moveNum, MaxLegalMoves);
+    for (size_t j = 0; j < num; ++j) {
+        moves[j].key = key;
+        moves[j].fromToPro = fromToPros_[moveIndex + j];
+        moves[j].count = counts_[moveIndex + j];
+        moves[j].score = static_cast<Score>(scores_[moveIndex + j]);
     }
+    return num;
+}
+
+size_t Book::find(const Key key, BookEntry* moves) const {
+    if (compact_ != nullptr)
+        return findCompact(key, moves);
 
-    assert(low == high);
+    const size_t k = findIndex(key);
+    if (k == 0)
+        return 0;
+    size_t num = 0;
+    for (const BookEntry* it = entries_ + indexEntries_[k]; it != entries_ + size_ && it->key == key && num < MaxLegalMoves; ++it)
+        moves[num++] = *it;
+    return num;
+}
 
-    seekg(low * sizeof(BookEntry), std::ios_base::beg);
+std::vector<Key> Book::keys() const {
+    std::vector<Key> result;
+    if (compact_ == nullptr) {
+        for (size_t i = 0; i < size_; ++i)
+            if (i == 0 || entries_[i].key != entries_[i - 1].key)
+                result.push_back(entries_[i].key);
+    }
+    else if (compact_->blockSize == 0)
+        result.assign(keys_, keys_ + compact_->positionNum);
+    else {
+        const u8* p = keyBytes_;
+        const u8* end = keyBytes_ + compact_->keyBytes;
+        Key current = 0;
+        for (u64 i = 0; i < compact_->positionNum; ++i) {
+            if (i % compact_->blockSize == 0)
+                current = blocks_[i / compact_->blockSize].firstKey;
+            u64 diff;
+            u64 moveNum; // 定跡手の数は使わない。
+            if (!readLEB128(p, end, diff) || !readLEB128(p, end, moveNum))
+                break;
+            current += diff;
+            result.push_back(current);
+        }
+    }
+    return result;
 }
 
 Key Book::bookKey(const Position& pos) {
@@ -109,21 +452,22 @@ Key Book::bookKey(const Position& pos) {
 }
 
 std::tuple<Move, Score> Book::probe(const Position& pos, const std::string& fName, const bool pickBest) {
-    BookEntry entry;
     u16 best = 0;
     u32 sum = 0;
     Move move = Move::moveNone();
-    const Key key = bookKey(pos);
     const Score min_book_score = static_cast<Score>(static_cast<int>(pos.searcher()->options["Min_Book_Score"]));
     Score score = ScoreZero;
 
-    if (fileName_ != fName && !open(fName.c_str()))
+    if (!open(fName))
         return std::make_tuple(Move::moveNone(), ScoreNone);
+    const Key key = this->key(pos);
 
-    binary_search(key);
+    BookEntry moves[MaxLegalMoves];
+    const size_t num = find(key, moves);
 
     // 現在の局面における定跡手の数だけループする。
-    while (read(reinterpret_cast<char*>(&entry), sizeof(entry)), entry.key == key && good()) {
+    for (size_t i = 0; i < num; ++i) {
+        const BookEntry& entry = moves[i];
         best = std::max(best, entry.count);
         sum += entry.count;
 
@@ -159,7 +503,287 @@ inline bool countCompare(const BookEntry& b1, const BookEntry& b2) {
     return b1.count < b2.count;
 }
 
+namespace {
+    // pos から定跡手で辿れる局面を深さ優先で全て訪れ、定跡の局面では f(pos, moves, num) を呼ぶ。
+    // moves はその局面の合法な定跡手。
+    // 勝った側の手しか記録していない定跡もあるので、定跡手以外でも、指した後の局面が定跡にある手は辿る。
+    // entries[ply] はその手数の局面の定跡手を読む領域で、再帰の各段のスタックに大きな配列を取らないよう、呼び出し元で持つ。
+    template <typename F>
+    void walkBook(const Book& book, Position& pos, const Ply ply, const Ply maxPly,
+                  std::vector<std::vector<BookEntry>>& entries, std::unordered_set<Key>& visited, F& f)
+    {
+        if (maxPly <= ply || !visited.insert(pos.getKey()).second)
+            return;
+        std::vector<BookEntry>& moves = entries[ply];
+        std::vector<BookEntry>& childMoves = entries[ply + 1]; // 子の局面を辿る前に、定跡にあるかを調べるのにだけ使う。
+        moves.resize(MaxLegalMoves);
+        childMoves.resize(MaxLegalMoves);
+        const size_t num = book.find(book.key(pos), moves.data());
+        // 合法な定跡手を、指し手生成の順に moves の前に詰める。
+        size_t legalNum = 0;
+        std::vector<Move> children;
+        std::vector<Move> others;
+        for (MoveList<Legal> ml(pos); !ml.end(); ++ml) {
+            const Move move = ml.move();
+            auto entry = std::find_if(moves.begin() + legalNum, moves.begin() + num,
+                                      [move](const BookEntry& e) { return e.fromToPro == move.proFromAndTo(); });
+            if (entry != moves.begin() + num) {
+                std::swap(moves[legalNum++], *entry);
+                children.push_back(move);
+            }
+            else
+                others.push_back(move);
+        }
+        for (const Move move : others) {
+            StateInfo st;
+            pos.doMove(move, st);
+            const bool childInBook = (book.find(book.key(pos), childMoves.data()) != 0);
+            pos.undoMove(move);
+            if (childInBook)
+                children.push_back(move);
+        }
+        if (legalNum != 0)
+            f(pos, moves.data(), legalNum);
+        for (const Move move : children) {
+            StateInfo st;
+            pos.doMove(move, st);
+            walkBook(book, pos, ply + 1, maxPly, entries, visited, f);
+            pos.undoMove(move);
+        }
+    }
+
+    template <typename F>
+    void walkBook(const Book& book, Position& pos, const Ply maxPly, std::unordered_set<Key>& visited, F& f) {
+        std::vector<std::vector<BookEntry>> entries(std::max<Ply>(maxPly, 0) + 1); // 使う手数の分だけ確保する。
+        walkBook(book, pos, 0, maxPly, entries, visited, f);
+    }
+
+    // 定跡手の内、点数が最大のものを返す。詰みの点数は手数に依るので、探索では使わない。
+    // 全ての定跡手の点数が ScoreZero の局面は点数を持たない定跡なので、探索の値として使わない。
+    bool bestBookMove(const Key key, const BookEntry* moves, const size_t num, BookHashEntry& best) {
+        if (std::none_of(moves, moves + num, [](const BookEntry& e) { return e.score != ScoreZero; }))
+            return false;
+        Score bestScore = -ScoreInfinite;
+        for (size_t i = 0; i < num; ++i) {
+            if (bestScore < moves[i].score && abs(moves[i].score) < ScoreMateInMaxPly) {
+                bestScore = moves[i].score;
+                best = {key, moves[i].fromToPro, static_cast<s16>(moves[i].score)};
+            }
+        }
+        return bestScore != -ScoreInfinite;
+    }
+}
+
+size_t BookHash::init(Book& book, const Position& pos, const Ply maxPly, const Depth depth) {
+    depth_ = depth;
+    std::vector<BookHashEntry> entries;
+    BookHashEntry best;
+    if (book.keyType() == BookKeyPosition) {
+        BookEntry moves[MaxLegalMoves];
+        for (const Key key : book.keys())
+            if (bestBookMove(key, moves, book.find(key, moves), best))
+                entries.push_back(best);
+    }
+    else {
+        std::unordered_set<Key> visited;
+        Position root(DefaultStartPositionSFEN, pos.searcher()->threads.main(), pos.searcher()->thisptr);
+        auto f = [&](const Position& p, const BookEntry* moves, const size_t num) {
+            if (bestBookMove(p.getKey(), moves, num, best))
+                entries.push_back(best);
+        };
+        walkBook(book, root, maxPly, visited, f);
+    }
+
+    size_t size = 1;
+    while (size < entries.size() * 2)
+        size <<= 1;
+    table_.assign(size, BookHashEntry());
+    mask_ = size - 1;
+    for (const BookHashEntry& entry : entries) {
+        size_t i = entry.key & mask_;
+        while (table_[i].key != 0)
+            i = (i + 1) & mask_;
+        table_[i] = entry;
+    }
+    return entries.size();
+}
+
 #if !defined MINIMUL
+// 定跡ファイルを compact 形式に変換する。入力は book.bin の形式でも compact 形式でも良い。
+// convert_book <入力の定跡ファイル> <出力する定跡ファイル> [blockSize] [book|position]
+// blockSize を 0 (default) にすると key をそのまま持つ。
+// 0 で無ければ key を差分で持ち、blockSize はブロック毎の局面数で、大きいほど索引が小さくなり、検索でブロック内を読む量が増える。
+// 最後の引数は出力の key の種類で、book (default) は Book::bookKey()、position は Position::getKey()。
+// 入力と key の種類が異なる場合は、平手の初期局面から定跡を辿って局面を作り直すので、初期局面から辿れない局面と合法でない定跡手は捨てる。
+// Book::bookKey() は相手の持ち駒を区別しないので、position に変換すると、同じ定跡手が相手の持ち駒の異なる局面毎に入る。
+void convertBook(Position& pos, std::istringstream& ssCmd) {
+    pos.searcher()->book.close(); // 書き出す定跡ファイルを mmap しているかも知れないので閉じる。
+    std::string inFileName;
+    std::string outFileName;
+    u32 blockSize = 0;
+    std::string keyTypeStr = "book";
+    ssCmd >> inFileName >> outFileName >> blockSize >> keyTypeStr;
+    if (keyTypeStr != "book" && keyTypeStr != "position") {
+        std::cerr << "Error: unknown key type " << keyTypeStr << std::endl;
+        return;
+    }
+    const BookKeyType keyType = (keyTypeStr == "position" ? BookKeyPosition : BookKeyBook);
+    Book book;
+    std::ifstream ifs(inFileName.c_str(), std::ios::binary | std::ios::ate);
+    if (!ifs || !book.open(inFileName)) {
+        std::cerr << "Error: cannot open " << inFileName << std::endl;
+        return;
+    }
+    const size_t bytes = static_cast<size_t>(ifs.tellg());
+
+    std::vector<BookEntry> entries;
+    BookEntry moves[MaxLegalMoves];
+    const std::vector<Key> inKeys = book.keys();
+    if (book.keyType() == keyType) {
+        for (const Key key : inKeys) {
+            const size_t num = book.find(key, moves);
+            entries.insert(entries.end(), moves, moves + num);
+        }
+    }
+    else {
+        std::unordered_set<Key> visited;
+        std::unordered_set<Key> reached; // 辿れた入力の局面の key
+        std::unordered_set<Key> outKeys;
+        Position root(DefaultStartPositionSFEN, pos.searcher()->threads.main(), pos.searcher()->thisptr);
+        auto f = [&](const Position& p, const BookEntry* legalMoves, const size_t num) {
+            reached.insert(book.key(p));
+            const Key key = (keyType == BookKeyPosition ? p.getKey() : Book::bookKey(p));
+            // bookKey() が同じ局面は、最初に辿った局面の定跡手だけを使う。
+            if (!outKeys.insert(key).second)
+                return;
+            for (size_t i = 0; i < num; ++i) {
+                entries.push_back(legalMoves[i]);
+                entries.back().key = key;
+            }
+        };
+        walkBook(book, root, MaxPly, visited, f);
+        std::cout << "reached positions: " << reached.size() << " / " << inKeys.size() << std::endl;
+    }
+    std::stable_sort(entries.begin(), entries.end(), [](const BookEntry& lhs, const BookEntry& rhs) { return lhs.key < rhs.key; });
+    if (std::numeric_limits<u32>::max() < entries.size()) {
+        std::cerr << "Error: too many entries" << std::endl;
+        return;
+    }
+
+    std::vector<Key> keys;
+    std::vector<u32> moveBegins;
+    std::vector<CompactBookBlock> blocks;
+    std::vector<u8> keyBytes;
+    std::vector<u16> fromToPros;
+    std::vector<u16> counts;
+    std::vector<s16> scores;
+    u8 buf[20];
+    u64 positionNum = 0;
+    for (size_t i = 0; i < entries.size(); ) {
+        const Key key = entries[i].key;
+        size_t last = i;
+        for (; last < entries.size() && entries[last].key == key; ++last) {
+            if (entries[last].score < std::numeric_limits<s16>::min() || std::numeric_limits<s16>::max() < entries[last].score) {
+                std::cerr << "Error: score " << entries[last].score << " is out of range" << std::endl;
+                return;
+            }
+            fromToPros.push_back(entries[last].fromToPro);
+            counts.push_back(entries[last].count);
+            scores.push_back(static_cast<s16>(entries[last].score));
+        }
+        if (blockSize == 0) {
+            keys.push_back(key);
+            moveBegins.push_back(static_cast<u32>(i));
+        }
+        else {
+            const bool blockHead = (positionNum % blockSize == 0);
+            if (blockHead) {
+                if (std::numeric_limits<u32>::max() < keyBytes.size()) {
+                    std::cerr << "Error: too many positions" << std::endl;
+                    return;
+                }
+                blocks.push_back({key, static_cast<u32>(keyBytes.size()), static_cast<u32>(i)});
+            }
+            u8* p = writeLEB128(buf, (blockHead ? 0 : key - entries[i - 1].key));
+            p = writeLEB128(p, last - i);
+            keyBytes.insert(keyBytes.end(), buf, p);
+        }
+        ++positionNum;
+        i = last;
+    }
+
+    if (blockSize == 0)
+        moveBegins.push_back(static_cast<u32>(entries.size()));
+
+    CompactBookHeader header;
+    std::copy(std::begin(CompactBookMagic), std::end(CompactBookMagic), header.magic);
+    header.version = CompactBookVersion;
+    header.blockSize = blockSize;
+    header.positionNum = positionNum;
+    header.moveNum = entries.size();
+    header.blockNum = blocks.size();
+    header.keyBytes = keyBytes.size();
+    header.keyType = keyType;
+    header.reserved = 0;
+    if (keyBytes.size() & 1)
+        keyBytes.push_back(0); // 定跡手の配列を 2 byte 境界に揃える。
+
+    std::ofstream ofs(outFileName.c_str(), std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(keys.data()), keys.size() * sizeof(Key));
+    ofs.write(reinterpret_cast<const char*>(moveBegins.data()), moveBegins.size() * sizeof(u32));
+    ofs.write(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(CompactBookBlock));
+    ofs.write(reinterpret_cast<const char*>(keyBytes.data()), keyBytes.size());
+    ofs.write(reinterpret_cast<const char*>(fromToPros.data()), fromToPros.size() * sizeof(u16));
+    ofs.write(reinterpret_cast<const char*>(counts.data()), counts.size() * sizeof(u16));
+    ofs.write(reinterpret_cast<const char*>(scores.data()), scores.size() * sizeof(s16));
+    if (!ofs) {
+        std::cerr << "Error: cannot write " << outFileName << std::endl;
+        return;
+    }
+    std::cout << "positions: " << positionNum << ", moves: " << entries.size()
+              << ", size: " << bytes << " -> " << static_cast<size_t>(ofs.tellp()) << " [byte]" << std::endl;
+}
+
+namespace {
+    // 棋譜 1 局分を読み、勝った側の手番の局面で、指し手を指す前に f(pos, move) を呼ぶ。
+    // header は <棋譜番号> <日付> ... の行、moves は CSA1行形式の指し手の行。
+    // states は指し手を進める為に使い、pos は呼び出し後も states を参照し続ける。
+    template <typename F>
+    void forEachWinnerMove(Position& pos, StateListPtr& states, const std::string& header, const std::string& moves, F f) {
+        std::string elem;
+        std::stringstream ss(header);
+        ss >> elem; // 棋譜番号を飛ばす。
+        ss >> elem; // 対局日を飛ばす。
+        ss >> elem; // 先手
+        ss >> elem; // 後手
+        ss >> elem; // (0:引き分け,1:先手の勝ち,2:後手の勝ち)
+        const Color winner = (elem == "1" ? Black : elem == "2" ? White : ColorNum);
+        // 勝った方の指し手を記録していく。
+        // 又は稲庭戦法側を記録していく。
+        const Color saveColor = winner;
+
+        pos.set(DefaultStartPositionSFEN, pos.searcher()->threads.main());
+        states = StateListPtr(new std::deque<StateInfo>(1));
+        for (size_t i = 0; i < moves.size(); i += 6) {
+            const std::string moveStrCSA = moves.substr(i, 6);
+            const Move move = csaToMove(pos, moveStrCSA);
+            if (!move) {
+                // makeBookParallel() では複数のスレッドから呼ぶので、局面の表示が他の出力と混ざらないよう IOLock を取る。
+                // SYNCCOUT, SYNCENDL は LEARN では何もしないので使わない。
+                std::cout << IOLock;
+                pos.print();
+                std::cout << "!!! Illegal move = " << moveStrCSA << " !!!" << std::endl << IOUnlock;
+                break;
+            }
+            if (pos.turn() == saveColor)
+                f(pos, move); // 先手、後手の内、片方だけを記録する。
+            states->emplace_back();
+            pos.doMove(move, states->back());
+        }
+    }
+}
+
 // 以下のようなフォーマットが入力される。
 // <棋譜番号> <日付> <先手名> <後手名> <0:引き分け, 1:先手勝ち, 2:後手勝ち> <総手数> <棋戦名前> <戦形>
 // <CSA1行形式の指し手>
@@ -172,7 +796,9 @@ inline bool countCompare(const BookEntry& b1, const BookEntry& b2) {
 // 出現回数がそのまま定跡として使う確率となる。
 // 基本的には棋譜を丁寧に選別した上で定跡を作る必要がある。
 // MAKE_SEARCHED_BOOK を on にしていると、定跡生成に非常に時間が掛かる。
+// 大量の棋譜から作る場合は makeBookParallel() を使う。
 void makeBook(Position& pos, std::istringstream& ssCmd) {
+    pos.searcher()->book.close(); // 書き出す定跡ファイルを mmap しているかも知れないので閉じる。
     std::string fileName;
     ssCmd >> fileName;
     std::ifstream ifs(fileName.c_str(), std::ios::binary);
@@ -180,41 +806,17 @@ void makeBook(Position& pos, std::istringstream& ssCmd) {
         std::cout << "I cannot open " << fileName << std::endl;
         return;
     }
+    std::string header;
     std::string line;
     std::map<Key, std::vector<BookEntry> > bookMap;
 
-    while (std::getline(ifs, line)) {
-        std::string elem;
-        std::stringstream ss(line);
-        ss >> elem; // 棋譜番号を飛ばす。
-        ss >> elem; // 対局日を飛ばす。
-        ss >> elem; // 先手
-        const std::string sente = elem;
-        ss >> elem; // 後手
-        const std::string gote = elem;
-        ss >> elem; // (0:引き分け,1:先手の勝ち,2:後手の勝ち)
-        const Color winner = (elem == "1" ? Black : elem == "2" ? White : ColorNum);
-        // 勝った方の指し手を記録していく。
-        // 又は稲庭戦法側を記録していく。
-        const Color saveColor = winner;
-
+    while (std::getline(ifs, header)) {
         if (!std::getline(ifs, line)) {
             std::cout << "!!! header only !!!" << std::endl;
             return;
         }
-        pos.set(DefaultStartPositionSFEN, pos.searcher()->threads.main());
-        StateListPtr states = StateListPtr(new std::deque<StateInfo>(1));
-        while (!line.empty()) {
-            const std::string moveStrCSA = line.substr(0, 6);
-            const Move move = csaToMove(pos, moveStrCSA);
-            if (!move) {
-                pos.print();
-                std::cout << "!!! Illegal move = " << moveStrCSA << " !!!" << std::endl;
-                break;
-            }
-            line.erase(0, 6); // 先頭から6文字削除
-            if (pos.turn() == saveColor) {
-                // 先手、後手の内、片方だけを記録する。
+        StateListPtr states;
+        forEachWinnerMove(pos, states, header, line, [&](Position& pos, const Move move) {
                 const Key key = Book::bookKey(pos);
                 bool isFind = false;
                 if (bookMap.find(key) != bookMap.end()) {
@@ -232,17 +834,17 @@ void makeBook(Position& pos, std::istringstream& ssCmd) {
                 }
                 if (isFind == false) {
 #if defined MAKE_SEARCHED_BOOK
-                    states->emplace_back();
-                    pos.doMove(move, states->back());
+                    StateInfo st;
+                    pos.doMove(move, st);
 
                     std::istringstream ssCmd("byoyomi 1000");
                     go(pos, ssCmd);
+                    pos.searcher()->threads.main()->waitForSearchFinished();
 
                     pos.undoMove(move);
-                    states->pop_back();
 
                     // doMove してから search してるので点数が反転しているので直す。
-                    const Score score = -pos.thisThread()->rootMoves[0].score;
+                    const Score score = -pos.searcher()->threads.main()->rootMoves[0].score;
 #else
                     const Score score = ScoreZero;
 #endif
@@ -254,10 +856,7 @@ void makeBook(Position& pos, std::istringstream& ssCmd) {
                     be.count = 1;
                     bookMap[key].push_back(be);
                 }
-            }
-            states->emplace_back();
-            pos.doMove(move, states->back());
-        }
+            });
     }
 
     // BookEntry::count の値で降順にソート
@@ -291,4 +890,467 @@ void makeBook(Position& pos, std::istringstream& ssCmd) {
 
     std::cout << "book making was done" << std::endl;
 }
+
+namespace {
+    // makeBookParallel() で、ソート済みの一時ファイルに書き出す定跡手。
+    // 点数を付ける時に探索するので、指し手を指す前の局面も持っておく。
+    struct BookRunEntry {
+        HuffmanCodedPos hcp;
+        BookEntry entry;
+    };
+
+    inline bool runEntryLess(const BookRunEntry& lhs, const BookRunEntry& rhs) {
+        return (lhs.entry.key != rhs.entry.key ? lhs.entry.key < rhs.entry.key : lhs.entry.fromToPro < rhs.entry.fromToPro);
+    }
+
+    // 同じ局面の同じ指し手を 1 つにまとめ、出現回数を足し合わせる。局面は最初のものを残す。
+    void addCount(BookEntry& entry, const u16 count) {
+        entry.count = static_cast<u16>(std::min<int>(entry.count + count, std::numeric_limits<u16>::max()));
+    }
+
+    // run を並べ替え、同じ定跡手をまとめてからファイルに書き出す。
+    bool writeRun(std::vector<BookRunEntry>& run, const std::string& fileName) {
+        std::sort(run.begin(), run.end(), runEntryLess);
+        size_t n = 0;
+        for (size_t i = 0; i < run.size(); ++i) {
+            if (n != 0 && !runEntryLess(run[n - 1], run[i]))
+                addCount(run[n - 1].entry, run[i].entry.count);
+            else
+                run[n++] = run[i];
+        }
+        std::ofstream ofs(fileName.c_str(), std::ios::binary);
+        ofs.write(reinterpret_cast<const char*>(run.data()), n * sizeof(BookRunEntry));
+        run.clear();
+        return static_cast<bool>(ofs);
+    }
+
+    // ソート済みの一時ファイルを先頭から少しずつ読む。
+    class RunReader {
+    public:
+        explicit RunReader(const std::string& fileName) : ifs_(fileName.c_str(), std::ios::binary), buf_(4096), pos_(0), size_(0) { fill(); }
+        bool empty() const { return pos_ == size_; }
+        const BookRunEntry& front() const { return buf_[pos_]; }
+        void pop() {
+            if (++pos_ == size_)
+                fill();
+        }
+
+    private:
+        void fill() {
+            ifs_.read(reinterpret_cast<char*>(buf_.data()), buf_.size() * sizeof(BookRunEntry));
+            size_ = static_cast<size_t>(ifs_.gcount()) / sizeof(BookRunEntry);
+            pos_ = 0;
+        }
+
+        std::ifstream ifs_;
+        std::vector<BookRunEntry> buf_;
+        size_t pos_;
+        size_t size_;
+    };
+
+    // pos を limits の通りに探索し、最善手を返す。score には手番側から見た評価値を入れる。
+    // pos.searcher() の探索を使う。USE_GLOBAL の時は Threads の数のスレッドで探索する。
+    Move searchBookPosition(Position& pos, const LimitsType& limits, Score& score) {
+#if defined LEARN
+        // LEARN の時は探索窓を固定しているので、広げておく。
+        pos.searcher()->alpha = -ScoreMaxEvaluate;
+        pos.searcher()->beta  =  ScoreMaxEvaluate;
+#endif
+        pos.searcher()->threads.startThinking(pos, limits, pos.searcher()->states);
+        pos.searcher()->threads.main()->waitForSearchFinished();
+        const RootMove& rm = pos.searcher()->threads.main()->rootMoves[0];
+        score = rm.score;
+        return rm.pv[0];
+    }
+
+    // hcp の局面で fromToPro の手を指した後の局面を depth の深さで探索し、指した側から見た評価値を返す。
+    Score searchBookMove(Position& pos, const HuffmanCodedPos& hcp, const u16 fromToPro, const Ply depth) {
+        if (!pos.set(hcp, pos.searcher()->threads.main()))
+            return ScoreZero;
+        Move move = Move::moveNone();
+        for (MoveList<Legal> ml(pos); !ml.end(); ++ml)
+            if (ml.move().proFromAndTo() == fromToPro)
+                move = ml.move();
+        if (!move)
+            return ScoreZero;
+        StateInfo st;
+        pos.doMove(move, st);
+        Score score;
+        if (MoveList<Legal>(pos).size() == 0)
+            score = ScoreMate1Ply; // 詰ませる手。
+        else {
+            LimitsType limits;
+            limits.depth = depth;
+            searchBookPosition(pos, limits, score);
+            // doMove してから search してるので点数が反転しているので直す。
+            score = -score;
+        }
+        pos.undoMove(move);
+        return score;
+    }
+
+    // 定跡の局面を並列に探索する為に、探索するスレッド毎の局面を用意する。
+    // LEARN の時は、スレッド毎に Searcher を用意して並列に探索する。
+    // それ以外は Searcher が 1 つしか無いので、局面を 1 つだけ用意し、1 局面ずつ Threads の数のスレッドで探索する。
+    class BookSearchWorkers {
+    public:
+        BookSearchWorkers(Position& pos, const int threadNum)
+#if defined USE_GLOBAL
+            : searcher_(pos.searcher())
+        {
+            (void)threadNum;
+            positions_.emplace_back(DefaultStartPositionSFEN, pos.searcher()->threads.main(), pos.searcher()->thisptr);
+            // 探索中に、作っている途中の定跡を引かないようにする。
+            ownBook_ = pos.searcher()->options["OwnBook"];
+            pos.searcher()->options["OwnBook"] = std::string("false");
+        }
+#else
+            : searchers_(threadNum)
+        {
+            for (auto& s : searchers_) {
+                s.init();
+                const std::string options[] = {"name Threads value 1",
+                                               "name MultiPV value 1",
+                                               "name USI_Hash value " + std::to_string(static_cast<int>(pos.searcher()->options["USI_Hash"])),
+                                               "name OwnBook value false",
+                                               "name Max_Random_Score_Diff value 0"};
+                for (auto& str : options) {
+                    std::istringstream is(str);
+                    s.setOption(is);
+                }
+                positions_.emplace_back(DefaultStartPositionSFEN, s.threads.main(), s.thisptr);
+            }
+        }
+#endif
+        ~BookSearchWorkers() {
+#if defined USE_GLOBAL
+            searcher_->options["OwnBook"] = std::string(ownBook_ ? "true" : "false");
+#endif
+        }
+        size_t size() const { return positions_.size(); }
+        // 0 から num - 1 までの各 i について、何れかのスレッドで f(そのスレッドの局面, i) を呼ぶ。
+        template <typename F>
+        void run(const size_t num, F f) {
+            std::atomic<size_t> idx(0);
+            auto work = [&](Position& workPos) {
+                for (size_t i; (i = idx++) < num;)
+                    f(workPos, i);
+            };
+            std::vector<std::thread> workers;
+            for (auto& workPos : positions_)
+                workers.emplace_back(work, std::ref(workPos));
+            for (auto& th : workers)
+                th.join();
+        }
+
+    private:
+#if defined USE_GLOBAL
+        Searcher* searcher_;
+        bool ownBook_;
+#else
+        std::vector<Searcher> searchers_;
+#endif
+        std::vector<Position> positions_;
+    };
+}
+
+// 大量の棋譜から定跡を作る。入力の形式と、作られる定跡の中身は makeBook() と同じ。
+// make_book <棋譜ファイル> <出力する定跡ファイル> [スレッド数] [点数付けの探索の深さ] [使うメモリ(MB)]
+//
+// 1. 各スレッドが棋譜を少しずつ取り出して再生し、定跡手を溜める。
+//    溜まった定跡手が使うメモリを超えたら、並べ替えて一時ファイル (<定跡ファイル>.run<番号>) に書き出す。
+// 2. 一時ファイルを k-way merge して、同じ定跡手の出現回数を足し合わせる。
+// 3. 探索の深さが 0 で無ければ、異なる定跡手毎に探索して点数を付ける。
+//    LEARN の時は、スレッド毎に Searcher を用意して並列に探索する。
+//    それ以外は Searcher が 1 つしか無いので、1 手ずつ Threads の数のスレッドで探索する。
+void makeBookParallel(Position& pos, std::istringstream& ssCmd) {
+    pos.searcher()->book.close(); // 書き出す定跡ファイルを mmap しているかも知れないので閉じる。
+    std::string kifuFileName;
+    std::string bookFileName;
+    int threadNum = std::max<int>(1, std::thread::hardware_concurrency());
+    Ply depth = 0;
+    s64 memoryMB = 1024;
+    ssCmd >> kifuFileName >> bookFileName >> threadNum >> depth >> memoryMB;
+    if (threadNum <= 0 || depth < 0 || memoryMB <= 0) {
+        std::cerr << "Error: thread num = " << threadNum << ", depth = " << depth << ", memory = " << memoryMB << std::endl;
+        return;
+    }
+    std::ifstream ifs(kifuFileName.c_str(), std::ios::binary);
+    if (!ifs) {
+        std::cerr << "Error: cannot open " << kifuFileName << std::endl;
+        return;
+    }
+    const size_t runSize = std::max<size_t>(1024, (memoryMB << 20) / sizeof(BookRunEntry) / threadNum);
+    std::cout << "kifu_file_name: " << kifuFileName << "\n"
+              << "book_file_name: " << bookFileName << "\n"
+              << "thread_num: " << threadNum << "\n"
+              << "search_depth: " << depth << "\n"
+              << "run_entries: " << runSize << std::endl;
+    Timer t = Timer::currentTime();
+
+    // 1. 棋譜の再生と一時ファイルへの書き出し
+    Mutex ifsMutex;
+    std::atomic<s64> gameNum(0);
+    std::atomic<int> runNum(0);
+    std::atomic<bool> failed(false);
+    auto runFileName = [&bookFileName](const int i) { return bookFileName + ".run" + std::to_string(i); };
+    auto parse = [&] {
+        const int GamesPerRead = 256;
+        Position workPos(DefaultStartPositionSFEN, pos.searcher()->threads.main(), pos.searcher()->thisptr);
+        StateListPtr states;
+        std::vector<std::string> lines;
+        std::vector<BookRunEntry> run;
+        run.reserve(runSize);
+        auto spill = [&] {
+            if (!writeRun(run, runFileName(runNum++)))
+                failed = true;
+        };
+        while (!failed) {
+            lines.clear();
+            {
+                std::unique_lock<Mutex> lock(ifsMutex);
+                std::string line;
+                while (lines.size() < 2 * GamesPerRead && std::getline(ifs, line))
+                    lines.push_back(line);
+            }
+            if (lines.empty())
+                break;
+            if (lines.size() & 1) {
+                std::cout << IOLock << "!!! header only !!!" << std::endl << IOUnlock;
+                lines.pop_back();
+            }
+            for (size_t i = 0; i < lines.size(); i += 2) {
+                forEachWinnerMove(workPos, states, lines[i], lines[i + 1], [&](Position& pos, const Move move) {
+                        BookRunEntry re;
+                        re.hcp = pos.toHuffmanCodedPos();
+                        re.entry.key = Book::bookKey(pos);
+                        re.entry.fromToPro = static_cast<u16>(move.proFromAndTo());
+                        re.entry.count = 1;
+                        re.entry.score = ScoreZero;
+                        run.push_back(re);
+                        if (runSize <= run.size())
+                            spill();
+                    });
+            }
+            gameNum += lines.size() / 2;
+        }
+        if (!run.empty())
+            spill();
+    };
+    {
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threadNum; ++i)
+            workers.emplace_back(parse);
+        for (auto& th : workers)
+            th.join();
+    }
+    if (failed) {
+        std::cerr << "Error: cannot write run files " << runFileName(0) << ", ..." << std::endl;
+        return;
+    }
+    std::cout << "games: " << gameNum << ", runs: " << runNum << ", elapsed: " << t.elapsed() / 1000 << " [sec]" << std::endl;
+
+    // 2. 一時ファイルのマージ
+    // 点数を付ける時は、局面を持ったまま <定跡ファイル>.merged に書き出してから点数を付ける。
+    const std::string mergedFileName = bookFileName + ".merged";
+    std::ofstream ofs((depth == 0 ? bookFileName : mergedFileName).c_str(), std::ios::binary);
+    if (!ofs) {
+        std::cerr << "Error: cannot open " << (depth == 0 ? bookFileName : mergedFileName) << std::endl;
+        return;
+    }
+    s64 entryNum = 0;
+    {
+        std::vector<std::unique_ptr<RunReader> > readers;
+        for (int i = 0; i < runNum; ++i)
+            readers.emplace_back(new RunReader(runFileName(i)));
+        auto greater = [&readers](const int lhs, const int rhs) { return runEntryLess(readers[rhs]->front(), readers[lhs]->front()); };
+        std::priority_queue<int, std::vector<int>, decltype(greater)> heap(greater);
+        for (int i = 0; i < runNum; ++i)
+            if (!readers[i]->empty())
+                heap.push(i);
+
+        // 同じ key の定跡手は、BookEntry::count の値で降順に並べて書き出す。
+        std::vector<BookRunEntry> group;
+        auto flush = [&] {
+            std::stable_sort(group.begin(), group.end(), [](const BookRunEntry& lhs, const BookRunEntry& rhs) { return lhs.entry.count > rhs.entry.count; });
+            for (auto& re : group) {
+                if (depth == 0)
+                    ofs.write(reinterpret_cast<const char*>(&re.entry), sizeof(BookEntry));
+                else
+                    ofs.write(reinterpret_cast<const char*>(&re), sizeof(BookRunEntry));
+            }
+            entryNum += group.size();
+            group.clear();
+        };
+        while (!heap.empty()) {
+            const int i = heap.top();
+            heap.pop();
+            const BookRunEntry& re = readers[i]->front();
+            if (!group.empty() && group.back().entry.key != re.entry.key)
+                flush();
+            if (!group.empty() && group.back().entry.fromToPro == re.entry.fromToPro)
+                addCount(group.back().entry, re.entry.count);
+            else
+                group.push_back(re);
+            readers[i]->pop();
+            if (!readers[i]->empty())
+                heap.push(i);
+        }
+        flush();
+    }
+    for (int i = 0; i < runNum; ++i)
+        std::remove(runFileName(i).c_str());
+    ofs.close();
+    std::cout << "entries: " << entryNum << ", elapsed: " << t.elapsed() / 1000 << " [sec]" << std::endl;
+
+    // 3. 探索による点数付け
+    if (depth != 0) {
+        std::ifstream mergedIfs(mergedFileName.c_str(), std::ios::binary);
+        std::ofstream bookOfs(bookFileName.c_str(), std::ios::binary);
+        if (!mergedIfs || !bookOfs) {
+            std::cerr << "Error: cannot open " << mergedFileName << " or " << bookFileName << std::endl;
+            return;
+        }
+        BookSearchWorkers workers(pos, threadNum);
+        std::vector<BookRunEntry> batch(4096 * workers.size());
+        s64 scoredNum = 0;
+        while (mergedIfs) {
+            mergedIfs.read(reinterpret_cast<char*>(batch.data()), batch.size() * sizeof(BookRunEntry));
+            const size_t size = static_cast<size_t>(mergedIfs.gcount()) / sizeof(BookRunEntry);
+            workers.run(size, [&](Position& workPos, const size_t i) {
+                    batch[i].entry.score = searchBookMove(workPos, batch[i].hcp, batch[i].entry.fromToPro, depth);
+                });
+            for (size_t i = 0; i < size; ++i)
+                bookOfs.write(reinterpret_cast<const char*>(&batch[i].entry), sizeof(BookEntry));
+            scoredNum += size;
+            std::cout << "scored: " << scoredNum << " / " << entryNum << ", elapsed: " << t.elapsed() / 1000 << " [sec]" << std::endl;
+        }
+        mergedIfs.close();
+        std::remove(mergedFileName.c_str());
+    }
+
+    std::cout << "book making was done" << std::endl;
+}
+
+// 定跡の末端の局面を探索して、定跡を 1 手伸ばす。
+// book_think <定跡ファイル> <出力する定跡ファイル> [スレッド数] [探索の深さ] [探索局面数] [最大手数]
+//
+// 平手の初期局面から定跡を最大手数まで辿り、定跡手を指した後の局面で、定跡に無く、どの手を指しても定跡の局面にならないものを末端とする。
+// 末端の局面毎に、探索の深さ、探索局面数 (0 なら制限しない) の何れかに達するまで探索し、最善手と評価値を定跡手として出力する。
+// 出力は book.bin の形式で、新しく作った定跡手だけを 1 局面探索する毎に追記する。
+// 途中で止めても、同じ出力ファイルを指定して実行し直すと、出力済みの局面を飛ばして続きから探索する。
+// 出力は book_merge で元の定跡とマージする。繰り返すと定跡が 1 手ずつ伸びる。
+// 探索はスレッド毎に独立に行う。(USE_GLOBAL の時は makeBookParallel() と同じく 1 局面ずつ探索する。)
+void bookThink(Position& pos, std::istringstream& ssCmd) {
+    pos.searcher()->book.close(); // 書き出す定跡ファイルを mmap しているかも知れないので閉じる。
+    std::string bookFileName;
+    std::string outFileName;
+    int threadNum = std::max<int>(1, std::thread::hardware_concurrency());
+    Ply depth = 0;
+    s64 nodes = 1000000;
+    Ply maxPly = MaxPly;
+    ssCmd >> bookFileName >> outFileName >> threadNum >> depth >> nodes >> maxPly;
+    if (threadNum <= 0 || depth < 0 || nodes < 0 || (depth == 0 && nodes == 0)) {
+        std::cerr << "Error: thread num = " << threadNum << ", depth = " << depth << ", nodes = " << nodes << std::endl;
+        return;
+    }
+    Book book;
+    if (!book.open(bookFileName)) {
+        std::cerr << "Error: cannot open " << bookFileName << std::endl;
+        return;
+    }
+    Timer t = Timer::currentTime();
+
+    // 1. 末端の局面を集める。
+    std::vector<HuffmanCodedPos> leaves;
+    std::unordered_set<Key> leafKeys;
+    {
+        std::unordered_set<Key> visited;
+        Position root(DefaultStartPositionSFEN, pos.searcher()->threads.main(), pos.searcher()->thisptr);
+        BookEntry childMoves[MaxLegalMoves];
+        auto isLeaf = [&](Position& p) {
+            if (book.find(book.key(p), childMoves) != 0)
+                return false;
+            MoveList<Legal> ml(p);
+            if (ml.size() == 0)
+                return false; // 詰んでいる局面は探索しない。
+            for (; !ml.end(); ++ml) {
+                StateInfo st;
+                p.doMove(ml.move(), st);
+                const bool inBook = (book.find(book.key(p), childMoves) != 0);
+                p.undoMove(ml.move());
+                if (inBook)
+                    return false;
+            }
+            return true;
+        };
+        auto f = [&](Position& p, const BookEntry* moves, const size_t num) {
+            for (size_t i = 0; i < num; ++i) {
+                const Move move = move16toMove(Move(moves[i].fromToPro), p);
+                StateInfo st;
+                p.doMove(move, st);
+                if (isLeaf(p) && leafKeys.insert(Book::bookKey(p)).second)
+                    leaves.push_back(p.toHuffmanCodedPos());
+                p.undoMove(move);
+            }
+        };
+        walkBook(book, root, maxPly, visited, f);
+    }
+
+    // 2. 出力済みの局面を飛ばす。
+    std::unordered_set<Key> doneKeys;
+    {
+        std::ifstream ifs(outFileName.c_str(), std::ios::binary);
+        BookEntry entry;
+        while (ifs.read(reinterpret_cast<char*>(&entry), sizeof(entry)))
+            doneKeys.insert(entry.key);
+    }
+    if (!doneKeys.empty()) {
+        Position workPos(DefaultStartPositionSFEN, pos.searcher()->threads.main(), pos.searcher()->thisptr);
+        leaves.erase(std::remove_if(leaves.begin(), leaves.end(), [&](const HuffmanCodedPos& hcp) {
+                    return workPos.set(hcp, pos.searcher()->threads.main()) && doneKeys.count(Book::bookKey(workPos)) != 0;
+                }), leaves.end());
+    }
+    std::cout << "book_file_name: " << bookFileName << "\n"
+              << "out_file_name: " << outFileName << "\n"
+              << "thread_num: " << threadNum << "\n"
+              << "search_depth: " << depth << "\n"
+              << "search_nodes: " << nodes << "\n"
+              << "leaves: " << leafKeys.size() << ", done: " << leafKeys.size() - leaves.size() << ", elapsed: " << t.elapsed() / 1000 << " [sec]" << std::endl;
+
+    // 3. 末端の局面の探索
+    std::ofstream ofs(outFileName.c_str(), std::ios::binary | std::ios::app);
+    if (!ofs) {
+        std::cerr << "Error: cannot open " << outFileName << std::endl;
+        return;
+    }
+    Mutex ofsMutex;
+    s64 searchedNum = 0;
+    BookSearchWorkers workers(pos, threadNum);
+    LimitsType limits;
+    limits.depth = depth;
+    limits.nodes = nodes;
+    workers.run(leaves.size(), [&](Position& workPos, const size_t i) {
+            if (!workPos.set(leaves[i], workPos.searcher()->threads.main()))
+                return;
+            BookEntry entry;
+            const Move move = searchBookPosition(workPos, limits, entry.score);
+            if (!move)
+                return;
+            entry.key = Book::bookKey(workPos);
+            entry.fromToPro = static_cast<u16>(move.proFromAndTo());
+            entry.count = 1;
+            // 1 局面毎に書き出すので、途中で止めても探索済みの局面は失われない。
+            std::unique_lock<Mutex> lock(ofsMutex);
+            ofs.write(reinterpret_cast<const char*>(&entry), sizeof(BookEntry));
+            ofs.flush();
+            if (++searchedNum % 100 == 0 || searchedNum == static_cast<s64>(leaves.size()))
+                std::cout << IOLock << "searched: " << searchedNum << " / " << leaves.size() << ", elapsed: " << t.elapsed() / 1000 << " [sec]" << std::endl << IOUnlock;
+        });
+    if (!ofs) {
+        std::cerr << "Error: cannot write " << outFileName << std::endl;
+        return;
+    }
+    std::cout << "book thinking was done" << std::endl;
+}
 #endif
@@ -24,6 +24,7 @@
 
 #include "position.hpp"
 #include "mt64bit.hpp"
+#include "tt.hpp"
 
 struct BookEntry {
     Key key;
@@ -32,27 +33,159 @@ struct BookEntry {
     Score score;
 };
 
-class Book : private std::ifstream {
+// 定跡の局面の key の種類。
+enum BookKeyType : u32 {
+    BookKeyBook,    // Book::bookKey()。手番側の持ち駒しか区別しない。book.bin は常にこれ。
+    BookKeyPosition // Position::getKey()。探索中の局面の key がそのまま使える。compact 形式でのみ使える。
+};
+
+// 局面毎にまとめた定跡ファイル (compact 形式) のヘッダ。convertBook() で book.bin から作る。
+// version 1 のヘッダは keyType 以降が無い 48 byte で、key は BookKeyBook。
+// ヘッダの後に以下が続く。全てリトルエンディアン。
+// blockSize == 0 の時 (key をそのまま持つ。検索は book.bin と同じ速さ)
+//   Key keys[positionNum];             // 局面の key の昇順
+//   u32 moveBegins[positionNum + 1];   // 各局面の最初の定跡手の位置
+// blockSize != 0 の時 (key を差分で持つ。小さくなるがブロック内を先頭から読むので検索は遅い)
+//   CompactBookBlock blocks[blockNum]; // blockSize 局面毎の索引
+//   u8 keys[keyBytes];                 // 局面毎に、前の局面の key との差分と定跡手の数を LEB128 で並べたもの
+//                                      // (各ブロックの最初の局面の key の差分は 0)。2 byte 境界まで 0 を詰める。
+// その後に定跡手の各要素の配列が続く。
+//   u16 fromToPro[moveNum];
+//   u16 count[moveNum];
+//   s16 score[moveNum];
+// 同じ局面の定跡手は book.bin での順番のまま並ぶ。
+struct CompactBookHeader {
+    char magic[8];
+    u32 version;
+    u32 blockSize;
+    u64 positionNum;
+    u64 moveNum;
+    u64 blockNum;
+    u64 keyBytes;
+    u32 keyType; // BookKeyType
+    u32 reserved;
+};
+static_assert(sizeof(CompactBookHeader) == 56, "");
+
+struct CompactBookBlock {
+    Key firstKey;  // ブロックの最初の局面の key
+    u32 keyOffset; // ブロックの最初の局面の keys での位置
+    u32 firstMove; // ブロックの最初の定跡手の位置
+};
+static_assert(sizeof(CompactBookBlock) == 16, "");
+
+const char CompactBookMagic[8] = {'A', 'P', 'E', 'R', 'Y', 'B', 'K', 'C'};
+const u32 CompactBookVersion = 2;
+const size_t CompactBookHeaderV1Size = 48;
+
+// 定跡ファイルが書き換えられたかを調べる為の、ファイルの大きさ、更新時刻、inode。
+struct BookFileStamp {
+    u64 size;
+    s64 mtime;
+    s64 mtimeNsec;
+    u64 inode;
+    bool operator == (const BookFileStamp& rhs) const {
+        return size == rhs.size && mtime == rhs.mtime && mtimeNsec == rhs.mtimeNsec && inode == rhs.inode;
+    }
+};
+
+// 定跡ファイルは 1 度だけ読み込み(mmap 出来る環境では mmap し)、探索開始時にはファイルを読まない。
+// mmap した定跡は同じファイルを使う複数のエンジンのプロセスで共有される。
+// book.bin の形式の場合、key の検索は、異なる key を Eytzinger 順 (二分探索木を幅優先で並べた順) に並べた索引で行う。
+// compact 形式で key を差分で持つ場合は、ブロックの最初の key を Eytzinger 順に並べた索引でブロックを探し、ブロック内を先頭から読む。
+class Book {
 public:
-    Book() : random_(std::chrono::system_clock::now().time_since_epoch().count()) {}
+    Book() : random_(std::chrono::system_clock::now().time_since_epoch().count()),
+             entries_(nullptr), size_(0), mapped_(nullptr), mappedSize_(0), keyType_(BookKeyBook), compact_(nullptr) {}
+    Book(const Book&) = delete;
+    Book& operator = (const Book&) = delete;
+    ~Book() { close(); }
     std::tuple<Move, Score> probe(const Position& pos, const std::string& fName, const bool pickBest);
+    // fName を定跡として読み込む。既に読み込んでいれば何もしない。isready で呼んでおく。
+    bool open(const std::string& fName);
+    // mmap した定跡ファイルを切り詰めて書き直すと、次の probe() で SIGBUS になる。
+    // 定跡ファイルを書き出すコマンドは、書き出す前に探索で使う定跡を閉じておく。
+    void close();
+    // key の定跡手を moves に書き込み、その数を返す。moves は MaxLegalMoves 個以上の要素を持つこと。
+    size_t find(const Key key, BookEntry* moves) const;
+    // 定跡の全ての局面の key を返す。
+    std::vector<Key> keys() const;
+    BookKeyType keyType() const { return keyType_; }
+    // pos を定跡で引く為の key。定跡が Position::getKey() を key にしていれば、局面の key をそのまま使う。
+    Key key(const Position& pos) const { return (keyType_ == BookKeyPosition ? pos.getKey() : bookKey(pos)); }
     static void init();
     static Key bookKey(const Position& pos);
 
 private:
-    bool open(const char* fName);
-    void binary_search(const Key key);
+    bool buildIndex();
+    bool openCompact(const char* data, const size_t bytes);
+    size_t findIndex(const Key key) const;
+    size_t findCompact(const Key key, BookEntry* moves) const;
 
     static MT64bit mt64bit_; // 定跡のhash生成用なので、seedは固定でデフォルト値を使う。
     MT64bit random_; // 時刻をseedにして色々指すようにする。
     std::string fileName_;
+    BookFileStamp fileStamp_; // 読み込んだ時の fileName_ の大きさと更新時刻。変わっていれば読み込み直す。
+    const BookEntry* entries_; // key の昇順に並んだ定跡手
     size_t size_;
+    void* mapped_; // mmap した領域。mmap していなければ nullptr で、ファイルの中身は buffer_ にある。
+    size_t mappedSize_;
+    std::vector<u64> buffer_; // BookEntry, CompactBookBlock の境界に揃える為に u64 で確保する。
+    std::vector<Key> indexKeys_; // 異なる key (差分で持つ compact 形式ではブロックの最初の key) を Eytzinger 順に並べたもの。[0] は使わない。
+    std::vector<u32> indexEntries_; // indexKeys_ の各 key の最初の定跡手 (compact 形式では局面かブロック) の位置
+
+    BookKeyType keyType_;
+    const CompactBookHeader* compact_; // compact 形式で無ければ nullptr
+    const Key* keys_;
+    const u32* moveBegins_;
+    const CompactBookBlock* blocks_;
+    const u8* keyBytes_;
+    const u16* fromToPros_;
+    const u16* counts_;
+    const s16* scores_;
 
     static Key ZobPiece[PieceNone][SquareNum];
     static Key ZobHand[HandPieceNum][19];
     static Key ZobTurn;
 };
 
+// 探索中に定跡の局面を引く為の、Position::getKey() を key にした読み込み専用のハッシュ表。
+// Book::bookKey() の定跡は、局面を平手の初期局面から定跡手で辿って作るので、初期局面から辿れない局面は入らない。
+// Position::getKey() の定跡は、全ての局面をそのまま入れる。
+// score は手番側から見た、その局面の定跡手の最大の点数。
+// b や探索深さ 0 の make_book で作った定跡は点数を持たない (全て ScoreZero) ので、そのような局面は読み込まない。
+struct BookHashEntry {
+    Key key; // 0 なら空き。
+    u16 move16;
+    s16 score;
+};
+
+class BookHash {
+public:
+    // book の局面を読み込み、局面数を返す。Book::bookKey() の定跡は平手の初期局面から maxPly 手まで辿る。
+    // 探索では、読み込んだ局面の score を depth の深さで探索した値として扱う。
+    size_t init(Book& book, const Position& pos, const Ply maxPly, const Depth depth);
+    void clear() { std::vector<BookHashEntry>().swap(table_); }
+    bool empty() const { return table_.empty(); }
+    Depth depth() const { return depth_; }
+    const BookHashEntry* probe(const Key key) const {
+        if (table_.empty())
+            return nullptr;
+        for (size_t i = key & mask_; table_[i].key != 0; i = (i + 1) & mask_)
+            if (table_[i].key == key)
+                return &table_[i];
+        return nullptr;
+    }
+
+private:
+    std::vector<BookHashEntry> table_;
+    size_t mask_;
+    Depth depth_;
+};
+
 void makeBook(Position& pos, std::istringstream& ssCmd);
+void makeBookParallel(Position& pos, std::istringstream& ssCmd);
+void bookThink(Position& pos, std::istringstream& ssCmd);
+void convertBook(Position& pos, std::istringstream& ssCmd);
 
 #endif // #ifndef APERY_BOOK_HPP
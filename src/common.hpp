@@ -34,6 +34,7 @@
 #include <iterator>
 #include <map>
 #include <set>
+#include <queue>
 #include <unordered_map>
 #include <unordered_set>
 #include <random>
@@ -55,7 +56,7 @@
 #include <cfloat>
 //#include <boost/align/aligned_alloc.hpp>
 
-#if defined HAVE_BMI2
+#if defined HAVE_BMI2 || defined HAVE_AVX2
 #include <immintrin.h>
 #endif
 
@@ -23,14 +23,437 @@
 #include "position.hpp"
 #include "search.hpp"
 #include "thread.hpp"
+#include "numa.hpp"
+#if !defined _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 EvalIndex KPPIndexBeginArray[fe_end];
 bool KPPIndexIsBlackArray[fe_end];
 
 bool Evaluator::allocated = false;
+bool Evaluator::loaded = false;
 EvalElementType Evaluator::KPP[SquareNum][fe_end][fe_end];
 EvalElementType Evaluator::KKP[SquareNum][SquareNum][fe_end];
+std::vector<EvalTables> Evaluator::replicas;
 EvaluateHashTable g_evalTable;
+#if defined LEARN
+Key g_evalHashSalt = 0;
+#endif
+
+namespace {
+    // 評価関数ファイルの並列読み込みとチェックサム計算の単位。
+    // チェックサムの値がスレッド数に依存しないように、ブロックの大きさは固定にする。
+    const u64 EvalFileBlockSize = UINT64_C(1) << 20; // 1MB
+    const u64 EvalFileChunkSize = EvalFileBlockSize * 64; // 1スレッドが一度に読み込む大きさ
+
+    inline int evalFileThreadNum() {
+        return std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    }
+
+    inline u64 mix64(u64 x) {
+        x ^= x >> 33;
+        x *= UINT64_C(0xff51afd7ed558ccd);
+        x ^= x >> 33;
+        x *= UINT64_C(0xc4ceb9fe1a85ec53);
+        x ^= x >> 33;
+        return x;
+    }
+    // 1 ブロック分のハッシュ値。ブロックの番号も混ぜて、ブロックの入れ替わりも検出する。
+    u64 blockChecksum(const char* data, const u64 size, const u64 blockIndex) {
+        u64 h = mix64(blockIndex + UINT64_C(0x9e3779b97f4a7c15));
+        u64 i = 0;
+        for (; i + sizeof(u64) <= size; i += sizeof(u64)) {
+            u64 w;
+            memcpy(&w, data + i, sizeof(w));
+            h = (h ^ w) * UINT64_C(0x100000001b3);
+            h ^= h >> 29;
+        }
+        for (; i < size; ++i)
+            h = (h ^ static_cast<u8>(data[i])) * UINT64_C(0x100000001b3);
+        return mix64(h ^ size);
+    }
+    // ブロック毎のハッシュ値の和をチェックサムとする。和なので計算するスレッドの順番に依らない。
+    u64 rangeChecksum(const char* data, const u64 begin, const u64 end) {
+        u64 sum = 0;
+        for (u64 b = begin; b < end; b += EvalFileBlockSize)
+            sum += blockChecksum(data + b, std::min(EvalFileBlockSize, end - b), b / EvalFileBlockSize);
+        return sum;
+    }
+    u64 evalChecksum(const char* data, const u64 size) {
+        std::atomic<u64> chunkIndex(0);
+        std::atomic<u64> sum(0);
+        auto func = [&] {
+            u64 localSum = 0;
+            for (u64 begin; (begin = chunkIndex++ * EvalFileChunkSize) < size;)
+                localSum += rangeChecksum(data, begin, std::min(begin + EvalFileChunkSize, size));
+            sum += localSum;
+        };
+        std::vector<std::thread> threads(evalFileThreadNum());
+        for (auto& th : threads)
+            th = std::thread(func);
+        for (auto& th : threads)
+            th.join();
+        return sum;
+    }
+    u64 evalChecksum(const char* kpp, const u64 kppSize, const char* kkp, const u64 kkpSize) {
+        return evalChecksum(kpp, kppSize) ^ mix64(evalChecksum(kkp, kkpSize));
+    }
+
+    u64 evalFileSize(const std::string& path) {
+        std::ifstream ifs(path.c_str(), std::ios::binary | std::ios::ate);
+        if (!ifs)
+            return 0;
+        return static_cast<u64>(ifs.tellg());
+    }
+
+    // path の offset の位置から size byte を複数スレッドで dst に読み込む。
+    // POSIX では 1つの fd を共有して pread で読み、それ以外ではスレッド毎に std::ifstream を開く。
+    // 2GB を超える read が出来ない環境もあるので、一度に読む大きさは EvalFileChunkSize までにする。
+    bool parallelReadFile(const std::string& path, char* dst, const u64 offset, const u64 size) {
+#if !defined _WIN32
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+#endif
+        std::atomic<u64> chunkIndex(0);
+        std::atomic<bool> ok(true);
+        auto func = [&] {
+#if defined _WIN32
+            std::ifstream ifs(path.c_str(), std::ios::binary);
+            if (!ifs) {
+                ok = false;
+                return;
+            }
+#endif
+            for (u64 begin; ok && (begin = chunkIndex++ * EvalFileChunkSize) < size;) {
+                const u64 chunkSize = std::min(EvalFileChunkSize, size - begin);
+#if defined _WIN32
+                ifs.seekg(offset + begin, std::ios::beg);
+                ifs.read(dst + begin, chunkSize);
+                if (static_cast<u64>(ifs.gcount()) != chunkSize)
+                    ok = false;
+#else
+                for (u64 done = 0; done < chunkSize;) {
+                    const ssize_t r = pread(fd, dst + begin + done, chunkSize - done, offset + begin + done);
+                    if (r <= 0) {
+                        ok = false;
+                        break;
+                    }
+                    done += r;
+                }
+#endif
+            }
+        };
+        std::vector<std::thread> threads(evalFileThreadNum());
+        for (auto& th : threads)
+            th = std::thread(func);
+        for (auto& th : threads)
+            th.join();
+#if !defined _WIN32
+        close(fd);
+#endif
+        return ok;
+    }
+
+    // src から size byte を複数スレッドで dst にコピーする。
+    void parallelCopy(char* dst, const char* src, const u64 size) {
+        std::atomic<u64> chunkIndex(0);
+        auto func = [&] {
+            for (u64 begin; (begin = chunkIndex++ * EvalFileChunkSize) < size;)
+                memcpy(dst + begin, src + begin, std::min(EvalFileChunkSize, size - begin));
+        };
+        std::vector<std::thread> threads(evalFileThreadNum());
+        for (auto& th : threads)
+            th = std::thread(func);
+        for (auto& th : threads)
+            th.join();
+    }
+
+    // 評価関数ファイルの読み込み先。
+    // まだ評価関数を読み込んでいなければ、KPP, KKP に直接読み込む。読み込みに失敗したら 0 に戻す。
+    // 読み込み済みなら一時領域に読み込み、確認が全て済んでから KPP, KKP にコピーして、途中で失敗しても使っている評価関数を壊さないようにする。
+    class EvalReadBuffer {
+    public:
+        EvalReadBuffer()
+            : staged_(Evaluator::loaded),
+              committed_(false),
+              kpp(staged_ ? static_cast<char*>(malloc(sizeof(Evaluator::KPP))) : reinterpret_cast<char*>(Evaluator::KPP)),
+              kkp(staged_ ? static_cast<char*>(malloc(sizeof(Evaluator::KKP))) : reinterpret_cast<char*>(Evaluator::KKP)) {}
+        ~EvalReadBuffer() {
+            if (staged_) {
+                free(kpp);
+                free(kkp);
+            }
+            else if (!committed_) {
+                memset(Evaluator::KPP, 0, sizeof(Evaluator::KPP));
+                memset(Evaluator::KKP, 0, sizeof(Evaluator::KKP));
+            }
+        }
+        bool allocated() const { return kpp != nullptr && kkp != nullptr; }
+        void commit() {
+            if (staged_) {
+                parallelCopy(reinterpret_cast<char*>(Evaluator::KPP), kpp, sizeof(Evaluator::KPP));
+                parallelCopy(reinterpret_cast<char*>(Evaluator::KKP), kkp, sizeof(Evaluator::KKP));
+            }
+            committed_ = true;
+            Evaluator::loaded = true;
+        }
+
+    private:
+        const bool staged_;
+        bool committed_;
+
+    public:
+        char* const kpp;
+        char* const kkp;
+
+    private:
+        EvalReadBuffer(const EvalReadBuffer&);
+        EvalReadBuffer& operator = (const EvalReadBuffer&);
+    };
+
+    // 2GB を超えるファイルは Msys2 環境では std::ofstream では一度に write 出来ず、分割して write する必要がある。
+    // 書き込みに失敗したら false を返す。
+    bool writeChunked(std::ofstream& ofs, const char* data, const u64 size) {
+        for (u64 i = 0; i < size && ofs; i += (1 << 30))
+            ofs.write(data + i, std::min<u64>(1 << 30, size - i));
+        return static_cast<bool>(ofs);
+    }
+}
+
+bool Evaluator::readEvalFile(const std::string& dirName) {
+    const std::string path = addSlashIfNone(dirName) + EvalFileName;
+    if (fileExist(path))
+        return readEvalContainerFile(path);
+    return readEvalRawFile(dirName);
+}
+
+bool Evaluator::readEvalContainerFile(const std::string& path) {
+    EvalFileHeader header;
+    {
+        std::ifstream ifs(path.c_str(), std::ios::binary);
+        if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            std::cerr << "Error: " << path << " is too small to have a header." << std::endl;
+            return false;
+        }
+    }
+    if (memcmp(header.magic, EvalFileMagic, sizeof(EvalFileMagic)) != 0) {
+        std::cerr << "Error: " << path << " is not an eval file." << std::endl;
+        return false;
+    }
+    if (header.version != EvalFileVersion || header.headerSize != sizeof(EvalFileHeader)) {
+        std::cerr << "Error: " << path << " has unsupported version " << header.version << "." << std::endl;
+        return false;
+    }
+    if (header.feEnd != fe_end || header.squareNum != SquareNum
+        || header.elementType != EvalFileS16x2 || header.elementSize != sizeof(EvalElementType)
+        || header.kppSize != sizeof(KPP) || header.kkpSize != sizeof(KKP))
+    {
+        std::cerr << "Error: " << path << " has different dimensions. fe_end: " << header.feEnd
+                  << ", SquareNum: " << header.squareNum << ", element size: " << header.elementSize << std::endl;
+        return false;
+    }
+    if (evalFileSize(path) != sizeof(EvalFileHeader) + header.kppSize + header.kkpSize) {
+        std::cerr << "Error: " << path << " is truncated." << std::endl;
+        return false;
+    }
+    EvalReadBuffer buffer;
+    if (!buffer.allocated()) {
+        std::cerr << "Error: cannot allocate memory to read " << path << std::endl;
+        return false;
+    }
+    if (!parallelReadFile(path, buffer.kpp, sizeof(EvalFileHeader), header.kppSize)
+        || !parallelReadFile(path, buffer.kkp, sizeof(EvalFileHeader) + header.kppSize, header.kkpSize))
+    {
+        std::cerr << "Error: cannot read " << path << std::endl;
+        return false;
+    }
+    if (evalChecksum(buffer.kpp, sizeof(KPP), buffer.kkp, sizeof(KKP)) != header.checksum) {
+        std::cerr << "Error: checksum mismatch in " << path << std::endl;
+        return false;
+    }
+    buffer.commit();
+    return true;
+}
+
+// 従来形式はヘッダが無いので、ファイルサイズだけ確認する。
+// KPP.bin だけ読めて KKP.bin で失敗した時に評価関数が混ざらないよう、両方読めてから KPP, KKP に反映する。
+bool Evaluator::readEvalRawFile(const std::string& dirName) {
+    const std::string kppPath = addSlashIfNone(dirName) + "KPP.bin";
+    const std::string kkpPath = addSlashIfNone(dirName) + "KKP.bin";
+    // 大きな一時領域を確保する前に、両方のファイルがあって大きさが正しいか確認しておく。
+#define FOO(x, path) {                                                  \
+        if (!fileExist(path))                                           \
+            return false;                                               \
+        if (evalFileSize(path) != sizeof(x ## EvalElementType2)) {      \
+            std::cerr << "Error: " << path << " size is " << evalFileSize(path) \
+                      << ", expected " << sizeof(x ## EvalElementType2) << std::endl; \
+            return false;                                               \
+        }                                                               \
+    }
+    FOO(KPP, kppPath);
+    FOO(KKP, kkpPath);
+#undef FOO
+    EvalReadBuffer buffer;
+    if (!buffer.allocated()) {
+        std::cerr << "Error: cannot allocate memory to read eval files in " << dirName << std::endl;
+        return false;
+    }
+#define FOO(x, path, dst) {                                             \
+        if (!parallelReadFile(path, dst, 0, sizeof(x ## EvalElementType2))) { \
+            std::cerr << "Error: cannot read " << path << std::endl;    \
+            return false;                                               \
+        }                                                               \
+    }
+    FOO(KPP, kppPath, buffer.kpp);
+    FOO(KKP, kkpPath, buffer.kkp);
+#undef FOO
+    buffer.commit();
+    return true;
+}
+
+bool Evaluator::writeEvalFile(const std::string& dirName) {
+#define FOO(x) {                                                        \
+        const std::string path = addSlashIfNone(dirName) + #x ".bin";   \
+        std::ofstream fs(path.c_str(), std::ios::binary);               \
+        if (!fs) {                                                      \
+            std::cerr << "Error: cannot open " << path << std::endl;    \
+            return false;                                               \
+        }                                                               \
+        const bool ok = writeChunked(fs, reinterpret_cast<const char*>(x), sizeof(x ## EvalElementType2)); \
+        fs.close();                                                     \
+        if (!ok || fs.fail()) {                                         \
+            std::cerr << "Error: cannot write " << path << std::endl;   \
+            return false;                                               \
+        }                                                               \
+    }
+    FOO(KPP);
+    FOO(KKP);
+#undef FOO
+    return true;
+}
+
+void Evaluator::replicate(const int nodeNum) {
+    for (size_t node = 1; node < replicas.size(); ++node) {
+        if (replicas[node].kpp == KPP)
+            continue; // 複製に失敗して KPP, KKP 自身を指している。
+        free(const_cast<KPPEvalElementType1*>(replicas[node].kpp));
+        free(const_cast<KKPEvalElementType1*>(replicas[node].kkp));
+    }
+    replicas.assign(1, EvalTables{KPP, KKP});
+    if (nodeNum <= 1)
+        return;
+
+    replicas.resize(nodeNum);
+    // 確保と書き込みをそのノードに固定したスレッドで行い、first touch でノードのメモリに載せる。
+    std::vector<std::thread> threads;
+    for (int node = 1; node < nodeNum; ++node) {
+        threads.emplace_back([node] {
+            bindThisThreadToNumaNode(node);
+            auto kpp = static_cast<KPPEvalElementType1*>(malloc(sizeof(KPP)));
+            auto kkp = static_cast<KKPEvalElementType1*>(malloc(sizeof(KKP)));
+            if (kpp == nullptr || kkp == nullptr) {
+                std::cerr << "Failed to allocate eval replica for NUMA node " << node << std::endl;
+                free(kpp);
+                free(kkp);
+                replicas[node] = EvalTables{KPP, KKP};
+                return;
+            }
+            memcpy(kpp, KPP, sizeof(KPP));
+            memcpy(kkp, KKP, sizeof(KKP));
+            replicas[node] = EvalTables{kpp, kkp};
+        });
+    }
+    for (auto& th : threads)
+        th.join();
+}
+
+void EvaluateHashShard::resize(const size_t mbSize) {
+    const size_t newSize = size_t(1) << msb(std::max<size_t>((mbSize * 1024 * 1024) / sizeof(EvaluateHashEntry), 1));
+    if (table_ != nullptr && newSize == mask_ + 1)
+        return;
+    allocate(newSize);
+}
+
+// 新しく確保したページは最初に書き込んだスレッドの NUMA ノードに割り当てられるので、ここでは書き込まない。
+// POSIX では mmap して、解放した時に確実に OS にページを返す。
+void EvaluateHashShard::allocate(const size_t entryNum) {
+    release();
+    const size_t bytes = entryNum * sizeof(EvaluateHashEntry);
+#if !defined _WIN32
+    mem_ = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem_ == MAP_FAILED)
+        mem_ = nullptr;
+    table_ = static_cast<EvaluateHashEntry*>(mem_); // ページの境界なのでキャッシュラインに揃っている。
+#else
+    mem_ = calloc(bytes + CacheLineSize - 1, 1);
+    table_ = reinterpret_cast<EvaluateHashEntry*>((uintptr_t(mem_) + CacheLineSize - 1) & ~(CacheLineSize - 1));
+#endif
+    if (!mem_) {
+        std::cerr << "Failed to allocate eval hash: " << (bytes >> 20) << "MB";
+        exit(EXIT_FAILURE);
+    }
+    mask_ = entryNum - 1;
+}
+
+void EvaluateHashShard::release() {
+    if (mem_ == nullptr)
+        return;
+#if !defined _WIN32
+    munmap(mem_, (mask_ + 1) * sizeof(EvaluateHashEntry));
+#else
+    free(mem_);
+#endif
+    mem_ = nullptr;
+    table_ = nullptr;
+}
+
+bool Evaluator::writeEvalContainerFile(const std::string& dirName) {
+    EvalFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EvalFileMagic, sizeof(EvalFileMagic));
+    header.version = EvalFileVersion;
+    header.headerSize = sizeof(EvalFileHeader);
+    header.feEnd = fe_end;
+    header.squareNum = SquareNum;
+    header.elementType = EvalFileS16x2;
+    header.elementSize = sizeof(EvalElementType);
+    header.kppSize = sizeof(KPP);
+    header.kkpSize = sizeof(KKP);
+    header.checksum = evalChecksum(reinterpret_cast<const char*>(KPP), sizeof(KPP), reinterpret_cast<const char*>(KKP), sizeof(KKP));
+
+    // 書き込みの途中で失敗しても既存の eval.bin を壊さないよう、一時ファイルに書き出してから置き換える。
+    const std::string path = addSlashIfNone(dirName) + EvalFileName;
+    const std::string tmpPath = path + ".tmp";
+    std::ofstream ofs(tmpPath.c_str(), std::ios::binary);
+    if (!ofs) {
+        std::cerr << "Error: cannot open " << tmpPath << std::endl;
+        return false;
+    }
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    bool ok = (ofs
+               && writeChunked(ofs, reinterpret_cast<const char*>(KPP), sizeof(KPP))
+               && writeChunked(ofs, reinterpret_cast<const char*>(KKP), sizeof(KKP)));
+    ofs.close();
+    ok = (ok && !ofs.fail());
+    if (!ok) {
+        std::cerr << "Error: cannot write " << tmpPath << std::endl;
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+#if defined _WIN32
+    std::remove(path.c_str()); // Windows の rename() は既存のファイルを上書きしない。
+#endif
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "Error: cannot rename " << tmpPath << " to " << path << std::endl;
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
 
 const EvalIndex kppArray[31] = {
     (EvalIndex)0, f_pawn,   f_lance,  f_knight,
@@ -53,16 +476,17 @@ const EvalIndex kppHandArray[ColorNum][HandPieceNum] = {
 
 namespace {
     EvalSum doapc(const Position& pos, const EvalIndex index[2]) {
+        const EvalTables& tables = pos.thisThread()->evalTables;
         const Square sq_bk = pos.kingSquare(Black);
         const Square sq_wk = pos.kingSquare(White);
         const EvalIndex* list0 = pos.cplist0();
         const EvalIndex* list1 = pos.cplist1();
 
         EvalSum sum;
-        sum.p[2][0] = Evaluator::KKP[sq_bk][sq_wk][index[0]][0];
-        sum.p[2][1] = Evaluator::KKP[sq_bk][sq_wk][index[0]][1];
-        const auto* pkppb = Evaluator::KPP[sq_bk         ][index[0]];
-        const auto* pkppw = Evaluator::KPP[inverse(sq_wk)][index[1]];
+        sum.p[2][0] = tables.kkp[sq_bk][sq_wk][index[0]][0];
+        sum.p[2][1] = tables.kkp[sq_bk][sq_wk][index[0]][1];
+        const auto* pkppb = tables.kpp[sq_bk         ][index[0]];
+        const auto* pkppw = tables.kpp[inverse(sq_wk)][index[1]];
 #if defined USE_AVX2_EVAL || defined USE_SSE_EVAL
         sum.m[0] = _mm_set_epi32(0, 0, *reinterpret_cast<const s32*>(&pkppw[list1[0]][0]), *reinterpret_cast<const s32*>(&pkppb[list0[0]][0]));
         sum.m[0] = _mm_cvtepi16_epi32(sum.m[0]);
@@ -86,10 +510,11 @@ namespace {
         return sum;
     }
     std::array<s32, 2> doablack(const Position& pos, const EvalIndex index[2]) {
+        const EvalTables& tables = pos.thisThread()->evalTables;
         const Square sq_bk = pos.kingSquare(Black);
         const EvalIndex* list0 = pos.cplist0();
 
-        const auto* pkppb = Evaluator::KPP[sq_bk         ][index[0]];
+        const auto* pkppb = tables.kpp[sq_bk         ][index[0]];
         std::array<s32, 2> sum = {{pkppb[list0[0]][0], pkppb[list0[0]][1]}};
         for (int i = 1; i < pos.nlist(); ++i) {
             sum[0] += pkppb[list0[i]][0];
@@ -98,10 +523,11 @@ namespace {
         return sum;
     }
     std::array<s32, 2> doawhite(const Position& pos, const EvalIndex index[2]) {
+        const EvalTables& tables = pos.thisThread()->evalTables;
         const Square sq_wk = pos.kingSquare(White);
         const EvalIndex* list1 = pos.cplist1();
 
-        const auto* pkppw = Evaluator::KPP[inverse(sq_wk)][index[1]];
+        const auto* pkppw = tables.kpp[inverse(sq_wk)][index[1]];
         std::array<s32, 2> sum = {{pkppw[list1[0]][0], pkppw[list1[0]][1]}};
         for (int i = 1; i < pos.nlist(); ++i) {
             sum[0] += pkppw[list1[i]][0];
@@ -161,6 +587,7 @@ namespace {
 #endif
 
     bool calcDifference(Position& pos, SearchStack* ss) {
+        const EvalTables& tables = pos.thisThread()->evalTables;
 #if defined INANIWA_SHIFT
         if (pos.csearcher()->inaniwaFlag != NotInaniwa) return false;
 #endif
@@ -178,7 +605,7 @@ namespace {
             diff.p[2][1] = 0;
             diff.p[2][0] += pos.material() * FVScale;
             if (pos.turn() == Black) {
-                const auto* ppkppw = Evaluator::KPP[inverse(sq_wk)];
+                const auto* ppkppw = tables.kpp[inverse(sq_wk)];
                 const EvalIndex* list1 = pos.plist1();
                 diff.p[1][0] = 0;
                 diff.p[1][1] = 0;
@@ -189,8 +616,8 @@ namespace {
                         const int l1 = list1[j];
                         diff.p[1] += pkppw[l1];
                     }
-                    diff.p[2][0] -= Evaluator::KKP[inverse(sq_wk)][inverse(sq_bk)][k1][0];
-                    diff.p[2][1] += Evaluator::KKP[inverse(sq_wk)][inverse(sq_bk)][k1][1];
+                    diff.p[2][0] -= tables.kkp[inverse(sq_wk)][inverse(sq_bk)][k1][0];
+                    diff.p[2][1] += tables.kkp[inverse(sq_wk)][inverse(sq_bk)][k1][1];
                 }
 
                 if (pos.cl().size == 2) {
@@ -202,7 +629,7 @@ namespace {
                 }
             }
             else {
-                const auto* ppkppb = Evaluator::KPP[sq_bk         ];
+                const auto* ppkppb = tables.kpp[sq_bk         ];
                 const EvalIndex* list0 = pos.plist0();
                 diff.p[0][0] = 0;
                 diff.p[0][1] = 0;
@@ -213,7 +640,7 @@ namespace {
                         const int l0 = list0[j];
                         diff.p[0] += pkppb[l0];
                     }
-                    diff.p[2] += Evaluator::KKP[sq_bk][sq_wk][k0];
+                    diff.p[2] += tables.kkp[sq_bk][sq_wk][k0];
                 }
 
                 if (pos.cl().size == 2) {
@@ -237,8 +664,8 @@ namespace {
             else {
                 assert(pos.cl().size == 2);
                 diff += doapc(pos, pos.cl().clistpair[1].newlist);
-                diff.p[0] -= Evaluator::KPP[pos.kingSquare(Black)         ][pos.cl().clistpair[0].newlist[0]][pos.cl().clistpair[1].newlist[0]];
-                diff.p[1] -= Evaluator::KPP[inverse(pos.kingSquare(White))][pos.cl().clistpair[0].newlist[1]][pos.cl().clistpair[1].newlist[1]];
+                diff.p[0] -= tables.kpp[pos.kingSquare(Black)         ][pos.cl().clistpair[0].newlist[0]][pos.cl().clistpair[1].newlist[0]];
+                diff.p[1] -= tables.kpp[inverse(pos.kingSquare(White))][pos.cl().clistpair[0].newlist[1]][pos.cl().clistpair[1].newlist[1]];
                 const int listIndex_cap = pos.cl().listindex[1];
                 pos.plist0()[listIndex_cap] = pos.cl().clistpair[1].oldlist[0];
                 pos.plist1()[listIndex_cap] = pos.cl().clistpair[1].oldlist[1];
@@ -247,8 +674,8 @@ namespace {
                 pos.plist1()[listIndex] = pos.cl().clistpair[0].oldlist[1];
                 diff -= doapc(pos, pos.cl().clistpair[0].oldlist);
                 diff -= doapc(pos, pos.cl().clistpair[1].oldlist);
-                diff.p[0] += Evaluator::KPP[pos.kingSquare(Black)         ][pos.cl().clistpair[0].oldlist[0]][pos.cl().clistpair[1].oldlist[0]];
-                diff.p[1] += Evaluator::KPP[inverse(pos.kingSquare(White))][pos.cl().clistpair[0].oldlist[1]][pos.cl().clistpair[1].oldlist[1]];
+                diff.p[0] += tables.kpp[pos.kingSquare(Black)         ][pos.cl().clistpair[0].oldlist[0]][pos.cl().clistpair[1].oldlist[0]];
+                diff.p[1] += tables.kpp[inverse(pos.kingSquare(White))][pos.cl().clistpair[0].oldlist[1]][pos.cl().clistpair[1].oldlist[1]];
                 pos.plist0()[listIndex_cap] = pos.cl().clistpair[1].newlist[0];
                 pos.plist1()[listIndex_cap] = pos.cl().clistpair[1].newlist[1];
             }
@@ -308,8 +735,9 @@ namespace {
         const EvalIndex* list0 = pos.plist0();
         const EvalIndex* list1 = pos.plist1();
 
-        const auto* ppkppb = Evaluator::KPP[sq_bk         ];
-        const auto* ppkppw = Evaluator::KPP[inverse(sq_wk)];
+        const EvalTables& tables = pos.thisThread()->evalTables;
+        const auto* ppkppb = tables.kpp[sq_bk         ];
+        const auto* ppkppw = tables.kpp[inverse(sq_wk)];
 
         EvalSum sum;
         sum.p[2][0] = 0;
@@ -329,7 +757,7 @@ namespace {
                 tmp = _mm_cvtepi16_epi32(tmp);
                 sum.m[0] = _mm_add_epi32(sum.m[0], tmp);
             }
-            sum.p[2] += Evaluator::KKP[sq_bk][sq_wk][k0];
+            sum.p[2] += tables.kkp[sq_bk][sq_wk][k0];
         }
 #else
         sum.p[0][0] = 0;
@@ -347,7 +775,7 @@ namespace {
                 sum.p[0] += pkppb[l0];
                 sum.p[1] += pkppw[l1];
             }
-            sum.p[2] += Evaluator::KKP[sq_bk][sq_wk][k0];
+            sum.p[2] += tables.kkp[sq_bk][sq_wk][k0];
         }
 #endif
 
@@ -397,8 +825,9 @@ Score evaluateUnUseDiff(const Position& pos) {
 
     nlist = make_list_unUseDiff(pos, list0, list1, nlist);
 
-    const auto* ppkppb = Evaluator::KPP[sq_bk         ];
-    const auto* ppkppw = Evaluator::KPP[inverse(sq_wk)];
+    const EvalTables& tables = pos.thisThread()->evalTables;
+    const auto* ppkppb = tables.kpp[sq_bk         ];
+    const auto* ppkppw = tables.kpp[inverse(sq_wk)];
 
     EvalSum score;
     score.p[0][0] = 0;
@@ -418,7 +847,7 @@ Score evaluateUnUseDiff(const Position& pos) {
             score.p[0] += pkppb[l0];
             score.p[1] += pkppw[l1];
         }
-        score.p[2] += Evaluator::KKP[sq_bk][sq_wk][k0];
+        score.p[2] += tables.kkp[sq_bk][sq_wk][k0];
     }
 
     score.p[2][0] += pos.material() * FVScale;
@@ -437,19 +866,121 @@ Score evaluate(Position& pos, SearchStack* ss) {
         return score / FVScale;
     }
 
+#if defined LEARN
+    const Key keyExcludeTurn = pos.getKeyExcludeTurn() ^ g_evalHashSalt;
+#else
     const Key keyExcludeTurn = pos.getKeyExcludeTurn();
-    EvaluateHashEntry entry = *g_evalTable[keyExcludeTurn]; // atomic にデータを取得する必要がある。
+#endif
+    Thread* th = pos.thisThread();
+    EvaluateHashEntry* const hashEntry = (th->evalHash != nullptr ? (*th->evalHash)[keyExcludeTurn] : g_evalTable[keyExcludeTurn]);
+    EvaluateHashEntry entry = *hashEntry; // atomic にデータを取得する必要がある。
     entry.decode();
     if (entry.key == keyExcludeTurn) {
+        ++th->evalHashHits;
         ss->staticEvalRaw = entry;
         assert(static_cast<Score>(ss->staticEvalRaw.sum(pos.turn())) == evaluateUnUseDiff(pos));
         return static_cast<Score>(entry.sum(pos.turn())) / FVScale;
     }
+    ++th->evalHashMisses;
 
     evaluateBody(pos, ss);
 
     ss->staticEvalRaw.key = keyExcludeTurn;
     ss->staticEvalRaw.encode();
-    *g_evalTable[keyExcludeTurn] = ss->staticEvalRaw;
+    *hashEntry = ss->staticEvalRaw;
+    return static_cast<Score>(ss->staticEvalRaw.sum(pos.turn())) / FVScale;
+}
+
+Score evaluateWithoutHash(Position& pos, SearchStack* ss) {
+    evaluateBody(pos, ss);
     return static_cast<Score>(ss->staticEvalRaw.sum(pos.turn())) / FVScale;
 }
+
+// KPP の参照は局面毎にランダムで、1局面ずつ評価するとキャッシュミスの待ちが支配的になる。
+// EvalBatchSize 局面の次の行の要素を prefetch してから今の行を足し込むことで、
+// 複数局面のメモリアクセスを重ねて待ち時間を隠す。結果は evaluateUnUseDiff() と同じ。
+void evaluateBatch(const Position* const positions[], const size_t num, Score scores[]) {
+    const int nlist = Position::nlist();
+    for (size_t begin = 0; begin < num; begin += EvalBatchSize) {
+        const size_t n = std::min(EvalBatchSize, num - begin);
+        const Position* const* ps = positions + begin;
+        const KPPEvalElementType0* ppkppb[EvalBatchSize];
+        const KPPEvalElementType0* ppkppw[EvalBatchSize];
+        const EvalElementType* pkkp[EvalBatchSize];
+        EvalSum sums[EvalBatchSize];
+        for (size_t b = 0; b < n; ++b) {
+            const EvalTables& tables = ps[b]->thisThread()->evalTables;
+            const Square sq_bk = ps[b]->kingSquare(Black);
+            const Square sq_wk = ps[b]->kingSquare(White);
+            ppkppb[b] = tables.kpp[sq_bk         ];
+            ppkppw[b] = tables.kpp[inverse(sq_wk)];
+            pkkp[b] = tables.kkp[sq_bk][sq_wk];
+            for (int k = 0; k < 3; ++k)
+                sums[b].p[k][0] = sums[b].p[k][1] = 0;
+        }
+
+        auto prefetchRow = [&](const size_t b, const int i) {
+            const EvalIndex* list0 = ps[b]->cplist0();
+            const EvalIndex* list1 = ps[b]->cplist1();
+            const auto* pkppb = ppkppb[b][list0[i]];
+            const auto* pkppw = ppkppw[b][list1[i]];
+            for (int j = 0; j < i; ++j) {
+                prefetch(const_cast<EvalElementType*>(&pkppb[list0[j]]));
+                prefetch(const_cast<EvalElementType*>(&pkppw[list1[j]]));
+            }
+            prefetch(const_cast<EvalElementType*>(&pkkp[b][list0[i]]));
+        };
+        auto addRow = [&](const size_t b, const int i) {
+            const EvalIndex* list0 = ps[b]->cplist0();
+            const EvalIndex* list1 = ps[b]->cplist1();
+            const auto* pkppb = ppkppb[b][list0[i]];
+            const auto* pkppw = ppkppw[b][list1[i]];
+            for (int j = 0; j < i; ++j) {
+                sums[b].p[0] += pkppb[list0[j]];
+                sums[b].p[1] += pkppw[list1[j]];
+            }
+            sums[b].p[2] += pkkp[b][list0[i]];
+        };
+
+        for (size_t b = 0; b < n; ++b)
+            prefetchRow(b, 0);
+        for (int i = 0; i < nlist; ++i) {
+            for (size_t b = 0; b < n; ++b) {
+                if (i + 1 < nlist)
+                    prefetchRow(b, i + 1);
+                addRow(b, i);
+            }
+        }
+
+        for (size_t b = 0; b < n; ++b) {
+            sums[b].p[2][0] += ps[b]->material() * FVScale;
+#if defined INANIWA_SHIFT
+            sums[b].p[2][0] += inaniwaScore(*ps[b]);
+#endif
+            const Score score = static_cast<Score>(sums[b].sum(ps[b]->turn()));
+            assert(score == evaluateUnUseDiff(*ps[b]));
+            scores[begin + b] = score / FVScale;
+        }
+    }
+}
+
+void evaluateBatch(const Position& pos, const HuffmanCodedPos hcps[], const size_t num, Score scores[]) {
+    std::vector<Position> positions(EvalBatchSize, pos);
+    const Position* ps[EvalBatchSize];
+    bool isValid[EvalBatchSize];
+    Score batchScores[EvalBatchSize];
+    for (size_t begin = 0; begin < num; begin += EvalBatchSize) {
+        const size_t n = std::min(EvalBatchSize, num - begin);
+        size_t validNum = 0;
+        for (size_t b = 0; b < n; ++b) {
+            isValid[b] = positions[validNum].set(hcps[begin + b], pos.thisThread());
+            if (isValid[b]) {
+                ps[validNum] = &positions[validNum];
+                ++validNum;
+            }
+        }
+        evaluateBatch(ps, validNum, batchScores);
+        for (size_t b = 0, i = 0; b < n; ++b)
+            scores[begin + b] = (isValid[b] ? batchScores[i++] : ScoreNotEvaluated);
+    }
+}
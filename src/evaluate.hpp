@@ -265,20 +265,8 @@ struct EvaluatorGradient : public EvaluatorBase<std::array<std::atomic<float>, 2
 #endif
             for (int ksq = SQ11; ksq < SquareNum; ++ksq) {
                 for (EvalIndex i = (EvalIndex)0; i < fe_end; ++i) {
-                    for (EvalIndex j = (EvalIndex)0; j < fe_end; ++j) {
-                        const int64_t index = minKPPIndex((Square)ksq, i, j);
-                        if (index == std::numeric_limits<int64_t>::max())
-                            continue;
-                        else if (index < 0) {
-                            // 内容を負として扱う。
-                            atomicSub((*oneArrayKPP(-index))[0], kpps.kpp[ksq][i][j][0]);
-                            atomicAdd((*oneArrayKPP(-index))[1], kpps.kpp[ksq][i][j][1]);
-                        }
-                        else if (&kpps.kpp[ksq][i][j] != oneArrayKPP(index)) {
-                            atomicAdd((*oneArrayKPP( index))[0], kpps.kpp[ksq][i][j][0]);
-                            atomicAdd((*oneArrayKPP( index))[1], kpps.kpp[ksq][i][j][1]);
-                        }
-                    }
+                    for (EvalIndex j = (EvalIndex)0; j < fe_end; ++j)
+                        sumMirrorKPP((Square)ksq, i, j);
                 }
             }
 #ifdef _OPENMP
@@ -286,26 +274,332 @@ struct EvaluatorGradient : public EvaluatorBase<std::array<std::atomic<float>, 2
 #endif
             for (int ksq0 = SQ11; ksq0 < SquareNum; ++ksq0) {
                 for (Square ksq1 = SQ11; ksq1 < SquareNum; ++ksq1) {
-                    for (EvalIndex i = (EvalIndex)0; i < fe_end; ++i) {
-                        const int64_t index = minKKPIndex((Square)ksq0, ksq1, i);
-                        if (index == std::numeric_limits<int64_t>::max())
-                            continue;
-                        else if (index < 0) {
-                            // 内容を負として扱う。
-                            atomicSub((*oneArrayKKP(-index))[0], kkps.kkp[ksq0][ksq1][i][0]);
-                            atomicAdd((*oneArrayKKP(-index))[1], kkps.kkp[ksq0][ksq1][i][1]);
-                        }
-                        else if (&kkps.kkp[ksq0][ksq1][i] != oneArrayKKP(index)) {
-                            atomicAdd((*oneArrayKKP( index))[0], kkps.kkp[ksq0][ksq1][i][0]);
-                            atomicAdd((*oneArrayKKP( index))[1], kkps.kkp[ksq0][ksq1][i][1]);
-                        }
-                    }
+                    for (EvalIndex i = (EvalIndex)0; i < fe_end; ++i)
+                        sumMirrorKKP((Square)ksq0, ksq1, i);
                 }
             }
         }
     }
+    // sumMirror() と同じ事を、touched で印の付いたブロックの要素だけに行う。足しこんだ先のブロックにも印を付ける。
+    template <typename TouchedBlocks>
+    void sumMirror(TouchedBlocks& touched) {
+        const std::vector<size_t> blocks = touched.blocks();
+        const size_t kppNum = kpps_end_index();
+        const size_t FeEnd = fe_end;
+        const size_t SqNum = SquareNum;
+#if defined _OPENMP
+#pragma omp parallel for
+#endif
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            const size_t last = std::min(TouchedBlocks::elementEnd(blocks[b]), kppNum + kkps_end_index());
+            for (size_t e = TouchedBlocks::elementBegin(blocks[b]); e < last; ++e) {
+                int64_t index;
+                size_t offset;
+                if (e < kppNum) {
+                    index = sumMirrorKPP(static_cast<Square>(e / (FeEnd * FeEnd)), static_cast<EvalIndex>(e / FeEnd % FeEnd), static_cast<EvalIndex>(e % FeEnd));
+                    offset = 0;
+                }
+                else {
+                    const size_t k = e - kppNum;
+                    index = sumMirrorKKP(static_cast<Square>(k / (SqNum * FeEnd)), static_cast<Square>(k / FeEnd % SqNum), static_cast<EvalIndex>(k % FeEnd));
+                    offset = kppNum;
+                }
+                if (index != std::numeric_limits<int64_t>::max())
+                    touched.markElement(offset + static_cast<size_t>(std::abs(index)));
+            }
+        }
+    }
+
+private:
+    // kpps.kpp[ksq][i][j] を足しこんだ先の要素の位置を返す。足しこまなければ std::numeric_limits<int64_t>::max() を返す。
+    int64_t sumMirrorKPP(const Square ksq, const EvalIndex i, const EvalIndex j) {
+        const int64_t index = minKPPIndex(ksq, i, j);
+        if (index == std::numeric_limits<int64_t>::max())
+            return index;
+        else if (index < 0) {
+            // 内容を負として扱う。
+            atomicSub((*oneArrayKPP(-index))[0], kpps.kpp[ksq][i][j][0]);
+            atomicAdd((*oneArrayKPP(-index))[1], kpps.kpp[ksq][i][j][1]);
+            return index;
+        }
+        else if (&kpps.kpp[ksq][i][j] != oneArrayKPP(index)) {
+            atomicAdd((*oneArrayKPP( index))[0], kpps.kpp[ksq][i][j][0]);
+            atomicAdd((*oneArrayKPP( index))[1], kpps.kpp[ksq][i][j][1]);
+            return index;
+        }
+        return std::numeric_limits<int64_t>::max();
+    }
+    int64_t sumMirrorKKP(const Square ksq0, const Square ksq1, const EvalIndex i) {
+        const int64_t index = minKKPIndex(ksq0, ksq1, i);
+        if (index == std::numeric_limits<int64_t>::max())
+            return index;
+        else if (index < 0) {
+            // 内容を負として扱う。
+            atomicSub((*oneArrayKKP(-index))[0], kkps.kkp[ksq0][ksq1][i][0]);
+            atomicAdd((*oneArrayKKP(-index))[1], kkps.kkp[ksq0][ksq1][i][1]);
+            return index;
+        }
+        else if (&kkps.kkp[ksq0][ksq1][i] != oneArrayKKP(index)) {
+            atomicAdd((*oneArrayKKP( index))[0], kkps.kkp[ksq0][ksq1][i][0]);
+            atomicAdd((*oneArrayKKP( index))[1], kkps.kkp[ksq0][ksq1][i][1]);
+            return index;
+        }
+        return std::numeric_limits<int64_t>::max();
+    }
+};
+
+// EvaluatorGradient の要素を一定の数毎の区間に分け、区間毎に持つロック。
+// EvaluatorGradientBuffer から足し込む時に、同じ区間に足し込むスレッドが 1 つだけになるようにする。
+struct EvaluatorGradientLocks {
+    static const int Shift = 20; // 1 つの区間の float の数は 2^Shift 個
+    static const size_t FloatNum = sizeof(EvaluatorGradient) / sizeof(float);
+    static const size_t Num = (FloatNum >> Shift) + 1;
+
+    EvaluatorGradientLocks() : mutexes(new Mutex[Num]) {}
+    std::unique_ptr<Mutex[]> mutexes;
 };
 
+// EvaluatorGradient を一定の数の要素毎のブロックに分け、値を足し込んだブロックに印を付ける。
+// 勾配が 0 で無いかも知れない要素を含むブロックだけを辿る事で、学習の更新を、学習に使った局面の量に比例する時間で済ませる。
+// 印は複数のスレッドから付けるので std::atomic<u8> にしている。
+struct EvaluatorGradientTouchedBlocks {
+    static const int Shift = 5; // 1 つのブロックの要素 (std::array<float, 2>) の数は 2^Shift 個
+    static const size_t ElementNum = EvaluatorGradientLocks::FloatNum / 2;
+    static const size_t Num = (ElementNum >> Shift) + 1;
+
+    EvaluatorGradientTouchedBlocks() : flags_(new std::atomic<u8>[Num]) { clear(); }
+    static size_t elementBegin(const size_t block) { return block << Shift; }
+    static size_t elementEnd(const size_t block) { return (block + 1) << Shift; }
+    // index は EvaluatorGradient を std::array<float, 2> の配列と見た時の位置。
+    void markElement(const size_t index) { flags_[index >> Shift].store(1, std::memory_order_relaxed); }
+    // 印の付いたブロックを昇順に返す。
+    std::vector<size_t> blocks() const {
+        std::vector<size_t> result;
+        for (size_t i = 0; i < Num; ++i)
+            if (flags_[i].load(std::memory_order_relaxed))
+                result.push_back(i);
+        return result;
+    }
+    void clear() {
+        for (size_t i = 0; i < Num; ++i)
+            flags_[i].store(0, std::memory_order_relaxed);
+    }
+    // blocks() で返したブロックの印だけを消す。
+    void clear(const std::vector<size_t>& blocks) {
+        for (const size_t i : blocks)
+            flags_[i].store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::unique_ptr<std::atomic<u8>[]> flags_;
+};
+
+// 学習でスレッド毎に持つ勾配のバッファ。
+// EvaluatorGradient::incParam() は要素毎に CAS で足し込むので、スレッドが増えると同じ要素やキャッシュラインの取り合いで遅くなる。
+// こちらは足し込む値を要素の位置をキーにしたスレッド毎のハッシュテーブルに溜め、同じ要素への値はその場でまとめる。
+// イテレーションの最後に mergeAll() で全てのスレッドのバッファを区間毎に並列に EvaluatorGradient に足し込む。
+// ハッシュテーブルが埋まってきた時だけ、イテレーションの途中でも区間のロックを取って足し込む。
+// ハッシュテーブルはスレッド毎にずっと持つので、1 イテレーションで 1 スレッドが扱う局面数から tableShiftFor() で大きさを決める。
+// mergeAll() か flush() を呼ぶまで、EvaluatorGradient には全ての値が入っていない事に注意する。
+class EvaluatorGradientBuffer {
+public:
+    static const int MinTableShift = 12; // 1 局面分の要素 (MaxUpdatesPerPosition) が入る大きさ
+    static const int MaxTableShift = 21; // 24MB
+
+    // touched が nullptr で無ければ、足し込んだ要素のブロックに印を付ける。
+    // ハッシュテーブルの要素数は 2 の tableShift 乗。
+    EvaluatorGradientBuffer(EvaluatorGradient& grad, EvaluatorGradientLocks& locks, const size_t startShard = 0,
+                            EvaluatorGradientTouchedBlocks* touched = nullptr, const int tableShift = MaxTableShift)
+        : grad_(grad), locks_(locks), touched_(touched),
+          tableShift_(std::max(MinTableShift, std::min(tableShift, MaxTableShift))), tableSize_(size_t(1) << tableShift_),
+          maxSize_(tableSize_ / 2), table_(tableSize_), size_(0), rangeBegin_(RangeNum + 1), startShard_(startShard % RangeNum)
+    {
+        for (Entry& e : table_)
+            e.index = EmptyIndex;
+    }
+    ~EvaluatorGradientBuffer() { flush(); }
+
+    // 1 つのバッファに positionNum 局面分の勾配を溜める時の tableShift。
+    // 要素数の上限の 2 倍を目安にし、足りない分はイテレーションの途中の flush() で足し込む。
+    static int tableShiftFor(const s64 positionNum) {
+        const u64 elementNum = std::min<u64>(ElementNum, static_cast<u64>(std::max<s64>(positionNum, 1)) * MaxUpdatesPerPosition);
+        int shift = MinTableShift;
+        while (shift < MaxTableShift && (size_t(1) << shift) / 2 < elementNum)
+            ++shift;
+        return shift;
+    }
+
+    // EvaluatorGradient::incParam() と同じ要素に同じ値を足す。
+    void incParam(const Position& pos, const std::array<float, 2>& dinc) {
+        if (maxSize_ < size_ + MaxUpdatesPerPosition)
+            flush();
+        const Square sq_bk = pos.kingSquare(Black);
+        const Square sq_wk = pos.kingSquare(White);
+        const EvalIndex* list0 = pos.cplist0();
+        const EvalIndex* list1 = pos.cplist1();
+        const std::array<float, 2> f = {{dinc[0] / FVScale, dinc[1] / FVScale}};
+
+        for (int i = 0; i < pos.nlist(); ++i) {
+            const EvalIndex k0 = list0[i];
+            const EvalIndex k1 = list1[i];
+            add(grad_.kkps.kkp[sq_bk][sq_wk][k0], f[0], f[1]);
+            for (int j = 0; j < i; ++j) {
+                const EvalIndex l0 = list0[j];
+                const EvalIndex l1 = list1[j];
+                add(grad_.kpps.kpp[sq_bk         ][k0][l0],  f[0], f[1]);
+                add(grad_.kpps.kpp[inverse(sq_wk)][k1][l1], -f[0], f[1]);
+            }
+        }
+    }
+
+    // 溜めた値を区間のロックを取って EvaluatorGradient に足し込む。他のスレッドが足し込んでいる最中でも呼べる。
+    // 全てのスレッドが同じ区間から足し込んでロックを待ち合わせないよう、スレッド毎に始める区間をずらす。
+    void flush() {
+        if (size_ == 0)
+            return;
+        sortByRange();
+        for (size_t n = 0; n < RangeNum; ++n) {
+            const size_t range = (startShard_ + n) % RangeNum;
+            if (rangeBegin_[range] == rangeBegin_[range + 1])
+                continue;
+            std::unique_lock<Mutex> lock(locks_.mutexes[range]);
+            addRange(range);
+        }
+        clear();
+    }
+
+    // 全てのバッファの値を EvaluatorGradient に足し込む。
+    // 区間毎に 1 つのスレッドが全てのバッファのその区間の値を足し込むので、ロックを取らない。
+    // バッファに足し込んでいるスレッドが無い時に呼ぶ事。
+    static void mergeAll(const std::vector<std::unique_ptr<EvaluatorGradientBuffer> >& buffers) {
+        const int bufferNum = static_cast<int>(buffers.size());
+#if defined _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < bufferNum; ++i)
+            buffers[i]->sortByRange();
+        const int rangeNum = static_cast<int>(RangeNum);
+#if defined _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int range = 0; range < rangeNum; ++range) {
+            for (auto& buffer : buffers)
+                buffer->addRange(range);
+        }
+#if defined _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < bufferNum; ++i)
+            buffers[i]->clear();
+    }
+
+private:
+    struct Entry {
+        u32 index; // EvaluatorGradient を std::array<float, 2> の配列と見た時の位置
+        float value[2];
+    };
+    static const size_t ElementNum = EvaluatorGradientLocks::FloatNum / 2;
+    static_assert(ElementNum < std::numeric_limits<u32>::max(), "");
+    static const u32 EmptyIndex = std::numeric_limits<u32>::max();
+    static const size_t RangeNum = EvaluatorGradientLocks::Num;
+    static const int RangeShift = EvaluatorGradientLocks::Shift - 1; // 要素の位置から EvaluatorGradientLocks の区間にする為のシフト
+    static const size_t MaxUpdatesPerPosition = EvalList::ListSize * EvalList::ListSize; // 1 局面で増える要素数の上限
+
+    void add(std::array<std::atomic<float>, 2>& elem, const float v0, const float v1) {
+        const u32 index = static_cast<u32>(&elem - reinterpret_cast<std::array<std::atomic<float>, 2>*>(&grad_));
+        for (size_t i = (index * UINT32_C(0x9e3779b1)) >> (32 - tableShift_); ; i = (i + 1) & (tableSize_ - 1)) {
+            Entry& e = table_[i];
+            if (e.index == index) {
+                e.value[0] += v0;
+                e.value[1] += v1;
+                return;
+            }
+            if (e.index == EmptyIndex) {
+                e.index = index;
+                e.value[0] = v0;
+                e.value[1] = v1;
+                ++size_;
+                return;
+            }
+        }
+    }
+    // ハッシュテーブルの要素を区間毎に sorted_ に並べる。
+    void sortByRange() {
+        std::fill(std::begin(rangeBegin_), std::end(rangeBegin_), 0);
+        for (const Entry& e : table_)
+            if (e.index != EmptyIndex)
+                ++rangeBegin_[(e.index >> RangeShift) + 1];
+        for (size_t i = 0; i < RangeNum; ++i)
+            rangeBegin_[i + 1] += rangeBegin_[i];
+        sorted_.resize(size_);
+        std::vector<u32> next(std::begin(rangeBegin_), std::end(rangeBegin_) - 1);
+        for (const Entry& e : table_)
+            if (e.index != EmptyIndex)
+                sorted_[next[e.index >> RangeShift]++] = e;
+    }
+    // sortByRange() した値のうち、range の区間の値を足し込む。
+    void addRange(const size_t range) {
+        std::array<std::atomic<float>, 2>* base = reinterpret_cast<std::array<std::atomic<float>, 2>*>(&grad_);
+        for (u32 i = rangeBegin_[range]; i < rangeBegin_[range + 1]; ++i) {
+            const Entry& e = sorted_[i];
+            std::array<std::atomic<float>, 2>& x = base[e.index];
+            x[0].store(x[0].load(std::memory_order_relaxed) + e.value[0], std::memory_order_relaxed);
+            x[1].store(x[1].load(std::memory_order_relaxed) + e.value[1], std::memory_order_relaxed);
+            if (touched_ != nullptr)
+                touched_->markElement(e.index);
+        }
+    }
+    void clear() {
+        for (const Entry& e : sorted_)
+            table_[tableIndexOf(e.index)].index = EmptyIndex;
+        sorted_.clear();
+        size_ = 0;
+    }
+    // ハッシュテーブル上の index の位置。
+    size_t tableIndexOf(const u32 index) const {
+        size_t i = (index * UINT32_C(0x9e3779b1)) >> (32 - tableShift_);
+        while (table_[i].index != index)
+            i = (i + 1) & (tableSize_ - 1);
+        return i;
+    }
+
+    EvaluatorGradient& grad_;
+    EvaluatorGradientLocks& locks_;
+    EvaluatorGradientTouchedBlocks* touched_;
+    const int tableShift_;
+    const size_t tableSize_;
+    const size_t maxSize_; // これ以上要素が入るとハッシュテーブルの探索が長くなるので足し込む。
+    std::vector<Entry> table_; // 要素の位置をキーにしたオープンアドレス法のハッシュテーブル
+    size_t size_; // table_ に入っている要素数
+    std::vector<Entry> sorted_; // table_ の要素を区間毎に並べたもの
+    std::vector<u32> rangeBegin_; // sorted_ の中での区間の始まり
+    size_t startShard_;
+};
+
+// ヘッダ付き評価関数ファイル。KPP.bin, KKP.bin は中身のサイズや次元を確認出来ないので、
+// こちらでは次元、要素の型、チェックサムを持たせて、壊れたファイルや別の評価関数のファイルを読み込まないようにする。
+// ヘッダの直後に KPP, KKP の順で従来の .bin と同じ並びのデータが続く。
+const char EvalFileName[] = "eval.bin";
+const char EvalFileMagic[8] = {'A', 'P', 'E', 'R', 'Y', 'E', 'V', 'L'};
+const u32 EvalFileVersion = 1;
+enum EvalFileElementType : u32 {
+    EvalFileS16x2 = 1 // std::array<s16, 2>
+};
+struct EvalFileHeader {
+    char magic[8];
+    u32 version;
+    u32 headerSize;
+    u32 feEnd;
+    u32 squareNum;
+    u32 elementType;
+    u32 elementSize;
+    u64 kppSize; // byte
+    u64 kkpSize; // byte
+    u64 checksum; // KPP, KKP のデータ部分に対するもの。
+    u64 reserved;
+};
+static_assert(sizeof(EvalFileHeader) == 64, "");
+
 using EvalElementType = std::array<s16, 2>;
 using KPPEvalElementType0 = EvalElementType[fe_end];
 using KPPEvalElementType1 = KPPEvalElementType0[fe_end];
@@ -313,10 +607,31 @@ using KPPEvalElementType2 = KPPEvalElementType1[SquareNum];
 using KKPEvalElementType0 = EvalElementType[fe_end];
 using KKPEvalElementType1 = KKPEvalElementType0[SquareNum];
 using KKPEvalElementType2 = KKPEvalElementType1[SquareNum];
+// 探索中に評価関数が参照するテーブル。
+// 通常は Evaluator::KPP, KKP を指すが、NUMA ノード毎に複製した場合はその複製を指す。
+struct EvalTables {
+    const KPPEvalElementType1* kpp;
+    const KKPEvalElementType1* kkp;
+};
+
 struct Evaluator /*: public EvaluatorBase<EvalElementType>*/ {
     static bool allocated;
+    // KPP, KKP に評価関数ファイルを読み込み済みか。
+    static bool loaded;
     static EvalElementType KPP[SquareNum][fe_end][fe_end];
     static EvalElementType KKP[SquareNum][SquareNum][fe_end];
+    // NUMA ノード毎の KPP, KKP の複製。[0] は KPP, KKP 自身。
+    static std::vector<EvalTables> replicas;
+
+    // ノード node で使うテーブル。複製していなければ KPP, KKP を返す。
+    static EvalTables tables(const int node = 0) {
+        if (0 < node && node < static_cast<int>(replicas.size()))
+            return replicas[node];
+        return EvalTables{KPP, KKP};
+    }
+    // 読み込んだ KPP, KKP を nodeNum 個の NUMA ノードそれぞれのメモリに複製する。
+    // 複製はこの時点のコピーなので、後から KPP, KKP を書き換える学習時には使わないこと。
+    static void replicate(const int nodeNum);
 
     static std::string addSlashIfNone(const std::string& str) {
         std::string ret = str;
@@ -327,48 +642,25 @@ struct Evaluator /*: public EvaluatorBase<EvalElementType>*/ {
         return ret;
     }
 
-    static void init(const std::string& dirName) {
+    static bool init(const std::string& dirName) {
         if (!allocated) {
             allocated = true;
             memset(KPP, 0, sizeof(KPP));
             memset(KKP, 0, sizeof(KKP));
         }
-        readEvalFile(dirName);
-    }
-
-    // 2GB を超えるファイルは Msys2 環境では std::ifstream では一度に read 出来ず、分割して read する必要がある。
-    static bool readEvalFile(const std::string& dirName) {
-#define FOO(x) {                                                        \
-            std::ifstream fs((addSlashIfNone(dirName) + #x ".bin").c_str(), std::ios::binary); \
-            if (!fs)                                                    \
-                return false;                                           \
-            auto end = (char*)x + sizeof(x ## EvalElementType2);        \
-            for (auto it = (char*)x; it < end; it += (1 << 30)) {       \
-                size_t size = (it + (1 << 30) < end ? (1 << 30) : end - it); \
-                fs.read(it, size);                                      \
-            }                                                           \
-        }
-        FOO(KPP);
-        FOO(KKP);
-#undef FOO
-        return true;
-    }
-    static bool writeEvalFile(const std::string& dirName) {
-#define FOO(x) {                                                        \
-            std::ofstream fs((addSlashIfNone(dirName) + #x ".bin").c_str(), std::ios::binary); \
-            if (!fs)                                                    \
-                return false;                                           \
-            auto end = (char*)x + sizeof(x ## EvalElementType2);        \
-            for (auto it = (char*)x; it < end; it += (1 << 30)) {       \
-                size_t size = (it + (1 << 30) < end ? (1 << 30) : end - it); \
-                fs.write(it, size);                                     \
-            }                                                           \
-        }
-        FOO(KPP);
-        FOO(KKP);
-#undef FOO
-        return true;
+        return readEvalFile(dirName);
     }
+
+    // EvalFileName があればそれを読み込み、無ければ従来の KPP.bin, KKP.bin を読み込む。
+    static bool readEvalFile(const std::string& dirName);
+    // 従来形式。KPP.bin, KKP.bin をそれぞれヘッダ無しでそのまま書き出す。
+    static bool writeEvalFile(const std::string& dirName);
+    // ヘッダとチェックサム付きの形式で EvalFileName に書き出す。
+    static bool writeEvalContainerFile(const std::string& dirName);
+
+private:
+    static bool readEvalContainerFile(const std::string& path);
+    static bool readEvalRawFile(const std::string& dirName);
 };
 
 extern const EvalIndex kppArray[31];
@@ -471,8 +763,49 @@ const size_t EvaluateTableSize = 0x400000; // 134MB
 using EvaluateHashEntry = EvalSum;
 struct EvaluateHashTable : HashTable<EvaluateHashEntry, EvaluateTableSize> {};
 extern EvaluateHashTable g_evalTable;
+#if defined LEARN
+// 学習中に評価関数を更新した時に、g_evalTable などを消す代わりに変える値。
+// evaluate() で局面の key に xor するので、更新前の評価値はハッシュテーブルに残っていても使われない。
+extern Key g_evalHashSalt;
+#endif
+
+// スレッド毎、NUMA ノード毎に持つ評価値のハッシュテーブル。
+// g_evalTable は全スレッドで共有するので、スレッド数が多いと書き込みでキャッシュラインの奪い合いになる。
+// その場合にこちらを使う。サイズは実行時に決める。
+class EvaluateHashShard {
+public:
+    EvaluateHashShard() : mask_(0), table_(nullptr), mem_(nullptr) {}
+    ~EvaluateHashShard() { release(); }
+    void resize(const size_t mbSize); // Mega Byte 指定
+    // 呼んだスレッドが書き込んで 0 にすると、そのスレッドの NUMA ノードにページが割り当てられてしまう。
+    // ページを解放して確保し直し、探索で最初に書き込むスレッドのノードに割り当てられるようにする。
+    void clear() { allocate(mask_ + 1); }
+    EvaluateHashEntry* operator [] (const Key k) { return table_ + (static_cast<size_t>(k) & mask_); }
+
+private:
+    EvaluateHashShard(const EvaluateHashShard&);
+    EvaluateHashShard& operator = (const EvaluateHashShard&);
+    void allocate(const size_t entryNum); // 0 で埋まった領域を書き込まずに確保する。
+    void release();
+
+    size_t mask_;
+    EvaluateHashEntry* table_;
+    void* mem_;
+};
 
 Score evaluateUnUseDiff(const Position& pos);
 Score evaluate(Position& pos, SearchStack* ss);
+// evaluate() から評価値のハッシュテーブルの参照を除いたもの。
+// (ss-1)->staticEvalRaw に値が入っていれば差分計算、入っていなければ全計算する。ベンチマークと検証用。
+Score evaluateWithoutHash(Position& pos, SearchStack* ss);
+
+// evaluateBatch() で同時に KPP の読み込みを重ねる局面数。
+const size_t EvalBatchSize = 8;
+// 複数の局面をまとめて評価し、手番側から見た評価値を scores に入れる。
+// 差分計算や評価値のハッシュテーブルは使わないので、探索外で大量の局面を評価する時に使う。
+void evaluateBatch(const Position* const positions[], const size_t num, Score scores[]);
+// HuffmanCodedPos から局面を復元して評価する。pos はスレッドや Searcher を得る為だけに使う。
+// 復元出来なかった局面の評価値は ScoreNotEvaluated にする。
+void evaluateBatch(const Position& pos, const HuffmanCodedPos hcps[], const size_t num, Score scores[]);
 
 #endif // #ifndef APERY_EVALUATE_HPP
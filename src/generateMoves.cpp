@@ -26,9 +26,9 @@ namespace {
     // 角, 飛車の場合
     template <MoveType MT, PieceType PT, Color US, bool ALL>
     FORCE_INLINE ExtMove* generateBishopOrRookMoves(ExtMove* moveList, const Position& pos,
-                                                    const Bitboard& target, const Square /*ksq*/)
+                                                    const Bitboard& target, const Square /*ksq*/, const Bitboard& fromMask)
     {
-        Bitboard fromBB = pos.bbOf(PT, US);
+        Bitboard fromBB = pos.bbOf(PT, US) & fromMask;
         while (fromBB) {
             const Square from = fromBB.firstOneFromSQ11();
             const bool fromCanPromote = canPromote(US, makeRank(from));
@@ -156,11 +156,14 @@ namespace {
     }
 
     // 金, 成り金、馬、竜の指し手生成
+    // fromMask は移動元の候補。pin されている駒を別に生成する時に使う。
     template <MoveType MT, PieceType PT, Color US, bool ALL> struct GeneratePieceMoves {
-        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square /*ksq*/) {
+        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square /*ksq*/,
+                                           const Bitboard& fromMask = allOneBB())
+        {
             static_assert(PT == GoldHorseDragon, "");
             // 金、成金、馬、竜のbitboardをまとめて扱う。
-            Bitboard fromBB = (pos.goldsBB() | pos.bbOf(Horse, Dragon)) & pos.bbOf(US);
+            Bitboard fromBB = (pos.goldsBB() | pos.bbOf(Horse, Dragon)) & pos.bbOf(US) & fromMask;
             while (fromBB) {
                 const Square from = fromBB.firstOneFromSQ11();
                 // from にある駒の種類を判別
@@ -176,13 +179,15 @@ namespace {
     };
     // 歩の場合
     template <MoveType MT, Color US, bool ALL> struct GeneratePieceMoves<MT, Pawn, US, ALL> {
-        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square /*ksq*/) {
+        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square /*ksq*/,
+                                           const Bitboard& fromMask = allOneBB())
+        {
             // Txxx は先手、後手の情報を吸収した変数。数字は先手に合わせている。
             const Rank TRank4 = (US == Black ? Rank4 : Rank6);
             const Bitboard TRank123BB = inFrontMask<US, TRank4>();
             const SquareDelta TDeltaS = (US == Black ? DeltaS : DeltaN);
 
-            Bitboard toBB = pawnAttack<US>(pos.bbOf(Pawn, US)) & target;
+            Bitboard toBB = pawnAttack<US>(pos.bbOf(Pawn, US) & fromMask) & target;
 
             // 成り
             if (MT != NonCaptureMinusPro) {
@@ -216,8 +221,10 @@ namespace {
     };
     // 香車の場合
     template <MoveType MT, Color US, bool ALL> struct GeneratePieceMoves<MT, Lance, US, ALL> {
-        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square /*ksq*/) {
-            Bitboard fromBB = pos.bbOf(Lance, US);
+        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square /*ksq*/,
+                                           const Bitboard& fromMask = allOneBB())
+        {
+            Bitboard fromBB = pos.bbOf(Lance, US) & fromMask;
             while (fromBB) {
                 const Square from = fromBB.firstOneFromSQ11();
                 Bitboard toBB = pos.attacksFrom<Lance>(US, from) & target;
@@ -248,8 +255,10 @@ namespace {
     };
     // 桂馬の場合
     template <MoveType MT, Color US, bool ALL> struct GeneratePieceMoves<MT, Knight, US, ALL> {
-        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square /*ksq*/) {
-            Bitboard fromBB = pos.bbOf(Knight, US);
+        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square /*ksq*/,
+                                           const Bitboard& fromMask = allOneBB())
+        {
+            Bitboard fromBB = pos.bbOf(Knight, US) & fromMask;
             while (fromBB) {
                 const Square from = fromBB.firstOneFromSQ11();
                 Bitboard toBB = pos.attacksFrom<Knight>(US, from) & target;
@@ -270,8 +279,10 @@ namespace {
     };
     // 銀の場合
     template <MoveType MT, Color US, bool ALL> struct GeneratePieceMoves<MT, Silver, US, ALL> {
-        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square /*ksq*/) {
-            Bitboard fromBB = pos.bbOf(Silver, US);
+        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square /*ksq*/,
+                                           const Bitboard& fromMask = allOneBB())
+        {
+            Bitboard fromBB = pos.bbOf(Silver, US) & fromMask;
             while (fromBB) {
                 const Square from = fromBB.firstOneFromSQ11();
                 const bool fromCanPromote = canPromote(US, makeRank(from));
@@ -288,13 +299,17 @@ namespace {
         }
     };
     template <MoveType MT, Color US, bool ALL> struct GeneratePieceMoves<MT, Bishop, US, ALL> {
-        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square ksq) {
-            return generateBishopOrRookMoves<MT, Bishop, US, ALL>(moveList, pos, target, ksq);
+        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square ksq,
+                                           const Bitboard& fromMask = allOneBB())
+        {
+            return generateBishopOrRookMoves<MT, Bishop, US, ALL>(moveList, pos, target, ksq, fromMask);
         }
     };
     template <MoveType MT, Color US, bool ALL> struct GeneratePieceMoves<MT, Rook, US, ALL> {
-        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square ksq) {
-            return generateBishopOrRookMoves<MT, Rook, US, ALL>(moveList, pos, target, ksq);
+        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos, const Bitboard& target, const Square ksq,
+                                           const Bitboard& fromMask = allOneBB())
+        {
+            return generateBishopOrRookMoves<MT, Rook, US, ALL>(moveList, pos, target, ksq, fromMask);
         }
     };
     // 玉の場合
@@ -524,48 +539,255 @@ namespace {
         }
     };
 
+    // from にある駒の、駒を取らない王手の生成。
+    // 成、不成の生成の規則は NonCaptureMinusPro に合わせる。(歩の成る手は CapturePlusPro で生成するので、ここでは生成しない。)
+    // discovered は移動すると空き王手になる移動先。from が空き王手の候補でなければ allZeroBB() を渡す。
+    template <Color US>
+    ExtMove* generateQuietChecksFrom(ExtMove* moveList, const Position& pos, const CheckInfo& ci,
+                                     const Square from, const Bitboard& discovered)
+    {
+        // Txxx は先手、後手の情報を吸収した変数。数字は先手に合わせている。
+        const Rank TRank4 = (US == Black ? Rank4 : Rank6);
+        const Rank TRank3 = (US == Black ? Rank3 : Rank7);
+        const Bitboard TRank123BB = inFrontMask<US, TRank4>();
+        const Bitboard TRank12BB = inFrontMask<US, TRank3>();
+
+        const PieceType pt = pieceToPieceType(pos.piece(from));
+        const Bitboard toBB = pos.attacksFrom(pt, US, from) & pos.emptyBB();
+        const Bitboard promoteZone = (canPromote(US, makeRank(from)) ? allOneBB() : TRank123BB);
+        Bitboard promoteBB = allZeroBB();
+        Bitboard nonPromoteBB;
+        switch (pt) {
+        case Pawn  :                                 nonPromoteBB = TRank123BB.notThisAnd(toBB);  break;
+        case Lance : promoteBB = toBB & TRank123BB;  nonPromoteBB = TRank123BB.notThisAnd(toBB);  break;
+        case Knight: promoteBB = toBB & TRank123BB;  nonPromoteBB = TRank12BB.notThisAnd(toBB);   break;
+        case Silver: promoteBB = toBB & promoteZone; nonPromoteBB = toBB;                         break;
+        case Bishop:
+        case Rook  : promoteBB = toBB & promoteZone; nonPromoteBB = promoteZone.notThisAnd(toBB); break;
+        default    :                                 nonPromoteBB = toBB;                         break;
+        }
+        if (promoteBB)
+            promoteBB &= ci.checkBB[pt + PTPromote] | discovered;
+        nonPromoteBB &= ci.checkBB[pt] | discovered;
+
+        Square to;
+        FOREACH_BB(promoteBB, to, {
+                (*moveList++).move = makePromoteMove<NonCapture>(pt, from, to, pos);
+            });
+        FOREACH_BB(nonPromoteBB, to, {
+                (*moveList++).move = makeNonPromoteMove<NonCapture>(pt, from, to, pos);
+            });
+        return moveList;
+    }
+
+    // 王手になる駒打ちの生成。
+    template <Color US>
+    ExtMove* generateDropChecks(ExtMove* moveList, const Position& pos, const CheckInfo& ci) {
+        const Hand hand = pos.hand(US);
+        const Bitboard empty = pos.emptyBB();
+        Square to;
+        if (hand.exists<HPawn>()) {
+            // 二歩と打ち歩詰めを除く。
+            Bitboard toBB = ci.checkBB[Pawn] & empty;
+            if (toBB) {
+                to = toBB.constFirstOneFromSQ11();
+                if (pos.noPawns(US, makeFile(to)) && !pos.isPawnDropCheckMate(US, to))
+                    (*moveList++).move = makeDropMove(Pawn, to);
+            }
+        }
+        // 王手になる位置は、行き所の無い段には無いので、段の制限は考えなくて良い。
+        for (const PieceType pt : {Lance, Knight, Silver, Gold, Bishop, Rook}) {
+            if (hand.exists(pieceTypeToHandPiece(pt))) {
+                Bitboard toBB = ci.checkBB[pt] & empty;
+                FOREACH_BB(toBB, to, {
+                        (*moveList++).move = makeDropMove(pt, to);
+                    });
+            }
+        }
+        return moveList;
+    }
+
     // 部分特殊化
-    // 連続王手の千日手以外の反則手を排除した合法手生成
-    // そんなに速度が要求されるところでは呼ばない。
-    template <Color US> struct GenerateMoves<Legal, US> {
-        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos) {
-            ExtMove* curr = moveList;
-            const Bitboard pinned = pos.pinnedBB();
-
-            moveList = pos.inCheck() ?
-                GenerateMoves<Evasion, US>()(moveList, pos) : GenerateMoves<NonEvasion, US>()(moveList, pos);
-
-            // 玉の移動による自殺手と、pinされている駒の移動による自殺手を削除
-            while (curr != moveList) {
-                if (!pos.pseudoLegalMoveIsLegal<false, false>(curr->move, pinned))
-                    curr->move = (--moveList)->move;
-                else
-                    ++curr;
+    // 駒を取らない王手の生成
+    // 王手が掛かっていないときに呼ぶ。pin されている駒の移動による自殺手を含むので、pseudo legal
+    // 全ての指し手を生成して moveGivesCheck() で調べる代わりに、
+    // 空き王手の候補の駒と、王手が出来る位置(GoldCheckTable 等)にある駒の移動だけを調べる。
+    template <Color US> struct GenerateMoves<QuietChecks, US> {
+        ExtMove* operator () (ExtMove* moveList, const Position& pos) {
+            assert(!pos.inCheck());
+            const Color Them = oppositeColor(US);
+            const Square ksq = pos.kingSquare(Them);
+            const CheckInfo ci(pos);
+
+            // 空き王手
+            // 遠隔駒と敵玉の間にある自駒が、その間以外に移動すれば空き王手になる。
+            Bitboard dcBB = allZeroBB();
+            Bitboard sliders = ((pos.bbOf(Lance) & lanceAttackToEdge(Them, ksq))
+                                | (pos.bbOf(Rook, Dragon) & rookAttackToEdge(ksq))
+                                | (pos.bbOf(Bishop, Horse) & bishopAttackToEdge(ksq)))
+                & pos.bbOf(US);
+            while (sliders) {
+                const Square sliderSq = sliders.firstOneFromSQ11();
+                const Bitboard between = betweenBB(sliderSq, ksq) & pos.occupiedBB();
+                if (between && between.isOneBit<false>() && between.andIsAny(pos.bbOf(US))) {
+                    dcBB |= between;
+                    moveList = generateQuietChecksFrom<US>(moveList, pos, ci, between.constFirstOneFromSQ11(),
+                                                           betweenBB(sliderSq, ksq).notThisAnd(allOneBB()));
+                }
+            }
+
+            // 歩の不成による王手。
+            {
+                const Rank TRank4 = (US == Black ? Rank4 : Rank6);
+                const SquareDelta TDeltaS = (US == Black ? DeltaS : DeltaN);
+                Bitboard toBB = pawnAttack<US>(dcBB.notThisAnd(pos.bbOf(Pawn, US)))
+                    & pos.emptyBB() & ci.checkBB[Pawn] & inFrontMask<US, TRank4>().notThisAnd(allOneBB());
+                Square to;
+                FOREACH_BB(toBB, to, {
+                        (*moveList++).move = makeNonPromoteMove<NonCapture>(Pawn, to + TDeltaS, to, pos);
+                    });
             }
 
+            // 歩、玉以外の駒は、王手が出来る可能性がある位置にある駒だけ調べる。
+            Bitboard fromBB = ((pos.goldsBB()          & goldCheckTable  (US, ksq))
+                               | (pos.bbOf(Silver)      & silverCheckTable(US, ksq))
+                               | (pos.bbOf(Knight)      & knightCheckTable(US, ksq))
+                               | (pos.bbOf(Lance)       & lanceCheckTable (US, ksq))
+                               | pos.bbOf(Bishop, Rook, Horse, Dragon))
+                & pos.bbOf(US);
+            fromBB.andEqualNot(dcBB);
+            Square from;
+            FOREACH_BB(fromBB, from, {
+                    moveList = generateQuietChecksFrom<US>(moveList, pos, ci, from, allZeroBB());
+                });
+
+            return generateDropChecks<US>(moveList, pos, ci);
+        }
+    };
+
+    // THEM 側の駒の利きがある全てのマスの Bitboard を返す。
+    // 玉の移動先の合法判定に使うので、occupied には玉を取り除いたものを渡す。
+    // (玉が遠隔駒の利きの延長線上に逃げる手を除く為。)
+    template <Color THEM>
+    Bitboard attackedSquaresBB(const Position& pos, const Bitboard& occupied) {
+        Bitboard attacked = pawnAttack<THEM>(pos.bbOf(Pawn, THEM));
+        Bitboard fromBB = pos.bbOf(Pawn).notThisAnd(pos.bbOf(THEM));
+        Square from;
+        FOREACH_BB(fromBB, from, {
+                attacked |= Position::attacksFrom(pieceToPieceType(pos.piece(from)), THEM, from, occupied);
+            });
+        return attacked;
+    }
+
+    // pin されている駒 1 つの指し手を生成する。
+    // target には pin している駒と玉の間のマスと、pin している駒のマスだけを含める。
+    template <MoveType MT, Color US, bool ALL>
+    ExtMove* generatePinnedPieceMoves(ExtMove* moveList, const Position& pos, const Square from,
+                                      const Bitboard& target, const Square ksq)
+    {
+        const Bitboard fromMask = setMaskBB(from);
+        switch (pieceToPieceType(pos.piece(from))) {
+        case Pawn  : return GeneratePieceMoves<MT, Pawn           , US, ALL>()(moveList, pos, target, ksq, fromMask);
+        case Lance : return GeneratePieceMoves<MT, Lance          , US, ALL>()(moveList, pos, target, ksq, fromMask);
+        case Knight: return moveList; // pin されている桂馬は動けない。
+        case Silver: return GeneratePieceMoves<MT, Silver         , US, ALL>()(moveList, pos, target, ksq, fromMask);
+        case Bishop: return GeneratePieceMoves<MT, Bishop         , US, ALL>()(moveList, pos, target, ksq, fromMask);
+        case Rook  : return GeneratePieceMoves<MT, Rook           , US, ALL>()(moveList, pos, target, ksq, fromMask);
+        default    : return GeneratePieceMoves<MT, GoldHorseDragon, US, ALL>()(moveList, pos, target, ksq, fromMask);
+        }
+    }
+
+    // 連続王手の千日手以外の反則手を排除した合法手生成
+    // 生成した後に 1 手ずつ合法か調べるのではなく、
+    // 玉の移動先は、局面毎に 1 度だけ求めた相手の利きで除き、
+    // pin されている駒は、pin の方向の移動だけを生成する。
+    // ALL == true のとき、歩、飛、角の不成、香の2段目の不成、香の3段目の駒を取らない不成も生成する。
+    // NonEvasion の駒の指し手生成は ALL に依らずこれらの不成も生成するので、王手が掛かっていなければ Legal と LegalAll は同じ手になる。
+    // ALL はそのまま渡しておく。
+    template <Color US, bool ALL>
+    ExtMove* generateLegalMoves(ExtMove* moveList, const Position& pos) {
+        const Color Them = oppositeColor(US);
+        const Square ksq = pos.kingSquare(US);
+        const Square oppKsq = pos.kingSquare(Them);
+        const Bitboard checkers = pos.checkersBB();
+
+        // 玉の移動
+        const Bitboard attacked = attackedSquaresBB<Them>(pos, pos.occupiedBB() ^ setMaskBB(ksq));
+        Bitboard toBB = attacked.notThisAnd(pos.bbOf(US).notThisAnd(kingAttack(ksq)));
+        while (toBB) {
+            const Square to = toBB.firstOneFromSQ11();
+            (*moveList++).move = makeNonPromoteMove<NonEvasion>(King, ksq, to, pos);
+        }
+
+        // 両王手なら、玉を移動するしか回避方法は無い。
+        if (checkers && !checkers.isOneBit())
             return moveList;
+
+        // pin されている駒を探し、pin の方向への移動だけを生成する。
+        // 王手されている時は、pin されている駒で王手を回避する事は出来ないので、生成しない。
+        Bitboard pinned = allZeroBB();
+        Bitboard pinners = ((pos.bbOf(Lance) & lanceAttackToEdge(US, ksq))
+                            | (pos.bbOf(Rook, Dragon) & rookAttackToEdge(ksq))
+                            | (pos.bbOf(Bishop, Horse) & bishopAttackToEdge(ksq)))
+            & pos.bbOf(Them);
+        while (pinners) {
+            const Square pinnerSq = pinners.firstOneFromSQ11();
+            const Bitboard between = betweenBB(pinnerSq, ksq) & pos.occupiedBB();
+            if (between && between.isOneBit<false>() && between.andIsAny(pos.bbOf(US))) {
+                pinned |= between;
+                if (!checkers) {
+                    const Bitboard target = betweenBB(pinnerSq, ksq) | setMaskBB(pinnerSq);
+                    moveList = generatePinnedPieceMoves<NonEvasion, US, ALL>(moveList, pos, between.constFirstOneFromSQ11(), target, oppKsq);
+                }
+            }
+        }
+        const Bitboard notPinned = pinned.notThisAnd(allOneBB());
+
+        if (checkers) {
+            // 王手している駒を取るか、合駒をする。
+            const Square checkSq = checkers.constFirstOneFromSQ11();
+            const Bitboard target1 = betweenBB(checkSq, ksq);
+            const Bitboard target2 = target1 | checkers;
+            moveList = GeneratePieceMoves<Evasion, Pawn           , US, ALL>()(moveList, pos, target2, ksq, notPinned);
+            moveList = GeneratePieceMoves<Evasion, Lance          , US, ALL>()(moveList, pos, target2, ksq, notPinned);
+            moveList = GeneratePieceMoves<Evasion, Knight         , US, ALL>()(moveList, pos, target2, ksq, notPinned);
+            moveList = GeneratePieceMoves<Evasion, Silver         , US, ALL>()(moveList, pos, target2, ksq, notPinned);
+            moveList = GeneratePieceMoves<Evasion, Bishop         , US, ALL>()(moveList, pos, target2, ksq, notPinned);
+            moveList = GeneratePieceMoves<Evasion, Rook           , US, ALL>()(moveList, pos, target2, ksq, notPinned);
+            moveList = GeneratePieceMoves<Evasion, GoldHorseDragon, US, ALL>()(moveList, pos, target2, ksq, notPinned);
+
+            if (target1)
+                moveList = generateDropMoves<US>(moveList, pos, target1);
+        }
+        else {
+            // 駒打ちで自玉が取られる事は無いので、常に合法手。
+            moveList = generateDropMoves<US>(moveList, pos, pos.emptyBB());
+            const Bitboard target = pos.bbOf(US).notThisAnd(allOneBB());
+            moveList = GeneratePieceMoves<NonEvasion, Pawn           , US, ALL>()(moveList, pos, target, oppKsq, notPinned);
+            moveList = GeneratePieceMoves<NonEvasion, Lance          , US, ALL>()(moveList, pos, target, oppKsq, notPinned);
+            moveList = GeneratePieceMoves<NonEvasion, Knight         , US, ALL>()(moveList, pos, target, oppKsq, notPinned);
+            moveList = GeneratePieceMoves<NonEvasion, Silver         , US, ALL>()(moveList, pos, target, oppKsq, notPinned);
+            moveList = GeneratePieceMoves<NonEvasion, Bishop         , US, ALL>()(moveList, pos, target, oppKsq, notPinned);
+            moveList = GeneratePieceMoves<NonEvasion, Rook           , US, ALL>()(moveList, pos, target, oppKsq, notPinned);
+            moveList = GeneratePieceMoves<NonEvasion, GoldHorseDragon, US, ALL>()(moveList, pos, target, oppKsq, notPinned);
+        }
+
+        return moveList;
+    }
+
+    // 部分特殊化
+    // 連続王手の千日手以外の反則手を排除した合法手生成
+    template <Color US> struct GenerateMoves<Legal, US> {
+        FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos) {
+            return generateLegalMoves<US, false>(moveList, pos);
         }
     };
 
     // 部分特殊化
-    // Evasion のときに歩、飛、角と、香の2段目の不成も生成する。
+    // Legal に加えて、歩、飛、角の不成、香の2段目の不成、香の3段目の駒を取らない不成も生成する。
     template <Color US> struct GenerateMoves<LegalAll, US> {
         FORCE_INLINE ExtMove* operator () (ExtMove* moveList, const Position& pos) {
-            ExtMove* curr = moveList;
-            const Bitboard pinned = pos.pinnedBB();
-
-            moveList = pos.inCheck() ?
-                GenerateMoves<Evasion, US, true>()(moveList, pos) : GenerateMoves<NonEvasion, US>()(moveList, pos);
-
-            // 玉の移動による自殺手と、pinされている駒の移動による自殺手を削除
-            while (curr != moveList) {
-                if (!pos.pseudoLegalMoveIsLegal<false, false>(curr->move, pinned))
-                    curr->move = (--moveList)->move;
-                else
-                    ++curr;
-            }
-
-            return moveList;
+            return generateLegalMoves<US, true>(moveList, pos);
         }
     };
 }
@@ -590,10 +812,11 @@ ExtMove* generateMoves(ExtMove* moveList, const Position& pos, const Square to)
 template ExtMove* generateMoves<Drop              >(ExtMove* moveList, const Position& pos);
 template ExtMove* generateMoves<CapturePlusPro    >(ExtMove* moveList, const Position& pos);
 template ExtMove* generateMoves<NonCaptureMinusPro>(ExtMove* moveList, const Position& pos);
+template ExtMove* generateMoves<QuietChecks       >(ExtMove* moveList, const Position& pos);
 template ExtMove* generateMoves<Evasion           >(ExtMove* moveList, const Position& pos);
 template ExtMove* generateMoves<NonEvasion        >(ExtMove* moveList, const Position& pos);
 template ExtMove* generateMoves<Legal             >(ExtMove* moveList, const Position& pos);
-#if !defined NDEBUG || defined LEARN
+#if !defined NDEBUG || defined LEARN || !defined MINIMUL
 template ExtMove* generateMoves<LegalAll          >(ExtMove* moveList, const Position& pos);
 #endif
 template ExtMove* generateMoves<Recapture         >(ExtMove* moveList, const Position& pos, const Square to);
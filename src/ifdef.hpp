@@ -38,6 +38,7 @@
 #endif
 
 #if 0
+// 静止探索の最初の深さで、駒を取らない王手(generateMoves<QuietChecks>)も探索する。
 #define USE_QCHECKS
 #endif
 
@@ -83,9 +84,12 @@
 #define BAN_WHITE_REPETITION
 #endif
 
-#if 0
-// Magic Bitboard で必要となるマジックナンバーを求める。
-#define FIND_MAGIC
+// 利きなどのテーブルはビルド時に tablegen で生成し、const なデータとして埋め込む。
+// tablegen 自身をビルドする時だけ、テーブルを計算して書き込めるように const を外す。
+#if defined GENERATE_ATTACK_TABLES
+#define TABLE_CONST
+#else
+#define TABLE_CONST const
 #endif
 
 #endif // #ifndef APERY_IFDEF_HPP
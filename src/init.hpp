@@ -28,8 +28,4 @@
 
 void initTable();
 
-#if defined FIND_MAGIC
-u64 findMagic(const Square sqare, const bool isBishop);
-#endif // #if defined FIND_MAGIC
-
 #endif // #ifndef APERY_INIT_HPP
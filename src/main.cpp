@@ -28,30 +28,6 @@
 #include "tt.hpp"
 #include "search.hpp"
 
-#if defined FIND_MAGIC
-// Magic Bitboard の Magic Number を求める為のソフト
-int main() {
-    u64 RookMagic[SquareNum];
-    u64 BishopMagic[SquareNum];
-
-    std::cout << "const u64 RookMagic[81] = {" << std::endl;
-    for (Square sq = SQ11; sq < SquareNum; ++sq) {
-        RookMagic[sq] = findMagic(sq, false);
-        std::cout << "\tUINT64_C(0x" << std::hex << RookMagic[sq] << ")," << std::endl;
-    }
-    std::cout << "};\n" << std::endl;
-
-    std::cout << "const u64 BishopMagic[81] = {" << std::endl;
-    for (Square sq = SQ11; sq < SquareNum; ++sq) {
-        BishopMagic[sq] = findMagic(sq, true);
-        std::cout << "\tUINT64_C(0x" << std::hex << BishopMagic[sq] << ")," << std::endl;
-    }
-    std::cout << "};\n" << std::endl;
-
-    return 0;
-}
-
-#else
 // 将棋を指すソフト
 int main(int argc, char* argv[]) {
     initTable();
@@ -62,5 +38,3 @@ int main(int argc, char* argv[]) {
     s->doUSICommandLoop(argc, argv);
     s->threads.exit();
 }
-
-#endif
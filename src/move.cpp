@@ -22,8 +22,7 @@
 #include "move.hpp"
 
 namespace {
-    const std::string HandPieceToStringTable[HandPieceNum] = {"P*", "L*", "N*", "S*", "G*", "B*", "R*"};
-    inline std::string handPieceToString(const HandPiece hp) { return HandPieceToStringTable[hp]; }
+    const char* const HandPieceToStringTable[HandPieceNum] = {"P*", "L*", "N*", "S*", "G*", "B*", "R*"};
 
     const std::string PieceTypeToStringTable[PieceTypeNum] = {
         "", "FU", "KY", "KE", "GI", "KA", "HI", "KI", "OU", "TO", "NY", "NK", "NG", "UM", "RY"
@@ -32,15 +31,34 @@ namespace {
 }
 
 std::string Move::toUSI() const {
-    if (!(*this)) return "None";
+    char buf[8];
+    return std::string(buf, writeUSI(buf));
+}
+
+char* Move::writeUSI(char* buf) const {
+    char* p = buf;
+    if (!(*this)) {
+        for (const char* str = "None"; *str; ++str)
+            *p++ = *str;
+        return p;
+    }
 
-    const Square from = this->from();
     const Square to = this->to();
-    if (this->isDrop())
-        return handPieceToString(this->handPieceDropped()) + squareToStringUSI(to);
-    std::string usi = squareToStringUSI(from) + squareToStringUSI(to);
-    if (this->isPromotion()) usi += "+";
-    return usi;
+    if (this->isDrop()) {
+        const char* hp = HandPieceToStringTable[this->handPieceDropped()];
+        *p++ = hp[0];
+        *p++ = hp[1];
+    }
+    else {
+        const Square from = this->from();
+        *p++ = fileToCharUSI(makeFile(from));
+        *p++ = rankToCharUSI(makeRank(from));
+    }
+    *p++ = fileToCharUSI(makeFile(to));
+    *p++ = rankToCharUSI(makeRank(to));
+    if (this->isPromotion())
+        *p++ = '+';
+    return p;
 }
 
 std::string Move::toCSA() const {
@@ -109,6 +109,8 @@ public:
     }
     std::string promoteFlagToStringUSI() const { return (this->isPromotion() ? "+" : ""); }
     std::string toUSI() const;
+    // toUSI() と同じ文字列を buf に書き、書いた文字列の末尾を返す。終端文字は書かない。buf は 5 文字以上。
+    char* writeUSI(char* buf) const;
     std::string toCSA() const;
 
     static Move moveNone() { return Move(MoveNone); }
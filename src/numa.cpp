@@ -0,0 +1,101 @@
+/*
+  Apery, a USI shogi playing engine derived from Stockfish, a UCI chess playing engine.
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2018 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+  Copyright (C) 2011-2018 Hiraoka Takuya
+
+  Apery is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Apery is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "numa.hpp"
+#if defined __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+#if defined __linux__
+    // "0-3,8-11" のような形式の cpulist を読む。
+    std::vector<int> readCpuList(const int node) {
+        std::vector<int> cpus;
+        std::ifstream ifs(("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist").c_str());
+        std::string token;
+        while (std::getline(ifs, token, ',')) {
+            int first, last;
+            const int n = sscanf(token.c_str(), "%d-%d", &first, &last);
+            if (n < 1)
+                continue;
+            if (n == 1)
+                last = first;
+            for (int cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    // CPU を持つノードだけを数える。メモリだけのノードにはスレッドを割り当てられない。
+    const std::vector<std::vector<int> >& nodeCpus() {
+        static const std::vector<std::vector<int> > cpus = [] {
+            std::vector<std::vector<int> > result;
+            for (int node = 0; fileExist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"); ++node) {
+                const std::vector<int> c = readCpuList(node);
+                if (!c.empty())
+                    result.push_back(c);
+            }
+            return result;
+        }();
+        return cpus;
+    }
+
+    bool setAffinity(const pthread_t handle, const int node) {
+        const auto& cpus = nodeCpus();
+        if (node < 0 || static_cast<int>(cpus.size()) <= node)
+            return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (const int cpu : cpus[node])
+            CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(handle, sizeof(set), &set) == 0;
+    }
+#endif
+}
+
+int numaNodeNum() {
+#if defined __linux__
+    return std::max(static_cast<int>(nodeCpus().size()), 1);
+#else
+    return 1;
+#endif
+}
+
+bool bindThreadToNumaNode(std::thread& th, const int node) {
+#if defined __linux__
+    return setAffinity(th.native_handle(), node);
+#else
+    (void)th;
+    (void)node;
+    return false;
+#endif
+}
+
+bool bindThisThreadToNumaNode(const int node) {
+#if defined __linux__
+    return setAffinity(pthread_self(), node);
+#else
+    (void)node;
+    return false;
+#endif
+}
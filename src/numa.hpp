@@ -0,0 +1,37 @@
+/*
+  Apery, a USI shogi playing engine derived from Stockfish, a UCI chess playing engine.
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2018 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+  Copyright (C) 2011-2018 Hiraoka Takuya
+
+  Apery is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Apery is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef APERY_NUMA_HPP
+#define APERY_NUMA_HPP
+
+#include "common.hpp"
+
+// NUMA ノードの情報を扱う。
+// Linux 以外ではノードの情報を取得しないので、1 ノードとして扱う。
+int numaNodeNum();
+// スレッドを指定したノードの CPU でのみ動くようにする。
+// メモリは first touch したスレッドのノードに割り当てられるので、
+// ノード毎のデータを作るスレッドもこれで固定してから書き込むこと。
+bool bindThreadToNumaNode(std::thread& th, const int node);
+bool bindThisThreadToNumaNode(const int node);
+
+#endif // #ifndef APERY_NUMA_HPP
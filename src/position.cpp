@@ -76,8 +76,8 @@ const HuffmanCode HuffmanCodedPos::handCodeTable[HandPieceNum][ColorNum] = {
     {{Binary<   111111>::value, 7}, {Binary<  1111111>::value, 7}}, // HRook
 };
 
-HuffmanCodeToPieceHash HuffmanCodedPos::boardCodeToPieceHash;
-HuffmanCodeToPieceHash HuffmanCodedPos::handCodeToPieceHash;
+HuffmanDecodeEntry HuffmanCodedPos::boardDecodeTable[256];
+HuffmanDecodeEntry HuffmanCodedPos::handDecodeTable[256];
 
 const CharToPieceUSI g_charToPieceUSI;
 
@@ -102,25 +102,21 @@ CheckInfo::CheckInfo(const Position& pos) {
     const Color them = oppositeColor(pos.turn());
     const Square ksq = pos.kingSquare(them);
 
-    pinned = pos.pinnedBB();
-    dcBB = pos.discoveredCheckBB();
-
-    checkBB[Pawn     ] = pos.attacksFrom<Pawn  >(them, ksq);
-    checkBB[Lance    ] = pos.attacksFrom<Lance >(them, ksq);
-    checkBB[Knight   ] = pos.attacksFrom<Knight>(them, ksq);
-    checkBB[Silver   ] = pos.attacksFrom<Silver>(them, ksq);
-    checkBB[Bishop   ] = pos.attacksFrom<Bishop>(ksq);
-    checkBB[Rook     ] = pos.attacksFrom<Rook  >(ksq);
-    checkBB[Gold     ] = pos.attacksFrom<Gold  >(them, ksq);
-    checkBB[King     ] = allZeroBB();
-    // todo: ここで AVX2 使えそう。
-    //       checkBB のreadアクセスは switch (pt) で場合分けして、余計なコピー減らした方が良いかも。
-    checkBB[ProPawn  ] = checkBB[Gold];
-    checkBB[ProLance ] = checkBB[Gold];
-    checkBB[ProKnight] = checkBB[Gold];
-    checkBB[ProSilver] = checkBB[Gold];
-    checkBB[Horse    ] = checkBB[Bishop] | pos.attacksFrom<King>(ksq);
-    checkBB[Dragon   ] = checkBB[Rook  ] | pos.attacksFrom<King>(ksq);
+    pos.pinnedAndDiscoveredCheckBB(pinned, dcBB);
+
+    // 隣り合う駒種の checkBB を 2 つずつまとめて書き込む。
+    static_assert(Lance == Pawn + 1 && Silver == Knight + 1 && Rook == Bishop + 1 && King == Gold + 1, "");
+    static_assert(ProLance == ProPawn + 1 && ProKnight == ProPawn + 2 && ProSilver == ProPawn + 3 && Dragon == Horse + 1, "");
+    Bitboard256(pos.attacksFrom<Pawn  >(them, ksq), pos.attacksFrom<Lance >(them, ksq)).store(&checkBB[Pawn  ]);
+    Bitboard256(pos.attacksFrom<Knight>(them, ksq), pos.attacksFrom<Silver>(them, ksq)).store(&checkBB[Knight]);
+    const Bitboard256 sliders(pos.attacksFrom<Bishop>(ksq), pos.attacksFrom<Rook>(ksq));
+    sliders.store(&checkBB[Bishop]);
+    const Bitboard gold = pos.attacksFrom<Gold>(them, ksq);
+    Bitboard256(gold, allZeroBB()).store(&checkBB[Gold]);
+    const Bitboard256 golds(gold);
+    golds.store(&checkBB[ProPawn  ]);
+    golds.store(&checkBB[ProKnight]);
+    (sliders | Bitboard256(pos.attacksFrom<King>(ksq))).store(&checkBB[Horse]);
 }
 
 Bitboard Position::attacksFrom(const PieceType pt, const Color c, const Square sq, const Bitboard& occupied) {
@@ -348,7 +344,8 @@ void Position::doMove(const Move move, StateInfo& newSt, const CheckInfo& ci, co
     newSt.previous = st_;
     st_ = &newSt;
 
-    st_->cl.size = 1;
+    ChangedLists& cl = st_->cl;
+    cl.size = 1;
 
     const Color us = turn();
     const Square to = move.to();
@@ -366,17 +363,17 @@ void Position::doMove(const Move move, StateInfo& newSt, const CheckInfo& ci, co
         const int handnum = hand(us).numOf(hpTo);
         const int listIndex = evalList_.squareHandToList[HandPieceToSquareHand[us][hpTo] + handnum];
         const Piece pcTo = colorAndPieceTypeToPiece(us, ptTo);
-        st_->cl.listindex[0] = listIndex;
-        st_->cl.clistpair[0].oldlist[0] = evalList_.list0[listIndex];
-        st_->cl.clistpair[0].oldlist[1] = evalList_.list1[listIndex];
+        cl.listindex[0] = listIndex;
+        cl.clistpair[0].oldlist[0] = evalList_.list0[listIndex];
+        cl.clistpair[0].oldlist[1] = evalList_.list1[listIndex];
 
         evalList_.list0[listIndex] = kppArray[pcTo         ] + (EvalIndex)to;
         evalList_.list1[listIndex] = kppArray[inverse(pcTo)] + (EvalIndex)inverse(to);
         evalList_.listToSquareHand[listIndex] = to;
         evalList_.squareHandToList[to] = listIndex;
 
-        st_->cl.clistpair[0].newlist[0] = evalList_.list0[listIndex];
-        st_->cl.clistpair[0].newlist[1] = evalList_.list1[listIndex];
+        cl.clistpair[0].newlist[0] = evalList_.list0[listIndex];
+        cl.clistpair[0].newlist[1] = evalList_.list1[listIndex];
 
         hand_[us].minusOne(hpTo);
         xorBBs(ptTo, to, us);
@@ -418,10 +415,10 @@ void Position::doMove(const Move move, StateInfo& newSt, const CheckInfo& ci, co
 
             hand_[us].plusOne(hpCaptured);
             const int toListIndex = evalList_.squareHandToList[to];
-            st_->cl.listindex[1] = toListIndex;
-            st_->cl.clistpair[1].oldlist[0] = evalList_.list0[toListIndex];
-            st_->cl.clistpair[1].oldlist[1] = evalList_.list1[toListIndex];
-            st_->cl.size = 2;
+            cl.listindex[1] = toListIndex;
+            cl.clistpair[1].oldlist[0] = evalList_.list0[toListIndex];
+            cl.clistpair[1].oldlist[1] = evalList_.list1[toListIndex];
+            cl.size = 2;
 
             const int handnum = hand(us).numOf(hpCaptured);
             evalList_.list0[toListIndex] = kppHandArray[us  ][hpCaptured] + handnum;
@@ -430,8 +427,8 @@ void Position::doMove(const Move move, StateInfo& newSt, const CheckInfo& ci, co
             evalList_.listToSquareHand[toListIndex] = squarehand;
             evalList_.squareHandToList[squarehand]  = toListIndex;
 
-            st_->cl.clistpair[1].newlist[0] = evalList_.list0[toListIndex];
-            st_->cl.clistpair[1].newlist[1] = evalList_.list1[toListIndex];
+            cl.clistpair[1].newlist[0] = evalList_.list0[toListIndex];
+            cl.clistpair[1].newlist[1] = evalList_.list1[toListIndex];
 
             st_->material += (us == Black ? capturePieceScore(ptCaptured) : -capturePieceScore(ptCaptured));
         }
@@ -446,17 +443,17 @@ void Position::doMove(const Move move, StateInfo& newSt, const CheckInfo& ci, co
             const Piece pcTo = colorAndPieceTypeToPiece(us, ptTo);
             const int fromListIndex = evalList_.squareHandToList[from];
 
-            st_->cl.listindex[0] = fromListIndex;
-            st_->cl.clistpair[0].oldlist[0] = evalList_.list0[fromListIndex];
-            st_->cl.clistpair[0].oldlist[1] = evalList_.list1[fromListIndex];
+            cl.listindex[0] = fromListIndex;
+            cl.clistpair[0].oldlist[0] = evalList_.list0[fromListIndex];
+            cl.clistpair[0].oldlist[1] = evalList_.list1[fromListIndex];
 
             evalList_.list0[fromListIndex] = kppArray[pcTo         ] + (EvalIndex)to;
             evalList_.list1[fromListIndex] = kppArray[inverse(pcTo)] + (EvalIndex)inverse(to);
             evalList_.listToSquareHand[fromListIndex] = to;
             evalList_.squareHandToList[to] = fromListIndex;
 
-            st_->cl.clistpair[0].newlist[0] = evalList_.list0[fromListIndex];
-            st_->cl.clistpair[0].newlist[1] = evalList_.list1[fromListIndex];
+            cl.clistpair[0].newlist[0] = evalList_.list0[fromListIndex];
+            cl.clistpair[0].newlist[1] = evalList_.list1[fromListIndex];
         }
 
         if (move.isPromotion())
@@ -499,6 +496,8 @@ void Position::doMove(const Move move, StateInfo& newSt, const CheckInfo& ci, co
 
     turn_ = oppositeColor(us);
     st_->hand = hand(turn());
+    if (keyHistory_)
+        keyHistory_->push(*st_);
 
     assert(isOK());
 }
@@ -580,6 +579,8 @@ void Position::undoMove(const Move move) {
     // key などは StateInfo にまとめられているので、
     // previous のポインタを st_ に代入するだけで良い。
     st_ = st_->previous;
+    if (keyHistory_)
+        keyHistory_->pop();
 
     assert(isOK());
 }
@@ -1598,8 +1599,31 @@ void Position::print() const {
 }
 
 std::string Position::toSFEN(const Ply ply) const {
-    std::stringstream ss;
-    ss << "sfen ";
+    char buf[MaxSFENLength];
+    char* last = writeSFEN(buf, ply);
+    return "sfen " + std::string(buf, last);
+}
+
+char* Position::writeSFEN(char* buf, const Ply ply) const {
+    char* p = buf;
+    auto writeChars = [&p](const char* str) {
+        while (*str)
+            *p++ = *str++;
+    };
+    auto writeInt = [&p](int n) {
+        if (n < 0) {
+            *p++ = '-';
+            n = -n;
+        }
+        char digits[16];
+        int i = 0;
+        do {
+            digits[i++] = '0' + n % 10;
+            n /= 10;
+        } while (n);
+        while (i)
+            *p++ = digits[--i];
+    };
     int space = 0;
     for (Rank rank = Rank1; rank != Rank9Wall; rank += RankDeltaS) {
         for (File file = File9; file != File1Wall; file += FileDeltaE) {
@@ -1609,22 +1633,22 @@ std::string Position::toSFEN(const Ply ply) const {
                 ++space;
             else {
                 if (space) {
-                    ss << space;
+                    *p++ = '0' + space;
                     space = 0;
                 }
-                ss << pieceToCharUSI(pc);
+                writeChars(pieceToCharUSI(pc));
             }
         }
         if (space) {
-            ss << space;
+            *p++ = '0' + space;
             space = 0;
         }
         if (rank != Rank9)
-            ss << "/";
+            *p++ = '/';
     }
-    ss << (turn() == Black ? " b " : " w ");
+    writeChars(turn() == Black ? " b " : " w ");
     if (hand(Black).value() == 0 && hand(White).value() == 0)
-        ss << "- ";
+        writeChars("- ");
     else {
         // USI の規格として、持ち駒の表記順は決まっており、先手、後手の順で、それぞれ 飛、角、金、銀、桂、香、歩 の順。
         for (Color color = Black; color < ColorNum; ++color) {
@@ -1633,23 +1657,23 @@ std::string Position::toSFEN(const Ply ply) const {
                 if (num == 0)
                     continue;
                 if (num != 1)
-                    ss << num;
+                    writeInt(num);
                 const Piece pc = colorAndHandPieceToPiece(color, hp);
-                ss << pieceToCharUSI(pc);
+                writeChars(pieceToCharUSI(pc));
             }
         }
-        ss << " ";
+        *p++ = ' ';
     }
-    ss << ply;
-    return ss.str();
+    writeInt(ply);
+    assert(p - buf < MaxSFENLength);
+    return p;
 }
 
 HuffmanCodedPos Position::toHuffmanCodedPos() const {
     HuffmanCodedPos result;
-    result.clear();
-    BitStream bs(result.data);
+    BitStream64 bs;
     // 手番 (1bit)
-    bs.putBit(turn());
+    bs.putBits(turn(), 1);
 
     // 玉の位置 (7bit * 2)
     bs.putBits(kingSquare(Black), 7);
@@ -1673,8 +1697,8 @@ HuffmanCodedPos Position::toHuffmanCodedPos() const {
                 bs.putBits(hc.code, hc.numOfBits);
         }
     }
-    assert(bs.data() == std::end(result.data));
-    assert(bs.curr() == 0);
+    assert(bs.curr() == 256);
+    bs.copyTo(result.data);
     result.ply = gamePly();
     return result;
 }
@@ -1834,43 +1858,82 @@ Key Position::computeHandKey() const {
 
 // todo: isRepetition() に名前変えた方が良さそう。
 //       同一局面4回をきちんと数えていないけど問題ないか。
+// 同一局面が i 手前にあった時の千日手の種類を返す。
+RepetitionType Position::repetitionType(const int i) const {
+    if (i <= st_->continuousCheck[turn()])
+        return RepetitionLose;
+    else if (i <= st_->continuousCheck[oppositeColor(turn())])
+        return RepetitionWin;
+#if defined BAN_BLACK_REPETITION
+    return (turn() == Black ? RepetitionLose : RepetitionWin);
+#elif defined BAN_WHITE_REPETITION
+    return (turn() == White ? RepetitionLose : RepetitionWin);
+#else
+    return RepetitionDraw;
+#endif
+}
+
 RepetitionType Position::isDraw(const int checkMaxPly) const {
     const int Start = 4;
     int i = Start;
     const int e = std::min(st_->pliesFromNull, checkMaxPly);
 
     // 4手掛けないと千日手には絶対にならない。
-    if (i <= e) {
-        // 現在の局面と、少なくとも 4 手戻らないと同じ局面にならない。
-        // ここでまず 2 手戻る。
-        StateInfo* stp = st_->previous->previous;
-
+    if (e < i)
+        return NotRepetition;
+
+    // 履歴が足りていれば、StateInfo を辿らずに連続したメモリを調べる。
+    if (keyHistory_ && e < keyHistory_->validSize()) {
+        // 盤面が同じ局面が無ければ、千日手でも優等局面、劣等局面でもない。
+        if (!keyHistory_->mayRepeat(st_->boardKey))
+            return NotRepetition;
+        const Key key = st_->key();
         do {
-            // 更に 2 手戻る。
-            stp = stp->previous->previous;
-            if (stp->key() == st_->key()) {
-                if (i <= st_->continuousCheck[turn()])
-                    return RepetitionLose;
-                else if (i <= st_->continuousCheck[oppositeColor(turn())])
-                    return RepetitionWin;
-#if defined BAN_BLACK_REPETITION
-                return (turn() == Black ? RepetitionLose : RepetitionWin);
-#elif defined BAN_WHITE_REPETITION
-                return (turn() == White ? RepetitionLose : RepetitionWin);
-#else
-                return RepetitionDraw;
-#endif
-            }
-            else if (stp->boardKey == st_->boardKey) {
-                if (st_->hand.isEqualOrSuperior(stp->hand)) return RepetitionSuperior;
-                if (stp->hand.isEqualOrSuperior(st_->hand)) return RepetitionInferior;
+            const KeyHistory::Entry& entry = keyHistory_->back(i);
+            if (entry.key == key)
+                return repetitionType(i);
+            else if (entry.boardKey == st_->boardKey) {
+                if (st_->hand.isEqualOrSuperior(entry.hand)) return RepetitionSuperior;
+                if (entry.hand.isEqualOrSuperior(st_->hand)) return RepetitionInferior;
             }
             i += 2;
         } while (i <= e);
+        return NotRepetition;
     }
+
+    // 現在の局面と、少なくとも 4 手戻らないと同じ局面にならない。
+    // ここでまず 2 手戻る。
+    StateInfo* stp = st_->previous->previous;
+
+    do {
+        // 更に 2 手戻る。
+        stp = stp->previous->previous;
+        if (stp->key() == st_->key())
+            return repetitionType(i);
+        else if (stp->boardKey == st_->boardKey) {
+            if (st_->hand.isEqualOrSuperior(stp->hand)) return RepetitionSuperior;
+            if (stp->hand.isEqualOrSuperior(st_->hand)) return RepetitionInferior;
+        }
+        i += 2;
+    } while (i <= e);
     return NotRepetition;
 }
 
+void Position::setKeyHistory(KeyHistory* keyHistory) {
+    keyHistory_ = keyHistory;
+    if (!keyHistory_)
+        return;
+    // 千日手判定で遡るのは pliesFromNull 手前までなので、それより前の StateInfo は辿らない。
+    const int num = std::min(st_->pliesFromNull, KeyHistory::Capacity - 1);
+    std::vector<const StateInfo*> states(num + 1);
+    const StateInfo* stp = st_;
+    for (int i = 0; i <= num; ++i, stp = stp->previous)
+        states[num - i] = stp;
+    keyHistory_->clear();
+    for (const StateInfo* state : states)
+        keyHistory_->push(*state);
+}
+
 namespace {
     void printHandPiece(const Position& pos, const HandPiece hp, const Color c, const std::string& str) {
         if (pos.hand(c).numOf(hp)) {
@@ -1897,23 +1960,52 @@ Position& Position::operator = (const Position& pos) {
     startState_ = *st_;
     st_ = &startState_;
     nodes_ = 0;
+    keyHistory_ = nullptr;
 
     assert(isOK());
     return *this;
 }
 
 void Position::set(const std::string& sfen, Thread* th) {
+    if (!set(sfen.data(), sfen.data() + sfen.size(), th))
+        std::cout << "incorrect SFEN string : " << sfen << std::endl;
+}
+
+namespace {
+    // 駒の種類毎の、持ち駒と盤上の成駒も含めた 1 組分の枚数。
+    const u32 HandPieceTotalNum[HandPieceNum] = {18, 4, 4, 4, 4, 2, 2};
+}
+
+bool Position::pieceNumIsOK(const bool allPieces) const {
+    for (Color c = Black; c < ColorNum; ++c) {
+        if (bbOf(King, c).popCount() != 1)
+            return false;
+    }
+    const Bitboard bbs[HandPieceNum] = {bbOf(Pawn, ProPawn), bbOf(Lance, ProLance), bbOf(Knight, ProKnight), bbOf(Silver, ProSilver),
+                                        bbOf(Gold), bbOf(Bishop, Horse), bbOf(Rook, Dragon)};
+    for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp) {
+        const u32 num = bbs[hp].popCount() + hand(Black).numOf(hp) + hand(White).numOf(hp);
+        if (HandPieceTotalNum[hp] < num || (allPieces && num != HandPieceTotalNum[hp]))
+            return false;
+    }
+    return true;
+}
+
+bool Position::set(const char* first, const char* last, Thread* th) {
     Piece promoteFlag = UnPromoted;
-    std::istringstream ss(sfen);
-    char token;
+    const char* p = first;
     Square sq = SQ91;
+    // 項目の区切りの空白は何文字続いても良い。
+    auto isSpace = [](const char c) { return isspace(static_cast<unsigned char>(c)) != 0; };
+    auto skipSpaces = [&] { while (p != last && isSpace(*p)) ++p; };
 
     Searcher* s = std::move(searcher_);
     clear();
     setSearcher(s);
 
     // 盤上の駒
-    while (ss.get(token) && token != ' ') {
+    for (skipSpaces(); p != last && !isSpace(*p); ++p) {
+        const char token = *p;
         if (isdigit(token))
             sq += DeltaE * (token - '0');
         else if (token == '/')
@@ -1927,27 +2019,29 @@ void Position::set(const std::string& sfen, Thread* th) {
                 sq += DeltaE;
             }
             else
-                goto INCORRECT;
+                return false;
         }
         else
-            goto INCORRECT;
+            return false;
     }
     kingSquare_[Black] = bbOf(King, Black).constFirstOneFromSQ11();
     kingSquare_[White] = bbOf(King, White).constFirstOneFromSQ11();
     goldsBB_ = bbOf(Gold, ProPawn, ProLance, ProKnight, ProSilver);
 
     // 手番
-    while (ss.get(token) && token != ' ') {
-        if (token == 'b')
+    for (skipSpaces(); p != last && !isSpace(*p); ++p) {
+        if (*p == 'b')
             turn_ = Black;
-        else if (token == 'w')
+        else if (*p == 'w')
             turn_ = White;
         else
-            goto INCORRECT;
+            return false;
     }
 
     // 持ち駒
-    for (int digits = 0; ss.get(token) && token != ' '; ) {
+    int digits = 0;
+    for (skipSpaces(); p != last && !isSpace(*p); ++p) {
+        const char token = *p;
         if (token == '-')
             memset(hand_, 0, sizeof(hand_));
         else if (isdigit(token))
@@ -1955,16 +2049,27 @@ void Position::set(const std::string& sfen, Thread* th) {
         else if (g_charToPieceUSI.isLegalChar(token)) {
             // 持ち駒を32bit に pack する
             const Piece piece = g_charToPieceUSI.value(token);
+            const HandPiece hp = pieceTypeToHandPiece(pieceToPieceType(piece));
+            // 玉や 1 組分より多い枚数は、他の駒の bit に溢れるので受け付けない。
+            if (hp == HandPieceNum || HandPieceTotalNum[hp] < static_cast<u32>(digits))
+                return false;
             setHand(piece, (digits == 0 ? 1 : digits));
 
             digits = 0;
         }
         else
-            goto INCORRECT;
+            return false;
     }
 
     // 次の手が何手目か
-    ss >> gamePly_;
+    // 省略されていれば 0 手目とする。
+    gamePly_ = 0;
+    for (skipSpaces(); p != last && isdigit(*p); ++p)
+        gamePly_ = gamePly_ * 10 + (*p - '0');
+
+    // 駒が多過ぎると EvalList に収まらない。
+    if (!pieceNumIsOK(false))
+        return false;
 
     // 残り時間, hash key, (もし実装するなら)駒番号などをここで設定
     st_->boardKey = computeBoardKey();
@@ -1976,9 +2081,7 @@ void Position::set(const std::string& sfen, Thread* th) {
     st_->material = computeMaterial();
     thisThread_ = th;
 
-    return;
-INCORRECT:
-    std::cout << "incorrect SFEN string : " << sfen << std::endl;
+    return true;
 }
 
 bool Position::set(const HuffmanCodedPos& hcp, Thread* th) {
@@ -1986,15 +2089,16 @@ bool Position::set(const HuffmanCodedPos& hcp, Thread* th) {
     clear();
     setSearcher(s);
 
-    HuffmanCodedPos tmp = hcp; // ローカルにコピー
-    BitStream bs(tmp.data);
+    BitStream64 bs(hcp.data);
 
     // 手番
-    turn_ = static_cast<Color>(bs.getBit());
+    turn_ = static_cast<Color>(bs.getBits(1));
 
-    // 玉の位置
+    // 玉の位置。7 bit なので盤外を指していることがある。
     Square sq0 = (Square)bs.getBits(7);
     Square sq1 = (Square)bs.getBits(7);
+    if (SquareNum <= sq0 || SquareNum <= sq1 || sq0 == sq1)
+        goto INCORRECT_HUFFMAN_CODE;
     setPiece(BKing, static_cast<Square>(sq0));
     setPiece(WKing, static_cast<Square>(sq1));
 
@@ -2002,38 +2106,36 @@ bool Position::set(const HuffmanCodedPos& hcp, Thread* th) {
     for (Square sq = SQ11; sq < SquareNum; ++sq) {
         if (pieceToPieceType(piece(sq)) == King) // piece(sq) は BKing, WKing, Empty のどれか。
             continue;
-        HuffmanCode hc = {0, 0};
-        while (hc.numOfBits <= 8) {
-            hc.code |= bs.getBit() << hc.numOfBits++;
-            if (HuffmanCodedPos::boardCodeToPieceHash.value(hc.key) != PieceNone) {
-                const Piece pc = HuffmanCodedPos::boardCodeToPieceHash.value(hc.key);
-                if (pc != Empty)
-                    setPiece(HuffmanCodedPos::boardCodeToPieceHash.value(hc.key), sq);
-                break;
-            }
-        }
-        if (HuffmanCodedPos::boardCodeToPieceHash.value(hc.key) == PieceNone)
+        if (256 <= bs.curr()) // 末尾を越えて番兵より先を読まないようにする。
+            goto INCORRECT_HUFFMAN_CODE;
+        const HuffmanDecodeEntry entry = HuffmanCodedPos::boardDecodeTable[bs.peek8()];
+        if (entry.numOfBits == 0)
             goto INCORRECT_HUFFMAN_CODE;
+        bs.skip(entry.numOfBits);
+        if (entry.piece != Empty)
+            setPiece(static_cast<Piece>(entry.piece), sq);
     }
-    while (bs.data() != std::end(tmp.data)) {
-        HuffmanCode hc = {0, 0};
-        while (hc.numOfBits <= 8) {
-            hc.code |= bs.getBit() << hc.numOfBits++;
-            const Piece pc = HuffmanCodedPos::handCodeToPieceHash.value(hc.key);
-            if (pc != PieceNone) {
-                hand_[pieceToColor(pc)].plusOne(pieceTypeToHandPiece(pieceToPieceType(pc)));
-                break;
-            }
-        }
-        if (HuffmanCodedPos::handCodeToPieceHash.value(hc.key) == PieceNone)
+    while (bs.curr() < 256) {
+        const HuffmanDecodeEntry entry = HuffmanCodedPos::handDecodeTable[bs.peek8()];
+        if (entry.numOfBits == 0)
+            goto INCORRECT_HUFFMAN_CODE;
+        bs.skip(entry.numOfBits);
+        const Piece pc = static_cast<Piece>(entry.piece);
+        const HandPiece hp = pieceTypeToHandPiece(pieceToPieceType(pc));
+        if (hand_[Black].numOf(hp) + hand_[White].numOf(hp) == HandPieceTotalNum[hp]) // 他の駒の bit に溢れないようにする。
             goto INCORRECT_HUFFMAN_CODE;
+        hand_[pieceToColor(pc)].plusOne(hp);
     }
+    if (bs.curr() != 256) // 最後の符号が末尾を跨いでいる。
+        goto INCORRECT_HUFFMAN_CODE;
+    if (!pieceNumIsOK(true))
+        goto INCORRECT_HUFFMAN_CODE;
 
     kingSquare_[Black] = bbOf(King, Black).constFirstOneFromSQ11();
     kingSquare_[White] = bbOf(King, White).constFirstOneFromSQ11();
     goldsBB_ = bbOf(Gold, ProPawn, ProLance, ProKnight, ProSilver);
 
-    gamePly_ = tmp.ply;
+    gamePly_ = hcp.ply;
 
     st_->boardKey = computeBoardKey();
     st_->handKey = computeHandKey();
@@ -2323,47 +2425,46 @@ void Position::clear() {
 
 // 先手、後手に関わらず、sq へ移動可能な Bitboard を返す。
 Bitboard Position::attackersTo(const Square sq, const Bitboard& occupied) const {
-    const Bitboard golds = goldsBB();
-    return (((attacksFrom<Pawn  >(Black, sq          ) & bbOf(Pawn  ))
-             | (attacksFrom<Lance >(Black, sq, occupied) & bbOf(Lance ))
-             | (attacksFrom<Knight>(Black, sq          ) & bbOf(Knight))
-             | (attacksFrom<Silver>(Black, sq          ) & bbOf(Silver))
-             | (attacksFrom<Gold  >(Black, sq          ) & golds       ))
-            & bbOf(White))
-        | (((attacksFrom<Pawn  >(White, sq          ) & bbOf(Pawn  ))
-            | (attacksFrom<Lance >(White, sq, occupied) & bbOf(Lance ))
-            | (attacksFrom<Knight>(White, sq          ) & bbOf(Knight))
-            | (attacksFrom<Silver>(White, sq          ) & bbOf(Silver))
-            | (attacksFrom<Gold  >(White, sq          ) & golds))
-           & bbOf(Black))
-        | (attacksFrom<Bishop>(sq, occupied) & bbOf(Bishop, Horse        ))
-        | (attacksFrom<Rook  >(sq, occupied) & bbOf(Rook  , Dragon       ))
-        | (attacksFrom<King  >(sq          ) & bbOf(King  , Horse, Dragon));
+    // 先手の駒の利きの逆から後手の駒、後手の駒の利きの逆から先手の駒を、1 組にして同時に求める。
+    const Bitboard256 pairBB = ((Bitboard256(attacksFrom<Pawn  >(Black, sq          ), attacksFrom<Pawn  >(White, sq          )) & Bitboard256(bbOf(Pawn  )))
+                                | (Bitboard256(attacksFrom<Lance >(Black, sq, occupied), attacksFrom<Lance >(White, sq, occupied)) & Bitboard256(bbOf(Lance )))
+                                | (Bitboard256(attacksFrom<Knight>(Black, sq          ), attacksFrom<Knight>(White, sq          )) & Bitboard256(bbOf(Knight)))
+                                | (Bitboard256(attacksFrom<Silver>(Black, sq          ), attacksFrom<Silver>(White, sq          )) & Bitboard256(bbOf(Silver)))
+                                | (Bitboard256(attacksFrom<Gold  >(Black, sq          ), attacksFrom<Gold  >(White, sq          )) & Bitboard256(goldsBB())))
+        & Bitboard256(bbOf(White), bbOf(Black));
+    // 角と飛車も 1 組にする。
+    const Bitboard256 sliders = Bitboard256(attacksFrom<Bishop>(sq, occupied), attacksFrom<Rook>(sq, occupied))
+        & Bitboard256(bbOf(Bishop, Horse), bbOf(Rook, Dragon));
+    return (pairBB | sliders).merge()
+        | (attacksFrom<King>(sq) & bbOf(King, Horse, Dragon));
 }
 
 // occupied を Position::occupiedBB() 以外のものを使用する場合に使用する。
+// 独立した駒種の利きを 2 つずつ組にして計算する。
 Bitboard Position::attackersTo(const Color c, const Square sq, const Bitboard& occupied) const {
     const Color opposite = oppositeColor(c);
-    return ((attacksFrom<Pawn  >(opposite, sq          ) & bbOf(Pawn  ))
-            | (attacksFrom<Lance >(opposite, sq, occupied) & bbOf(Lance ))
-            | (attacksFrom<Knight>(opposite, sq          ) & bbOf(Knight))
-            | (attacksFrom<Silver>(opposite, sq          ) & bbOf(Silver, King, Dragon))
-            | (attacksFrom<Gold  >(opposite, sq          ) & (bbOf(King  , Horse) | goldsBB()))
-            | (attacksFrom<Bishop>(          sq, occupied) & bbOf(Bishop, Horse        ))
-            | (attacksFrom<Rook  >(          sq, occupied) & bbOf(Rook  , Dragon       )))
+    const Bitboard256 pairBB = (Bitboard256(attacksFrom<Pawn  >(opposite, sq          ), attacksFrom<Lance >(opposite, sq, occupied))
+                                & Bitboard256(bbOf(Pawn  ), bbOf(Lance)))
+        | (Bitboard256(attacksFrom<Knight>(opposite, sq          ), attacksFrom<Silver>(opposite, sq          ))
+           & Bitboard256(bbOf(Knight), bbOf(Silver, King, Dragon)))
+        | (Bitboard256(attacksFrom<Gold  >(opposite, sq          ), attacksFrom<Bishop>(          sq, occupied))
+           & Bitboard256(bbOf(King, Horse) | goldsBB(), bbOf(Bishop, Horse)));
+    return (pairBB.merge()
+            | (attacksFrom<Rook>(sq, occupied) & bbOf(Rook, Dragon)))
         & bbOf(c);
 }
 
 // 玉以外で sq へ移動可能な c 側の駒の Bitboard を返す。
 Bitboard Position::attackersToExceptKing(const Color c, const Square sq) const {
     const Color opposite = oppositeColor(c);
-    return ((attacksFrom<Pawn  >(opposite, sq) & bbOf(Pawn  ))
-            | (attacksFrom<Lance >(opposite, sq) & bbOf(Lance ))
-            | (attacksFrom<Knight>(opposite, sq) & bbOf(Knight))
-            | (attacksFrom<Silver>(opposite, sq) & bbOf(Silver, Dragon))
-            | (attacksFrom<Gold  >(opposite, sq) & (goldsBB() | bbOf(Horse)))
-            | (attacksFrom<Bishop>(          sq) & bbOf(Bishop, Horse ))
-            | (attacksFrom<Rook  >(          sq) & bbOf(Rook  , Dragon)))
+    const Bitboard256 pairBB = (Bitboard256(attacksFrom<Pawn  >(opposite, sq), attacksFrom<Lance >(opposite, sq))
+                                & Bitboard256(bbOf(Pawn  ), bbOf(Lance)))
+        | (Bitboard256(attacksFrom<Knight>(opposite, sq), attacksFrom<Silver>(opposite, sq))
+           & Bitboard256(bbOf(Knight), bbOf(Silver, Dragon)))
+        | (Bitboard256(attacksFrom<Gold  >(opposite, sq), attacksFrom<Bishop>(          sq))
+           & Bitboard256(goldsBB() | bbOf(Horse), bbOf(Bishop, Horse)));
+    return (pairBB.merge()
+            | (attacksFrom<Rook>(sq) & bbOf(Rook, Dragon)))
         & bbOf(c);
 }
 
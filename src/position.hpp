@@ -58,7 +58,7 @@ struct ChangedListPair {
 struct ChangedLists {
     ChangedListPair clistpair[2]; // 一手で動く駒は最大2つ。(動く駒、取られる駒)
     int listindex[2]; // 一手で動く駒は最大2つ。(動く駒、取られる駒)
-    size_t size;
+    int size;
 };
 
 struct StateInfo {
@@ -81,9 +81,69 @@ struct StateInfo {
 
     Key key() const { return boardKey + handKey; }
 };
+// 毎手読み書きする値は先頭の 1 cache line に収まっていること。
+static_assert(offsetof(StateInfo, cl) <= CacheLineSize, "");
 
 using StateListPtr = std::unique_ptr<std::deque<StateInfo>>;
 
+// 千日手判定用の、局面の key の履歴。
+// StateInfo の previous を辿る代わりに、連続したメモリを後ろから調べる。
+// 探索中の局面だけが使うので、スレッド毎に持つ。
+// 同じ boardKey の局面が履歴に無ければ、調べずに千日手でないと分かるように、boardKey の上位 bit で数を数えておく。
+class KeyHistory {
+public:
+    struct Entry {
+        Key key;
+        Key boardKey;
+        Hand hand; // 手番側の持ち駒
+    };
+    static const int Capacity = 1024; // 2 の累乗であること。
+    static const int FilterSize = 1024; // 2 の累乗であること。
+
+    void clear() {
+        size_ = validSize_ = 0;
+        std::fill(std::begin(filter_), std::end(filter_), 0);
+    }
+    void push(const StateInfo& st) {
+        Entry& entry = entries_[size_++ & (Capacity - 1)];
+        if (validSize_ == Capacity) // 最も古い局面を上書きする。
+            --filter_[filterIndex(entry.boardKey)];
+        else
+            ++validSize_;
+        entry.key = st.key();
+        entry.boardKey = st.boardKey;
+        entry.hand = st.hand;
+        ++filter_[filterIndex(entry.boardKey)];
+    }
+    void pop() {
+        assert(0 < validSize_);
+        --validSize_;
+        --filter_[filterIndex(entries_[--size_ & (Capacity - 1)].boardKey)];
+    }
+    // null move で手番が変わった時に、最後の局面を置き換える。
+    void replaceBack(const StateInfo& st) {
+        pop();
+        push(st);
+    }
+    // 最後の局面から n 手前の局面。0 なら最後の局面。
+    const Entry& back(const int n) const {
+        assert(n < validSize_);
+        return entries_[(size_ - 1 - n) & (Capacity - 1)];
+    }
+    // 最後の局面を含めて、何手前まで遡れるか。
+    int validSize() const { return validSize_; }
+    // 最後の局面以外に boardKey が同じ局面があるかも知れないなら true
+    bool mayRepeat(const Key boardKey) const { return 1 < filter_[filterIndex(boardKey)]; }
+
+private:
+    static size_t filterIndex(const Key boardKey) { return static_cast<size_t>(boardKey >> 54) & (FilterSize - 1); }
+
+    Entry entries_[Capacity];
+    u16 filter_[FilterSize];
+    u64 size_ = 0; // push した数 - pop した数。entries_ の位置を決める。
+    int validSize_ = 0; // 上書きされずに残っている局面の数
+};
+
 class BitStream {
 public:
     // 読み込む先頭データのポインタをセットする。
@@ -136,39 +196,84 @@ private:
     int curr_; // 1byte 中の bit の位置
 };
 
-union HuffmanCode {
-    struct {
-        u8 code;      // 符号化時の bit 列
-        u8 numOfBits; // 使用 bit 数
-    };
-    u16 key; // std::unordered_map の key として使う。
+// BitStream と同じ bit の並び (各 byte の下位 bit から) で、64 bit 単位でまとめて読み書きする。
+// HuffmanCodedPos の符号化、復号用。byte 列と u64 の変換はリトルエンディアンを前提とする。
+class BitStream64 {
+public:
+    static const int WordNum = 4; // 256 bit
+    BitStream64() : words_(), curr_() {}
+    explicit BitStream64(const u8* d) : curr_() {
+        std::memcpy(words_, d, sizeof(u64) * WordNum);
+        words_[WordNum] = 0;
+    }
+    // 8 bit 先読みする。どこまで読み込んだかを表す bit の位置は進めない。
+    u32 peek8() const {
+        const int w = curr_ >> 6;
+        const int o = curr_ & 63;
+        u64 result = words_[w] >> o;
+        if (56 < o)
+            result |= words_[w + 1] << (64 - o);
+        return static_cast<u32>(result & 0xff);
+    }
+    // numOfBits bit 読み込む。numOfBits <= 8
+    u32 getBits(const int numOfBits) {
+        assert(numOfBits <= 8);
+        const u32 result = peek8() & ((1u << numOfBits) - 1);
+        skip(numOfBits);
+        return result;
+    }
+    void skip(const int numOfBits) { curr_ += numOfBits; }
+    // val の値を numOfBits bit 書き込む。numOfBits <= 8
+    void putBits(const u32 val, const int numOfBits) {
+        assert(numOfBits <= 8);
+        const int w = curr_ >> 6;
+        const int o = curr_ & 63;
+        words_[w] |= static_cast<u64>(val) << o;
+        if (64 - numOfBits < o)
+            words_[w + 1] |= static_cast<u64>(val) >> (64 - o);
+        curr_ += numOfBits;
+    }
+    void copyTo(u8* d) const { std::memcpy(d, words_, sizeof(u64) * WordNum); }
+    int curr() const { return curr_; } // 先頭からの bit の位置
+
+private:
+    u64 words_[WordNum + 1]; // 最後の要素は末尾を跨いで先読みする為の番兵。
+    int curr_;
 };
 
-struct HuffmanCodeToPieceHash : public std::unordered_map<u16, Piece> {
-    Piece value(const u16 key) const {
-        const auto it = find(key);
-        if (it == std::end(*this))
-            return PieceNone;
-        return it->second;
-    }
+struct HuffmanCode {
+    u8 code;      // 符号化時の bit 列
+    u8 numOfBits; // 使用 bit 数
+};
+
+// 符号の先頭 8 bit から駒と符号の bit 数を引く為の表の要素。
+struct HuffmanDecodeEntry {
+    u8 piece;     // Piece
+    u8 numOfBits; // 0 なら該当する符号が無い。
 };
 
 // Huffman 符号化された局面のデータ構造。256 bit で局面を表す。
 struct HuffmanCodedPos {
     static const HuffmanCode boardCodeTable[PieceNone];
     static const HuffmanCode handCodeTable[HandPieceNum][ColorNum];
-    static HuffmanCodeToPieceHash boardCodeToPieceHash;
-    static HuffmanCodeToPieceHash handCodeToPieceHash;
+    // 符号は最長 8 bit で、どの符号も他の符号の先頭部分にはならないので、
+    // 8 bit 先読みした値で引けば、1 回の表引きで駒と bit 数が決まる。
+    static HuffmanDecodeEntry boardDecodeTable[256];
+    static HuffmanDecodeEntry handDecodeTable[256];
     static void init() {
+        auto setEntries = [](HuffmanDecodeEntry table[256], const HuffmanCode hc, const Piece pc) {
+            for (int bits = 0; bits < 256; bits += (1 << hc.numOfBits))
+                table[bits | hc.code] = {static_cast<u8>(pc), hc.numOfBits};
+        };
         for (Piece pc = Empty; pc <= BDragon; ++pc)
             if (pieceToPieceType(pc) != King) // 玉は位置で符号化するので、駒の種類では符号化しない。
-                boardCodeToPieceHash[boardCodeTable[pc].key] = pc;
+                setEntries(boardDecodeTable, boardCodeTable[pc], pc);
         for (Piece pc = WPawn; pc <= WDragon; ++pc)
             if (pieceToPieceType(pc) != King) // 玉は位置で符号化するので、駒の種類では符号化しない。
-                boardCodeToPieceHash[boardCodeTable[pc].key] = pc;
+                setEntries(boardDecodeTable, boardCodeTable[pc], pc);
         for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp)
             for (Color c = Black; c < ColorNum; ++c)
-                handCodeToPieceHash[handCodeTable[hp][c].key] = colorAndPieceTypeToPiece(c, handPieceToPieceType(hp));
+                setEntries(handDecodeTable, handCodeTable[hp][c], colorAndPieceTypeToPiece(c, handPieceToPieceType(hp)));
     }
     void clear() { std::fill(std::begin(data), std::end(data), 0); }
 
@@ -193,8 +298,8 @@ struct Searcher;
 
 class Position {
 public:
-    Position() {}
-    explicit Position(Searcher* s) : searcher_(s) {}
+    Position() : keyHistory_(nullptr) {}
+    explicit Position(Searcher* s) : keyHistory_(nullptr), searcher_(s) {}
     Position(const Position& pos) { *this = pos; }
     Position(const Position& pos, Thread* th) {
         *this = pos;
@@ -207,8 +312,14 @@ public:
 
     Position& operator = (const Position& pos);
     void set(const std::string& sfen, Thread* th);
+    // [first, last) の SFEN 文字列から局面を作る。文字列のコピーを作らないので、大量の局面を読む時に使う。
+    // 不正な SFEN なら false を返す。
+    bool set(const char* first, const char* last, Thread* th);
     bool set(const HuffmanCodedPos& hcp, Thread* th);
     void set(std::mt19937& mt, Thread* th);
+    // 玉が先後 1 枚ずつで、他の駒が持ち駒と成駒も含めて駒の種類毎に 1 組分を越えていなければ true。
+    // allPieces なら、全ての駒が丁度 1 組分揃っている事も求める。EvalList は全ての駒が揃っている事を前提にしている。
+    bool pieceNumIsOK(const bool allPieces) const;
 
     Bitboard bbOf(const PieceType pt) const                                            { return byTypeBB_[pt]; }
     Bitboard bbOf(const Color c) const                                                 { return byColorBB_[c]; }
@@ -248,6 +359,24 @@ public:
     // BetweenIsUs == true  : 間の駒が自駒。
     // BetweenIsUs == false : 間の駒が敵駒。
     template <bool BetweenIsUs = true> Bitboard discoveredCheckBB() const { return hiddenCheckers<false, BetweenIsUs>(); }
+    // pinnedBB() と discoveredCheckBB() を同時に求める。
+    // 自玉と敵玉に対する遠隔駒の絞り込みを 1 組にして行う。
+    void pinnedAndDiscoveredCheckBB(Bitboard& pinned, Bitboard& dcBB) const {
+        const Color us = turn();
+        const Color them = oppositeColor(us);
+        const Square ksqUs = kingSquare(us);
+        const Square ksqThem = kingSquare(them);
+
+        Bitboard256 pinners = (Bitboard256(bbOf(Lance)) & Bitboard256(lanceAttackToEdge(us, ksqUs), lanceAttackToEdge(them, ksqThem)))
+            | (Bitboard256(bbOf(Rook, Dragon)) & Bitboard256(rookAttackToEdge(ksqUs), rookAttackToEdge(ksqThem)))
+            | (Bitboard256(bbOf(Bishop, Horse)) & Bitboard256(bishopAttackToEdge(ksqUs), bishopAttackToEdge(ksqThem)));
+        pinners &= Bitboard256(bbOf(them), bbOf(us));
+
+        Bitboard pinnersToUs, pinnersToThem;
+        pinners.toBitboards(pinnersToUs, pinnersToThem);
+        pinned = betweenOnlyOneBB(pinnersToUs, ksqUs, us);
+        dcBB = betweenOnlyOneBB(pinnersToThem, ksqThem, us);
+    }
 
     // toFile と同じ筋に us の歩がないなら true
     bool noPawns(const Color us, const File toFile) const { return !bbOf(Pawn, us).andIsAny(fileMask(toFile)); }
@@ -358,12 +487,18 @@ public:
     void print() const;
     std::string toSFEN(const Ply ply) const;
     std::string toSFEN() const { return toSFEN(gamePly()); }
+    // 先頭の "sfen " を付けずに SFEN 文字列を buf に書き、書いた文字列の末尾を返す。終端文字は書かない。
+    // buf は MaxSFENLength 以上の大きさにすること。
+    char* writeSFEN(char* buf, const Ply ply) const;
 
     HuffmanCodedPos toHuffmanCodedPos() const;
 
     s64 nodesSearched() const          { return nodes_; }
     void setNodesSearched(const s64 n) { nodes_ = n; }
     RepetitionType isDraw(const int checkMaxPly = std::numeric_limits<int>::max()) const;
+    // 千日手判定に keyHistory を使うようにする。現在の局面までの履歴を StateInfo から作り直す。
+    // Position をコピーしても引き継がないので、コピーした後に改めて呼ぶこと。
+    void setKeyHistory(KeyHistory* keyHistory);
 
     Thread* thisThread() const { return thisThread_; }
 
@@ -435,20 +570,27 @@ private:
     // pin されて(して)いる駒の Bitboard を返す。
     // BetweenIsUs == true  : 間の駒が自駒。
     // BetweenIsUs == false : 間の駒が敵駒。
+    RepetitionType repetitionType(const int i) const;
+
     template <bool FindPinned, bool BetweenIsUs> Bitboard hiddenCheckers() const {
-        Bitboard result = allZeroBB();
         const Color us = turn();
         const Color them = oppositeColor(us);
-        // pin する遠隔駒
-        // まずは自駒か敵駒かで大雑把に判別
-        Bitboard pinners = bbOf(FindPinned ? them : us);
-
-        const Square ksq = kingSquare(FindPinned ? us : them);
+        const Color kingColor = (FindPinned ? us : them);
+        const Square ksq = kingSquare(kingColor);
 
         // 障害物が無ければ玉に到達出来る駒のBitboardだけ残す。
-        pinners &= (bbOf(Lance) & lanceAttackToEdge((FindPinned ? us : them), ksq)) |
-            (bbOf(Rook, Dragon) & rookAttackToEdge(ksq)) | (bbOf(Bishop, Horse) & bishopAttackToEdge(ksq));
+        // 香車と飛車の判定を 1 組にして同時に行う。
+        const Bitboard256 sliders = Bitboard256(bbOf(Lance), bbOf(Rook, Dragon))
+            & Bitboard256(lanceAttackToEdge(kingColor, ksq), rookAttackToEdge(ksq));
+        // pin する遠隔駒
+        const Bitboard pinners = (sliders.merge() | (bbOf(Bishop, Horse) & bishopAttackToEdge(ksq)))
+            & bbOf(FindPinned ? them : us);
 
+        return betweenOnlyOneBB(pinners, ksq, (BetweenIsUs ? us : them));
+    }
+    // pinners の各駒と ksq の間にある駒が1つで、かつ、c 側の駒のとき、その駒を集めた Bitboard を返す。
+    Bitboard betweenOnlyOneBB(Bitboard pinners, const Square ksq, const Color c) const {
+        Bitboard result = allZeroBB();
         while (pinners) {
             const Square sq = pinners.firstOneFromSQ11();
             // pin する遠隔駒と玉の間にある駒の位置の Bitboard
@@ -457,7 +599,7 @@ private:
             // pin する遠隔駒と玉の間にある駒が1つで、かつ、引数の色のとき、その駒は(を) pin されて(して)いる。
             if (between
                 && between.isOneBit<false>()
-                && between.andIsAny(bbOf(BetweenIsUs ? us : them)))
+                && between.andIsAny(bbOf(c)))
             {
                 result |= between;
             }
@@ -503,6 +645,8 @@ private:
     Ply gamePly_;
     Thread* thisThread_;
     s64 nodes_;
+    // 千日手判定に使う局面の履歴。nullptr なら StateInfo を辿る。
+    KeyHistory* keyHistory_;
 
     Searcher* searcher_;
 
@@ -532,20 +676,29 @@ template <> inline Bitboard Position::attacksFrom<Dragon>(const Color  , const S
 // の局面が最大合法手局面で 593 手。番兵の分、+ 1 しておく。
 const int MaxLegalMoves = 593 + 1;
 
-class CharToPieceUSI : public std::map<char, Piece> {
+// SFEN 文字列の長さの上限。盤上が駒と成りの '+' で高々 81 + 40 文字、段の区切りが 8 文字で、
+// 手番、持ち駒、手数を足しても十分収まる。
+const int MaxSFENLength = 256;
+
+// SFEN を 1 文字ずつ読むので、std::map ではなく文字コードで引く表にしておく。
+class CharToPieceUSI {
 public:
     CharToPieceUSI() {
-        (*this)['P'] = BPawn;   (*this)['p'] = WPawn;
-        (*this)['L'] = BLance;  (*this)['l'] = WLance;
-        (*this)['N'] = BKnight; (*this)['n'] = WKnight;
-        (*this)['S'] = BSilver; (*this)['s'] = WSilver;
-        (*this)['B'] = BBishop; (*this)['b'] = WBishop;
-        (*this)['R'] = BRook;   (*this)['r'] = WRook;
-        (*this)['G'] = BGold;   (*this)['g'] = WGold;
-        (*this)['K'] = BKing;   (*this)['k'] = WKing;
-    }
-    Piece value(char c) const      { return this->find(c)->second; }
-    bool isLegalChar(char c) const { return (this->find(c) != this->end()); }
+        std::fill(std::begin(table_), std::end(table_), Empty);
+        table_['P'] = BPawn;   table_['p'] = WPawn;
+        table_['L'] = BLance;  table_['l'] = WLance;
+        table_['N'] = BKnight; table_['n'] = WKnight;
+        table_['S'] = BSilver; table_['s'] = WSilver;
+        table_['B'] = BBishop; table_['b'] = WBishop;
+        table_['R'] = BRook;   table_['r'] = WRook;
+        table_['G'] = BGold;   table_['g'] = WGold;
+        table_['K'] = BKing;   table_['k'] = WKing;
+    }
+    Piece value(char c) const      { return table_[static_cast<unsigned char>(c)]; }
+    bool isLegalChar(char c) const { return value(c) != Empty; }
+
+private:
+    Piece table_[256];
 };
 extern const CharToPieceUSI g_charToPieceUSI;
 
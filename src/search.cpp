@@ -42,6 +42,8 @@ InaniwaFlag Searcher::inaniwaFlag;
 ThreadPool Searcher::threads;
 OptionsMap Searcher::options;
 EasyMoveManager Searcher::easyMove;
+Book Searcher::book;
+BookHash Searcher::bookHash;
 Searcher* Searcher::thisptr;
 #endif
 
@@ -497,6 +499,12 @@ Score Searcher::qsearch(Position& pos, SearchStack* ss, Score alpha, Score beta,
     return bestScore;
 }
 
+#if defined LEARN
+// 学習用の qsearch() (usi.cpp) から呼ぶので、実体化しておく。
+template Score Searcher::qsearch<PV, true >(Position& pos, SearchStack* ss, Score alpha, Score beta, const Depth depth);
+template Score Searcher::qsearch<PV, false>(Position& pos, SearchStack* ss, Score alpha, Score beta, const Depth depth);
+#endif
+
 void Thread::search() {
     SearchStack stack[MaxPly+7];
     SearchStack* ss = stack + 5; // To allow referencing (ss-5) and (ss+2)
@@ -693,6 +701,7 @@ void Searcher::detectInaniwa(const Position& pos) {
     if (prevInaniwaFlag != inaniwaFlag) {
         tt.clear();
         g_evalTable.clear();
+        threads.clearEvalHashShards();
     }
 }
 #endif
@@ -715,6 +724,8 @@ template <bool DO> void Position::doNullMove(StateInfo& backUpSt) {
         st_->continuousCheck[turn()] = 0;
     }
     st_->hand = hand(turn());
+    if (keyHistory_)
+        keyHistory_->replaceBack(*st_);
 
     assert(isOK());
 }
@@ -824,6 +835,23 @@ Score Searcher::search(Position& pos, SearchStack* ss, Score alpha, Score beta,
         return ttScore;
     }
 
+    // 定跡の局面では定跡手を最初に探索する。
+    // 定跡の点数は定跡手の中で最も良い点数なので、この局面の点数の下限としてしか使えない。
+    // 浅い探索で beta 以上なら、置換表と同じように BoundLower として枝刈りする。
+    if (!RootNode && !excludedMove && !bookHash.empty()) {
+        if (const BookHashEntry* bhe = bookHash.probe(posKey)) {
+            const Move bookMove = move16toMove(Move(bhe->move16), pos);
+            if (!ttMove)
+                ttMove = bookMove;
+            const Score bookScore = static_cast<Score>(bhe->score);
+            if (!PVNode && depth <= bookHash.depth() && bookScore >= beta) {
+                tte->save(posKey, scoreToTT(bookScore, ss->ply), BoundLower, depth,
+                          bookMove, ScoreNone, tt.generation());
+                return bookScore;
+            }
+        }
+    }
+
     if (!RootNode) {
         if (nyugyoku(pos)) {
             ss->staticEval = bestScore = mateIn(ss->ply);
@@ -1361,7 +1389,7 @@ void MainThread::search() {
     auto& tt = searcher->tt;
     auto& signals = searcher->signals;
 
-    static Book book;
+    Book& book = searcher->book;
     Position& pos = rootPos;
     const Color us = pos.turn();
     searcher->timeManager.init(searcher->limits, us, pos.gamePly(), pos, searcher);
@@ -27,6 +27,7 @@
 #include "timeManager.hpp"
 #include "tt.hpp"
 #include "thread.hpp"
+#include "book.hpp"
 
 class Position;
 struct SplitPoint;
@@ -119,6 +120,8 @@ struct Searcher {
     STATIC ThreadPool threads;
     STATIC OptionsMap options;
     STATIC EasyMoveManager easyMove;
+    STATIC Book book;
+    STATIC BookHash bookHash;
 
     STATIC void init();
     STATIC void clear();
@@ -21,7 +21,10 @@
 
 #include "square.hpp"
 
+#if defined GENERATE_ATTACK_TABLES
+// tablegen でテーブルを計算する時だけ使う。通常のビルドでは tablegen が生成した定義を使う。
 Direction SquareRelation[SquareNum][SquareNum];
 
 // 何かの駒で一手で行ける位置関係についての距離のテーブル。桂馬の位置は距離1とする。
 int SquareDistance[SquareNum][SquareNum];
+#endif
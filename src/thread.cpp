@@ -23,6 +23,17 @@
 #include "search.hpp"
 #include "thread.hpp"
 #include "usi.hpp"
+#include "numa.hpp"
+
+namespace {
+    // "Shared", "Thread", "NUMA" の何れか。大文字小文字は区別しない。それ以外は "Shared" とする。
+    EvalHashMode evalHashModeFromString(std::string str) {
+        std::transform(std::begin(str), std::end(str), std::begin(str), ::tolower);
+        if (str == "thread") return EvalHashPerThread;
+        if (str == "numa"  ) return EvalHashPerNumaNode;
+        return EvalHashShared;
+    }
+}
 
 Thread::Thread(Searcher* s) {
     searcher = s;
@@ -31,6 +42,10 @@ Thread::Thread(Searcher* s) {
     history.clear();
     counterMoves.clear();
     idx = s->threads.size();
+    numaNode = 0;
+    evalTables = Evaluator::tables();
+    evalHash = nullptr;
+    evalHashHits = evalHashMisses = 0;
 
     std::unique_lock<Mutex> lock(mutex);
     searching = true;
@@ -63,6 +78,24 @@ void Thread::wait(std::atomic_bool& condition) {
     sleepCondition.wait(lock, [&] { return static_cast<bool>(condition); });
 }
 
+void Thread::bindToNumaNode(const int node, const bool bind) {
+    numaNode = node;
+    evalTables = Evaluator::tables(node);
+    if (bind)
+        bindThreadToNumaNode(nativeThread, node);
+}
+
+// startThinking() で用意した探索開始局面を、このスレッドの rootPos にする。
+// 各スレッドが探索を始める時に自分で呼ぶので、スレッド数が多くても並列に準備出来る。
+void Thread::setupRoot() {
+    const ThreadPool& threads = searcher->threads;
+    rootPos = Position(threads.setupPos, this);
+    rootPos.setKeyHistory(&keyHistory);
+    rootMoves = threads.setupRootMoves;
+    maxPly = 0;
+    rootDepth = Depth0;
+}
+
 void Thread::idleLoop() {
     while (!exit) {
         std::unique_lock<Mutex> lock(mutex);
@@ -72,8 +105,10 @@ void Thread::idleLoop() {
             sleepCondition.wait(lock);
         }
         lock.unlock();
-        if (!exit)
+        if (!exit) {
+            setupRoot();
             search();
+        }
     }
 }
 
@@ -100,6 +135,58 @@ void ThreadPool::readUSIOptions(Searcher* s) {
         delete back();
         pop_back();
     }
+    setupEvalHash(s);
+}
+
+// スレッドを NUMA ノードに振り分け、評価関数を複製していればそのノードの複製を使わせる。
+// 評価関数の複製かノード毎の評価値ハッシュを使う時だけ、スレッドをノードの CPU に固定する。
+void ThreadPool::assignNumaNodes(Searcher* s) {
+    evalHashMode = evalHashModeFromString(s->options["Eval_Hash_Mode"]);
+    const int nodeNum = numaNodeNum();
+    const bool bind = 1 < nodeNum && (1 < Evaluator::replicas.size() || evalHashMode == EvalHashPerNumaNode);
+    for (Thread* th : *this)
+        th->bindToNumaNode(static_cast<int>(th->idx % nodeNum), bind);
+}
+
+void ThreadPool::setupEvalHash(Searcher* s) {
+    assignNumaNodes(s);
+    const size_t shardNum = (evalHashMode == EvalHashPerThread   ? size()       :
+                             evalHashMode == EvalHashPerNumaNode ? numaNodeNum() :
+                             0);
+    const size_t mbSize = static_cast<int>(s->options["Eval_Hash_Shard_MB"]);
+    while (evalHashShards.size() < shardNum)
+        evalHashShards.emplace_back(new EvaluateHashShard);
+    evalHashShards.resize(shardNum);
+    for (auto& shard : evalHashShards)
+        shard->resize(mbSize);
+    for (Thread* th : *this)
+        th->evalHash = (evalHashMode == EvalHashPerThread   ? evalHashShards[th->idx].get()      :
+                        evalHashMode == EvalHashPerNumaNode ? evalHashShards[th->numaNode].get() :
+                        nullptr);
+}
+
+void ThreadPool::clearEvalHashShards() {
+    for (auto& shard : evalHashShards)
+        shard->clear();
+}
+
+s64 ThreadPool::evalHashHits() const {
+    s64 hits = 0;
+    for (Thread* th : *this)
+        hits += th->evalHashHits;
+    return hits;
+}
+
+s64 ThreadPool::evalHashMisses() const {
+    s64 misses = 0;
+    for (Thread* th : *this)
+        misses += th->evalHashMisses;
+    return misses;
+}
+
+void ThreadPool::resetEvalHashStats() {
+    for (Thread* th : *this)
+        th->evalHashHits = th->evalHashMisses = 0;
 }
 
 s64 ThreadPool::nodesSearched() const {
@@ -113,13 +200,12 @@ void ThreadPool::startThinking(const Position& pos, const LimitsType& limits, St
     main()->waitForSearchFinished();
     pos.searcher()->signals.stopOnPonderHit = pos.searcher()->signals.stop = false;
     pos.searcher()->limits = limits;
-    std::vector<RootMove> rootMoves;
-
+    setupRootMoves.clear();
     for (MoveList<Legal> ml(pos); !ml.end(); ++ml) {
         if (limits.searchmoves.empty()
             || std::find(std::begin(limits.searchmoves), std::end(limits.searchmoves), ml.move()) != std::end(limits.searchmoves))
         {
-            rootMoves.push_back(RootMove(ml.move()));
+            setupRootMoves.push_back(RootMove(ml.move()));
         }
     }
 
@@ -130,12 +216,11 @@ void ThreadPool::startThinking(const Position& pos, const LimitsType& limits, St
 
     //StateInfo tmp = setUpStates->back();
 
-    for (Thread* th : pos.searcher()->threads) {
-        th->rootPos = Position(pos, th);
-        th->maxPly = 0;
-        th->rootDepth = Depth0;
-        th->rootMoves = rootMoves;
-    }
+    // 局面のコピーはここでは 1 回だけにして、各スレッドの rootPos は setupRoot() で作る。
+    // 探索を始める前に nodesSearched() が前回の探索局面数を数えないよう、局面数だけ消しておく。
+    setupPos = pos;
+    for (Thread* th : pos.searcher()->threads)
+        th->rootPos.setNodesSearched(0);
 
     //setUpStates->back() = tmp;
     main()->startSearching();
@@ -107,14 +107,22 @@ struct Thread {
     void startSearching(const bool resume = false);
     void waitForSearchFinished();
     void wait(std::atomic_bool& condition);
+    void bindToNumaNode(const int node, const bool bind);
+    void setupRoot();
 
     Searcher* searcher;
     size_t idx;
+    int numaNode;
+    EvalTables evalTables; // このスレッドが評価に使うテーブル。numaNode の複製を指す。
+    EvaluateHashShard* evalHash; // nullptr なら全スレッド共有の g_evalTable を使う。
+    s64 evalHashHits;
+    s64 evalHashMisses;
     size_t pvIdx;
     int maxPly;
     int callsCnt;
 
     Position rootPos;
+    KeyHistory keyHistory; // rootPos の千日手判定に使う。
     std::vector<RootMove> rootMoves;
     Depth rootDepth;
     Depth completedDepth;
@@ -142,6 +150,13 @@ struct MainThread : public Thread {
     Score previousScore;
 };
 
+// 評価値のハッシュテーブルの持ち方。
+enum EvalHashMode {
+    EvalHashShared,      // 全スレッドで g_evalTable を共有する。
+    EvalHashPerThread,   // スレッド毎に持つ。
+    EvalHashPerNumaNode  // NUMA ノード毎に持ち、同じノードのスレッドで共有する。
+};
+
 struct ThreadPool : public std::vector<Thread*> {
     void init(Searcher* s);
     void exit();
@@ -149,10 +164,24 @@ struct ThreadPool : public std::vector<Thread*> {
     MainThread* main() { return static_cast<MainThread*>((*this)[0]); }
     void startThinking(const Position& pos, const LimitsType& limits, StateListPtr& states);
     void readUSIOptions(Searcher* s);
+    void assignNumaNodes(Searcher* s);
+    void setupEvalHash(Searcher* s);
+    void clearEvalHashShards();
     s64 nodesSearched() const;
+    s64 evalHashHits() const;
+    s64 evalHashMisses() const;
+    void resetEvalHashStats();
+
+    EvalHashMode evalHashMode;
+
+    // 探索開始局面と、探索する合法手。startThinking() で 1 回だけ作り、
+    // 各スレッドは探索を始める時に自分のスレッドで rootPos, rootMoves にコピーする。
+    Position setupPos;
+    std::vector<RootMove> setupRootMoves;
 
 private:
     StateListPtr setupStates;
+    std::vector<std::unique_ptr<EvaluateHashShard>> evalHashShards;
 };
 
 #endif // #ifndef APERY_THREAD_HPP
@@ -30,11 +30,18 @@
 #include "thread.hpp"
 #include "benchmark.hpp"
 #include "learner.hpp"
+#include "numa.hpp"
+#include <cerrno>
+#if !defined _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace {
     void onThreads(Searcher* s, const USIOption&)      { s->threads.readUSIOptions(s); }
     void onHashSize(Searcher* s, const USIOption& opt) { s->tt.resize(opt); }
     void onClearHash(Searcher* s, const USIOption&)    { s->tt.clear(); }
+    void onEvalHash(Searcher* s, const USIOption&)     { s->threads.setupEvalHash(s); }
 }
 
 bool CaseInsensitiveLess::operator () (const std::string& s1, const std::string& s2) const {
@@ -106,6 +113,8 @@ void OptionsMap::init(Searcher* s) {
     (*this)["Min_Book_Ply"]                = USIOption(SHRT_MAX, 0, SHRT_MAX);
     (*this)["Max_Book_Ply"]                = USIOption(SHRT_MAX, 0, SHRT_MAX);
     (*this)["Min_Book_Score"]              = USIOption(-180, -ScoreInfinite, ScoreInfinite);
+    (*this)["Book_In_Search"]              = USIOption(false); // 探索中にも定跡の局面の点数を使う。isready で反映。
+    (*this)["Book_In_Search_Depth"]        = USIOption(8, 1, MaxPly); // 定跡の点数をこの深さで探索した値として扱う。
     (*this)["USI_Ponder"]                  = USIOption(true);
     (*this)["Byoyomi_Margin"]              = USIOption(500, 0, INT_MAX);
     (*this)["Time_Margin"]                 = USIOption(4500, 0, INT_MAX);
@@ -122,6 +131,14 @@ void OptionsMap::init(Searcher* s) {
     (*this)["Move_Overhead"]               = USIOption(30, 0, 5000);
     (*this)["Minimum_Thinking_Time"]       = USIOption(20, 0, INT_MAX);
     (*this)["Threads"]                     = USIOption(cpuCoreCount(), 1, MaxThreads, onThreads, s);
+    (*this)["Eval_NUMA_Replication"]       = USIOption(false); // NUMA ノード毎に評価関数テーブルを複製する。isready で反映。
+    (*this)["Eval_Hash_Mode"]              = USIOption("Shared", onEvalHash, s); // Shared, Thread, NUMA の何れか。
+    (*this)["Eval_Hash_Shard_MB"]          = USIOption(16, 1, MaxHashMB, onEvalHash, s); // Thread, NUMA の時の 1つ当たりのサイズ。
+#if defined LEARN
+    (*this)["Learn_Batch_Size"]            = USIOption(30000000, 1, INT_MAX); // use_teacher で 1回評価値を更新するのに使う教師局面数。
+    (*this)["Learn_Read_Chunk_Size"]       = USIOption(1 << 20, 1, INT_MAX); // use_teacher で教師データを先読みする単位の局面数。
+    (*this)["Learn_Read_Ahead_Chunks"]     = USIOption(4, 1, 1024); // use_teacher で先読みしておく chunk の数。
+#endif
 #ifdef NDEBUG
     (*this)["Engine_Name"]                 = USIOption("Apery");
 #else
@@ -242,10 +259,9 @@ inline double dsigmoidWinningRate(const double x) {
 
 // 学習でqsearchだけ呼んだ時のPVを取得する為の関数。
 // RootMoves が存在しない為、別の関数とする。
+// st は MaxPly 個以上の要素を持つこと。Undo == false の時は pos が st を参照し続けるので、呼び出し側で確保しておく。
 template <bool Undo> // 局面を戻し、moves に PV を書き込むなら true。末端の局面に移動したいだけなら false
-bool extractPVFromTT(Position& pos, Move* moves, const Move /*bestMove*/) {
-    StateInfo state[MaxPly+7];
-    StateInfo* st = state;
+bool extractPVFromTT(Position& pos, Move* moves, const Move /*bestMove*/, StateInfo* st) {
     TTEntry* tte;
     Ply ply = 0;
     Move m;
@@ -275,7 +291,7 @@ bool extractPVFromTT(Position& pos, Move* moves, const Move /*bestMove*/) {
 }
 
 template <bool Undo>
-bool qsearch(Position& pos, const u16 bestMove16) {
+bool qsearch(Position& pos, const u16 bestMove16, StateInfo* states) {
     //static std::atomic<int> i;
     //StateInfo st;
     Move pv[MaxPly+1];
@@ -296,7 +312,7 @@ bool qsearch(Position& pos, const u16 bestMove16) {
         pos.searcher()->qsearch<PV, false>(pos, ss, -ScoreInfinite, ScoreInfinite, Depth0);
     const Move bestMove = move16toMove(Move(bestMove16), pos);
     // pv 取得
-    return extractPVFromTT<Undo>(pos, moves, bestMove);
+    return extractPVFromTT<Undo>(pos, moves, bestMove, states);
 }
 
 #if defined USE_GLOBAL
@@ -533,6 +549,35 @@ namespace {
     using LowerDimensionedEvaluatorGradient = EvaluatorBase<std::array<std::atomic<float>, 2>>;
     using EvalBaseType = EvaluatorBase<std::array<float, 2>>;
 
+    // Evaluator::KPP[ksq][i][j] に、対応する小数の評価値を round して整数に直したものを入れる。
+    void copyKPPToInteger(EvalBaseType& evalBase, const Square ksq, const EvalIndex i, const EvalIndex j) {
+        const int64_t index = evalBase.minKPPIndex(ksq, i, j);
+        if (index == std::numeric_limits<int64_t>::max())
+            return;
+        else if (index < 0) {
+            // 内容を負として扱う。
+            Evaluator::KPP[ksq][i][j][0] = -round((*evalBase.oneArrayKPP(-index))[0]);
+            Evaluator::KPP[ksq][i][j][1] =  round((*evalBase.oneArrayKPP(-index))[1]);
+        }
+        else {
+            Evaluator::KPP[ksq][i][j][0] =  round((*evalBase.oneArrayKPP( index))[0]);
+            Evaluator::KPP[ksq][i][j][1] =  round((*evalBase.oneArrayKPP( index))[1]);
+        }
+    }
+    void copyKKPToInteger(EvalBaseType& evalBase, const Square ksq0, const Square ksq1, const EvalIndex i) {
+        const int64_t index = evalBase.minKKPIndex(ksq0, ksq1, i);
+        if (index == std::numeric_limits<int64_t>::max())
+            return;
+        else if (index < 0) {
+            // 内容を負として扱う。
+            Evaluator::KKP[ksq0][ksq1][i][0] = -round((*evalBase.oneArrayKKP(-index))[0]);
+            Evaluator::KKP[ksq0][ksq1][i][1] =  round((*evalBase.oneArrayKKP(-index))[1]);
+        }
+        else {
+            Evaluator::KKP[ksq0][ksq1][i][0] =  round((*evalBase.oneArrayKKP( index))[0]);
+            Evaluator::KKP[ksq0][ksq1][i][1] =  round((*evalBase.oneArrayKKP( index))[1]);
+        }
+    }
     // 小数の評価値を round して整数に直す。
     void copyEvalToInteger(EvalBaseType& evalBase) {
 #if defined _OPENMP
@@ -544,20 +589,8 @@ namespace {
 #endif
             for (int ksq = SQ11; ksq < SquareNum; ++ksq) {
                 for (EvalIndex i = (EvalIndex)0; i < fe_end; ++i) {
-                    for (EvalIndex j = (EvalIndex)0; j < fe_end; ++j) {
-                        const int64_t index = evalBase.minKPPIndex((Square)ksq, i, j);
-                        if (index == std::numeric_limits<int64_t>::max())
-                            continue;
-                        else if (index < 0) {
-                            // 内容を負として扱う。
-                            Evaluator::KPP[ksq][i][j][0] = -round((*evalBase.oneArrayKPP(-index))[0]);
-                            Evaluator::KPP[ksq][i][j][1] =  round((*evalBase.oneArrayKPP(-index))[1]);
-                        }
-                        else {
-                            Evaluator::KPP[ksq][i][j][0] =  round((*evalBase.oneArrayKPP( index))[0]);
-                            Evaluator::KPP[ksq][i][j][1] =  round((*evalBase.oneArrayKPP( index))[1]);
-                        }
-                    }
+                    for (EvalIndex j = (EvalIndex)0; j < fe_end; ++j)
+                        copyKPPToInteger(evalBase, (Square)ksq, i, j);
                 }
             }
 #ifdef _OPENMP
@@ -565,20 +598,39 @@ namespace {
 #endif
             for (int ksq0 = SQ11; ksq0 < SquareNum; ++ksq0) {
                 for (Square ksq1 = SQ11; ksq1 < SquareNum; ++ksq1) {
-                    for (EvalIndex i = (EvalIndex)0; i < fe_end; ++i) {
-                        const int64_t index = evalBase.minKKPIndex((Square)ksq0, ksq1, i);
-                        if (index == std::numeric_limits<int64_t>::max())
-                            continue;
-                        else if (index < 0) {
-                            // 内容を負として扱う。
-                            Evaluator::KKP[ksq0][ksq1][i][0] = -round((*evalBase.oneArrayKKP(-index))[0]);
-                            Evaluator::KKP[ksq0][ksq1][i][1] =  round((*evalBase.oneArrayKKP(-index))[1]);
-                        }
-                        else {
-                            Evaluator::KKP[ksq0][ksq1][i][0] =  round((*evalBase.oneArrayKKP( index))[0]);
-                            Evaluator::KKP[ksq0][ksq1][i][1] =  round((*evalBase.oneArrayKKP( index))[1]);
-                        }
-                    }
+                    for (EvalIndex i = (EvalIndex)0; i < fe_end; ++i)
+                        copyKKPToInteger(evalBase, (Square)ksq0, ksq1, i);
+                }
+            }
+        }
+    }
+    // copyEvalToInteger() と同じ事を、blocks の要素を参照する整数の評価値だけに行う。
+    // 小数の評価値は blocks の要素しか変わっていないので、結果は copyEvalToInteger() と同じになる。
+    // 同じ整数の評価値を複数のスレッドから書かないよう、2駒を入れ替えた場合と比べてインデックスが若い方の要素からだけ書く。
+    void copyEvalToInteger(EvalBaseType& evalBase, const std::vector<size_t>& blocks) {
+        const size_t kppNum = evalBase.kpps_end_index();
+        const size_t elementNum = kppNum + evalBase.kkps_end_index();
+        const size_t FeEnd = fe_end;
+        const size_t SqNum = SquareNum;
+#if defined _OPENMP
+#pragma omp parallel for
+#endif
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            const size_t last = std::min(EvaluatorGradientTouchedBlocks::elementEnd(blocks[b]), elementNum);
+            for (size_t e = EvaluatorGradientTouchedBlocks::elementBegin(blocks[b]); e < last; ++e) {
+                if (e < kppNum) {
+                    const Square ksq = static_cast<Square>(e / (FeEnd * FeEnd));
+                    const EvalIndex i = static_cast<EvalIndex>(e / FeEnd % FeEnd);
+                    const EvalIndex j = static_cast<EvalIndex>(e % FeEnd);
+                    const int64_t index = evalBase.minKPPIndex(ksq, i, j);
+                    if (index == std::numeric_limits<int64_t>::max() || static_cast<size_t>(std::abs(index)) != e)
+                        continue;
+                    copyKPPToInteger(evalBase, ksq, i, j);
+                    copyKPPToInteger(evalBase, ksq, j, i);
+                }
+                else {
+                    const size_t k = e - kppNum;
+                    copyKKPToInteger(evalBase, static_cast<Square>(k / (SqNum * FeEnd)), static_cast<Square>(k / FeEnd % SqNum), static_cast<EvalIndex>(k % FeEnd));
                 }
             }
         }
@@ -712,97 +764,206 @@ namespace {
         }
     }
 
-    constexpr s64 NodesPerIteration = 30000000; // 1回評価値を更新するのに使う教師局面数
-
-    // 別スレッドで読み込む教師データを読み込む為のstruct。
-    // ファイルの終端では、buffer の途中までしか値を入れる事が出来ないので、
-    // データがどこまで有効かはこの構造体の外で管理しておく必要がある。
-    struct TeacherBuffer {
-        enum State : int8_t {
-            WaitFilling, Filling, WaitUsing, Using
-        };
-        std::vector<HuffmanCodedPosAndEval> buffer;
-        std::atomic<State> state;
-
-        void init() {
-            buffer.assign(NodesPerIteration, HuffmanCodedPosAndEval());
-            state = WaitFilling;
+    // updateEval() と同じ事を、blocks の要素だけに行う。
+    // 勾配が 0 の要素は更新しても変わらないので、blocks が勾配が 0 で無い要素を全て含んでいれば、結果は updateEval() と同じになる。
+    void updateEval(EvalBaseType& evalBase,
+                    EvaluatorGradient& evaluatorGradient,
+                    EvaluatorGradient& meanSquareOfEvaluatorGradient,
+                    const std::vector<size_t>& blocks)
+    {
+        const size_t kppNum = evalBase.kpps_end_index();
+        const size_t elementNum = kppNum + evalBase.kkps_end_index();
+#if defined _OPENMP
+#pragma omp parallel for
+#endif
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            const size_t last = std::min(EvaluatorGradientTouchedBlocks::elementEnd(blocks[b]), elementNum);
+            for (size_t e = EvaluatorGradientTouchedBlocks::elementBegin(blocks[b]); e < last; ++e) {
+                if (e < kppNum)
+                    updateFV(*evalBase.oneArrayKPP(e), *evaluatorGradient.oneArrayKPP(e), *meanSquareOfEvaluatorGradient.oneArrayKPP(e));
+                else
+                    updateFV(*evalBase.oneArrayKKP(e - kppNum), *evaluatorGradient.oneArrayKKP(e - kppNum), *meanSquareOfEvaluatorGradient.oneArrayKKP(e - kppNum));
+            }
         }
-    };
-
-    // 教師データ読み込みの待ち時間を無くす為、２つのバッファを切り替えて使う。
-    struct TeacherBuffers {
-        TeacherBuffer teacherBuffers[2];
-        std::atomic<int> index;
-
-        void init() {
-            for (auto& elem : teacherBuffers)
-                elem.init();
-            index = 0;
+    }
+    // blocks の要素の勾配を 0 にする。
+    void clearGradient(EvaluatorGradient& evaluatorGradient, const std::vector<size_t>& blocks) {
+        const size_t kppNum = evaluatorGradient.kpps_end_index();
+        const size_t elementNum = kppNum + evaluatorGradient.kkps_end_index();
+#if defined _OPENMP
+#pragma omp parallel for
+#endif
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            const size_t last = std::min(EvaluatorGradientTouchedBlocks::elementEnd(blocks[b]), elementNum);
+            for (size_t e = EvaluatorGradientTouchedBlocks::elementBegin(blocks[b]); e < last; ++e) {
+                auto& elem = (e < kppNum ? *evaluatorGradient.oneArrayKPP(e) : *evaluatorGradient.oneArrayKKP(e - kppNum));
+                for (auto& v : elem)
+                    v = 0.0f;
+            }
         }
-        TeacherBuffer& currentBuffer() { return teacherBuffers[index]; }
-        void setAnotherBuffer() { index = index ^ 1; }
-    };
+    }
 
-    // 複数のファイルを扱う std::ifstream のようなもの。
-    // 関数は必要なものだけを作った。
-    struct TeacherFilesStream {
-        std::vector<std::string> fileNames;
-        size_t fileIndex;
-        size_t currentFileSize;
-        bool eof_;
-        std::ifstream ifs;
-
-        explicit TeacherFilesStream(const std::vector<std::string>& f) : fileNames(f), fileIndex(), eof_() {
-            for (; fileIndex < fileNames.size(); ++fileIndex) {
-                const auto& file = fileNames[fileIndex];
-                ifs.open(file.c_str(), std::ios::binary);
-                if (ifs.is_open()) {
-                    currentFileSize = static_cast<size_t>(ifs.seekg(0, std::ios::end).tellg());
-                    ifs.seekg(0, std::ios::beg);     // ストリームのポインタを一番前に戻して、これから先で使いやすいようにする
+    // 教師データのファイルを別スレッドで先読みし、学習のスレッドに渡す。
+    // 先読みは一定の局面数の chunk 単位で行い、chunk を chunkNum 個持つリングバッファに入れる。
+    // 使うメモリは chunk の大きさと数だけで決まり、1回の評価値の更新に使う局面数には依らない。
+    // 読み込みも受け渡しも待つ時は ConditionVariable で待つので、sleep して状態を見に行く事は無い。
+    class TeacherStream {
+    public:
+        TeacherStream(const std::vector<std::string>& fileNames, const size_t chunkSize, const size_t chunkNum)
+            : fileNames_(fileNames), chunks_(chunkNum), chunkSizes_(chunkNum, 0),
+              head_(0), offset_(0), filledNum_(0), eof_(false), failed_(false), exit_(false)
+        {
+            for (auto& chunk : chunks_)
+                chunk.resize(chunkSize);
+            readThread_ = std::thread([this] { readLoop(); });
+        }
+        ~TeacherStream() {
+            {
+                std::unique_lock<Mutex> lock(mutex_);
+                exit_ = true;
+            }
+            freed_.notify_one();
+            readThread_.join();
+        }
+        // 全てのファイルの局面数の合計。
+        static s64 positionNum(const std::vector<std::string>& fileNames) {
+            s64 sum = 0;
+            for (const auto& fileName : fileNames) {
+                std::ifstream ifs(fileName.c_str(), std::ios::binary | std::ios::ate);
+                if (ifs)
+                    sum += static_cast<s64>(ifs.tellg()) / static_cast<s64>(sizeof(HuffmanCodedPosAndEval));
+            }
+            return sum;
+        }
+        // 次の num 局面を dst にコピーする。先読みが間に合っていなければ待つ。
+        // 全てのファイルを読み終えて局面が足りない時だけ、num 未満の局面数を返す。
+        size_t pop(HuffmanCodedPosAndEval* dst, const size_t num) {
+            std::unique_lock<Mutex> lock(mutex_);
+            size_t popped = 0;
+            while (popped < num) {
+                filled_.wait(lock, [&] { return filledNum_ != 0 || eof_; });
+                if (filledNum_ == 0)
                     break;
+                const std::vector<HuffmanCodedPosAndEval>& chunk = chunks_[head_];
+                const size_t n = std::min(num - popped, chunkSizes_[head_] - offset_);
+                std::copy(std::begin(chunk) + offset_, std::begin(chunk) + offset_ + n, dst + popped);
+                popped += n;
+                offset_ += n;
+                if (offset_ == chunkSizes_[head_]) {
+                    offset_ = 0;
+                    head_ = (head_ + 1) % chunks_.size();
+                    --filledNum_;
+                    freed_.notify_one();
                 }
             }
+            return popped;
         }
-        explicit operator bool() const {
-            return fileIndex < fileNames.size();
+        // 読み込みに失敗して、途中で読むのを止めたか。pop() が局面を返さなくなった後に調べる。
+        bool failed() {
+            std::unique_lock<Mutex> lock(mutex_);
+            return failed_;
         }
-        // ファイルサイズを直接取得する関数は ifstream には無いが、
-        // ここでは全てのファイルの合計のサイズを返す事にする。
-        size_t fileSize() const {
-            size_t sum = 0;
-            for (size_t i = 0; i < fileNames.size(); ++i) {
-                std::ifstream tmp_ifs(fileNames[i].c_str(), std::ios::binary);
-                const size_t fs = static_cast<size_t>(tmp_ifs.seekg(0, std::ios::end).tellg());
-                sum += fs;
+
+    private:
+        void readLoop() {
+            for (const auto& fileName : fileNames_) {
+                if (!readFile(fileName))
+                    break;
             }
-            return sum;
+            std::unique_lock<Mutex> lock(mutex_);
+            eof_ = true;
+            filled_.notify_all();
         }
-        // ファイルの末端に到達したら、続きで次のファイルを読み込む。
-        void read(char* buf, const size_t size) {
-            size_t sum = 0;
-            for (; fileIndex < fileNames.size();) {
-                const int64_t before = ifs.tellg();
-                ifs.read(buf + sum, size - sum);
-                const int64_t after = ifs.tellg();
-                if (after == -1)
-                    sum += currentFileSize - before;
-                else
-                    sum += after - before;
-                if (sum == size)
+        // ファイルを chunk の大きさずつ読み、空いている chunk に入れる。ファイルの末端の chunk は chunk の大きさより少ない局面数になる。
+        // 学習が先に終わって読み込みを止める時と、読み込みに失敗した時は false を返す。
+        bool readFile(const std::string& fileName) {
+#if defined _WIN32
+            std::ifstream ifs(fileName.c_str(), std::ios::binary);
+            const bool opened = static_cast<bool>(ifs);
+#else
+            const int fd = open(fileName.c_str(), O_RDONLY);
+            const bool opened = (fd != -1);
+#endif
+            if (!opened) {
+                std::cerr << "Error: cannot open " << fileName << std::endl;
+                return true;
+            }
+            bool cont = true;
+            for (u64 offset = 0; ; ) {
+                size_t index;
+                {
+                    std::unique_lock<Mutex> lock(mutex_);
+                    freed_.wait(lock, [&] { return filledNum_ < chunks_.size() || exit_; });
+                    if (exit_) {
+                        cont = false;
+                        break;
+                    }
+                    index = (head_ + filledNum_) % chunks_.size();
+                }
+                // 空いている chunk は学習のスレッドからは触られないので、ロックを取らずに読み込む。
+                char* const dst = reinterpret_cast<char*>(chunks_[index].data());
+                const size_t bytes = chunks_[index].size() * sizeof(HuffmanCodedPosAndEval);
+                size_t done = 0;
+                int error = 0; // 読み込みに失敗した時の errno
+#if defined _WIN32
+                ifs.read(dst, bytes);
+                done = static_cast<size_t>(ifs.gcount());
+                if (ifs.bad())
+                    error = (errno != 0 ? errno : EIO);
+#else
+                while (done < bytes) {
+                    const ssize_t r = pread(fd, dst + done, bytes - done, offset + done);
+                    if (r < 0 && errno == EINTR) // シグナルで中断されただけなので読み直す。
+                        continue;
+                    if (r < 0)
+                        error = errno;
+                    if (r <= 0)
+                        break;
+                    done += r;
+                }
+#endif
+                if (error != 0) {
+                    // 途中の局面を飛ばして学習を続けないよう、読み込みを止めて学習のスレッドに知らせる。
+                    std::cerr << "Error: cannot read " << fileName << " at " << offset + done << ": " << strerror(error) << std::endl;
+                    std::unique_lock<Mutex> lock(mutex_);
+                    failed_ = true;
+                    cont = false;
                     break;
-                if (ifs.eof()) {
-                    ifs.close();
-                    ifs.open(fileNames[++fileIndex].c_str(), std::ios::binary);
-                    currentFileSize = static_cast<size_t>(ifs.seekg(0, std::ios::end).tellg());
-                    ifs.seekg(0, std::ios::beg);     // ストリームのポインタを一番前に戻して、これから先で使いやすいようにする
                 }
+                offset += done;
+                const size_t size = done / sizeof(HuffmanCodedPosAndEval); // 末端の不完全な局面は捨てる。
+                if (size != 0) {
+                    std::unique_lock<Mutex> lock(mutex_);
+                    chunkSizes_[index] = size;
+                    ++filledNum_;
+                    filled_.notify_all();
+                }
+                if (done != bytes)
+                    break;
             }
-            if (sum != size)
-                eof_ = true;
+#if !defined _WIN32
+            close(fd);
+#endif
+            return cont;
         }
-        bool eof() const { return eof_; }
+
+        std::vector<std::string> fileNames_;
+        std::vector<std::vector<HuffmanCodedPosAndEval> > chunks_;
+        std::vector<size_t> chunkSizes_;
+        size_t head_; // 学習のスレッドが次に使う chunk
+        size_t offset_; // head_ の chunk の中で次に使う局面
+        size_t filledNum_; // head_ から数えて、読み込みの終わった chunk の数
+        bool eof_;
+        bool failed_;
+        bool exit_;
+        Mutex mutex_;
+        ConditionVariable filled_;
+        ConditionVariable freed_;
+        std::thread readThread_;
     };
+
+    // 学習のスレッドが TeacherStream から一度に取り出す局面数。TeacherStream のロックを取る回数を減らす為にまとめて取り出す。
+    constexpr size_t TeacherClaimSize = 256;
 }
 
 void use_teacher(Position& pos, std::istringstream& ssCmd) {
@@ -837,77 +998,85 @@ void use_teacher(Position& pos, std::istringstream& ssCmd) {
     }
     if (teacherFileName == "-") // "-" なら棋譜ファイルを読み込まない。
         exit(EXIT_FAILURE);
-    TeacherFilesStream ifs(teacherFileNames);
-    if (!ifs)
+    const s64 MaxNodes = TeacherStream::positionNum(teacherFileNames);
+    if (MaxNodes == 0)
         exit(EXIT_FAILURE);
-
-    TeacherBuffers teacherBuffers;
-    teacherBuffers.init();
-
-    auto readFunc = [&ifs, &teacherBuffers] {
-        while (true) {
-            if (ifs.eof()) // ファイルを全部読み終えたら終了。
-                break;
-            for (auto& elem : teacherBuffers.teacherBuffers) {
-                if (elem.state == TeacherBuffer::WaitFilling) {
-                    elem.state = TeacherBuffer::Filling;
-                    ifs.read((char*)elem.buffer.data(), elem.buffer.size() * sizeof(elem.buffer[0]));
-                    // ファイル末端まで読み込んで不完全な場合でも state は更新する。
-                    elem.state = TeacherBuffer::WaitUsing;
-                }
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(500)); // 適当な時間だけ待ってからループ
-        }
-    };
-
-    auto func = [&teacherBuffers](Position& pos, EvaluatorGradient& evaluatorGradient, double& /*loss*/, std::atomic<s64>& nodes, const s64 iteration, const s64 MaxNodes) {
-        SearchStack ss[2];
-        HuffmanCodedPosAndEval hcpe;
+    const s64 batchSize = pos.searcher()->options["Learn_Batch_Size"];
+    TeacherStream stream(teacherFileNames, pos.searcher()->options["Learn_Read_Chunk_Size"], pos.searcher()->options["Learn_Read_Ahead_Chunks"]);
+
+    // 勾配はスレッド毎に EvaluatorGradientBuffer に溜めてから、イテレーションの最後にまとめて EvaluatorGradient に足し込む。
+    // 勾配を足し込んだ要素は EvaluatorGradientTouchedBlocks に印を付けておき、パラメータの更新はその要素だけに行う。
+    EvaluatorGradientLocks evaluatorGradientLocks;
+    EvaluatorGradientTouchedBlocks touchedBlocks;
+    // バッファのハッシュテーブルは 1 イテレーションで 1 スレッドが扱う局面数に合わせた大きさにする。
+    const int gradientTableShift = EvaluatorGradientBuffer::tableShiftFor((batchSize + threadNum - 1) / threadNum);
+    std::vector<std::unique_ptr<EvaluatorGradientBuffer> > gradientBuffers;
+    for (int i = 0; i < threadNum; ++i)
+        gradientBuffers.emplace_back(new EvaluatorGradientBuffer(*evaluatorGradient, evaluatorGradientLocks, EvaluatorGradientLocks::Num * i / threadNum,
+                                                                 &touchedBlocks, gradientTableShift));
+    auto func = [&stream, batchSize](Position& pos, EvaluatorGradientBuffer& gradientBuffer, double& /*loss*/, std::atomic<s64>& nodes) {
+        // 末端の局面を EvalBatchSize 個溜めてから evaluateBatch() でまとめて評価する。
+        // 末端の局面はそこまでの StateInfo を参照するので、局面毎に StateInfo の領域を持っておく。
+        std::vector<Position> leaves(EvalBatchSize, pos);
+        std::vector<std::array<StateInfo, MaxPly+7>> states(EvalBatchSize);
+        HuffmanCodedPosAndEval hcpes[EvalBatchSize];
+        Color rootColors[EvalBatchSize];
+        const Position* leafPtrs[EvalBatchSize];
+        Score evals[EvalBatchSize];
+        std::vector<HuffmanCodedPosAndEval> claimed(TeacherClaimSize); // stream から取り出した局面
+        size_t claimedIndex = 0;
+        size_t claimedNum = 0;
         pos.searcher()->tt.clear();
-        while (true) {
-            {
-                // std::atomic<Integer>::operator++(int) (後置インクリメント)は std::atomic<Integer>::fetch_add(11) なので、
-                // nodes の読み込みと加算の間に別のスレッドからの読み込みが挟まって、複数のスレッドが同じ値を読み込む心配は無い。
-                const s64 current_node = nodes++;
-                if (NodesPerIteration <= current_node || MaxNodes <= NodesPerIteration * iteration + current_node) {
-                    --nodes;
-                    return;
+        bool finished = false;
+        while (!finished) {
+            size_t n = 0;
+            while (n < EvalBatchSize) {
+                if (claimedIndex == claimedNum) {
+                    // 今回のイテレーションで使う局面数を超えないよう、nodes で局面数を確保してから stream から取り出す。
+                    // fetch_add() なので、複数のスレッドが同じ範囲を確保する心配は無い。使わなかった分は後で戻す。
+                    const s64 begin = nodes.fetch_add(TeacherClaimSize);
+                    const size_t take = static_cast<size_t>(std::max<s64>(0, std::min<s64>(TeacherClaimSize, batchSize - begin)));
+                    claimedNum = (take == 0 ? 0 : stream.pop(claimed.data(), take));
+                    claimedIndex = 0;
+                    nodes -= TeacherClaimSize - claimedNum;
+                    if (claimedNum == 0) {
+                        finished = true;
+                        break;
+                    }
                 }
-                hcpe = teacherBuffers.currentBuffer().buffer[current_node];
+                hcpes[n] = claimed[claimedIndex++];
+                Position& leaf = leaves[n];
+                setPosition(leaf, hcpes[n].hcp);
+                rootColors[n] = leaf.turn();
+                leaf.searcher()->alpha = -ScoreMaxEvaluate;
+                leaf.searcher()->beta  =  ScoreMaxEvaluate;
+                if (!qsearch<false>(leaf, hcpes[n].bestMove16, states[n].data())) // 末端の局面に移動する。
+                    continue;
+                leafPtrs[n++] = &leaf;
+            }
+            // evaluateBatch() は手番側から見た点数を返すので、eval は rootColor から見た点数に直す。
+            evaluateBatch(leafPtrs, n, evals);
+            for (size_t b = 0; b < n; ++b) {
+                const Position& leaf = leaves[b];
+                const Color rootColor = rootColors[b];
+                const Score eval = (rootColor == leaf.turn() ? evals[b] : -evals[b]);
+                const Score teacherEval = static_cast<Score>(hcpes[b].eval); // root から見た評価値が入っている。
+                const Color leafColor = leaf.turn(); // leaf は末端の局面になっている。
+                // 目的関数をelmoと同様に変更。
+                const double evalWinRate = sigmoidWinningRate(eval);
+                const double teacherEvalWinRate = sigmoidWinningRate(teacherEval);
+                const double t = (hcpes[b].gameResult == BlackWin ? (rootColor == Black ? 1.0 : 0.0) :
+                                  hcpes[b].gameResult == WhiteWin ? (rootColor == White ? 1.0 : 0.0) :
+                                  /*hcpes[b].gameResult == Draw ?*/ 0.5);
+                const double L = 1.0 / 3; // elmo と同様の配分
+                const double dsig = (1.0 - L) * (evalWinRate - t) + L * (evalWinRate - teacherEvalWinRate);
+                //const double tmp = -1 * (hcpes[b].gameResult == BlackWin ? (rootColor == Black ? log(evalWinRate) : log(1.0 - evalWinRate)) :
+                //                         hcpes[b].gameResult == WhiteWin ? (rootColor == White ? log(evalWinRate) : log(1.0 - evalWinRate)) :
+                //                         log(fabs(0.5 - evalWinRate))) + L * (-teacherEvalWinRate*log(evalWinRate) - (1 - teacherEvalWinRate) * log(1 - evalWinRate));
+                //loss += tmp;
+                std::array<float, 2> dT = {{(float)(rootColor == Black ? -dsig : dsig), (float)(rootColor == leafColor ? -dsig : dsig)}};
+                gradientBuffer.incParam(leaf, dT);
             }
-            auto setpos = [](HuffmanCodedPosAndEval& hcpe, Position& pos) {
-                setPosition(pos, hcpe.hcp);
-            };
-            setpos(hcpe, pos);
-            const Color rootColor = pos.turn();
-            pos.searcher()->alpha = -ScoreMaxEvaluate;
-            pos.searcher()->beta  =  ScoreMaxEvaluate;
-            if (!qsearch<false>(pos, hcpe.bestMove16)) // 末端の局面に移動する。
-                continue;
-            // pv を辿って評価値を返す。pos は pv を辿る為に状態が変わる。
-            auto pvEval = [&ss, &rootColor](Position& pos) {
-                ss[0].staticEvalRaw.p[0][0] = ss[1].staticEvalRaw.p[0][0] = ScoreNotEvaluated;
-                // evaluate() は手番側から見た点数なので、eval は rootColor から見た点数。
-                const Score eval = (rootColor == pos.turn() ? evaluate(pos, ss+1) : -evaluate(pos, ss+1));
-                return eval;
-            };
-            const Score eval = pvEval(pos);
-            const Score teacherEval = static_cast<Score>(hcpe.eval); // root から見た評価値が入っている。
-            const Color leafColor = pos.turn(); // pos は末端の局面になっている。
-            // 目的関数をelmoと同様に変更。
-            const double evalWinRate = sigmoidWinningRate(eval);
-            const double teacherEvalWinRate = sigmoidWinningRate(teacherEval);
-            const double t = (hcpe.gameResult == BlackWin ? (rootColor == Black ? 1.0 : 0.0) :
-                              hcpe.gameResult == WhiteWin ? (rootColor == White ? 1.0 : 0.0) :
-                              /*hcpe.gameResult == Draw ?*/ 0.5);
-            const double L = 1.0 / 3; // elmo と同様の配分
-            const double dsig = (1.0 - L) * (evalWinRate - t) + L * (evalWinRate - teacherEvalWinRate);
-            //const double tmp = -1 * (hcpe.gameResult == BlackWin ? (rootColor == Black ? log(evalWinRate) : log(1.0 - evalWinRate)) :
-            //                         hcpe.gameResult == WhiteWin ? (rootColor == White ? log(evalWinRate) : log(1.0 - evalWinRate)) :
-            //                         log(fabs(0.5 - evalWinRate))) + L * (-teacherEvalWinRate*log(evalWinRate) - (1 - teacherEvalWinRate) * log(1 - evalWinRate));
-            //loss += tmp;
-            std::array<float, 2> dT = {{(float)(rootColor == Black ? -dsig : dsig), (float)(rootColor == leafColor ? -dsig : dsig)}};
-            evaluatorGradient.incParam(pos, dT);
         }
     };
 
@@ -920,9 +1089,8 @@ void use_teacher(Position& pos, std::istringstream& ssCmd) {
     //Evaluator::init(pos.searcher()->options["Eval_Dir"]);
     copyEvalToDecimal(*evalBase); // 小数に直してコピー。
     //memcpy(averagedEvalBase.get(), evalBase.get(), sizeof(EvalBaseType));
-    const size_t fileSize = ifs.fileSize();
-    const s64 MaxNodes = fileSize / sizeof(HuffmanCodedPosAndEval);
     std::atomic<s64> nodes(0); // 今回のイテレーションで読み込んだ学習局面数。
+    s64 learnedNodes = 0; // 前回のイテレーションまでに読み込んだ学習局面数。
     //auto writeEval = [&] {
     //    // ファイル保存
     //    //copyEval(*eval, *averagedEvalBase); // 平均化した物を整数の評価値にコピー
@@ -938,36 +1106,42 @@ void use_teacher(Position& pos, std::istringstream& ssCmd) {
         std::ofstream((Evaluator::addSlashIfNone(pos.searcher()->options["Eval_Dir"]) + "KKP.bin").c_str(), std::ios::binary).write((char*)Evaluator::KKP, sizeof(KKPEvalElementType2));
         std::cout << "done" << std::endl;
     };
-    auto readThread = std::thread([&readFunc, &ifs, &teacherBuffers] { readFunc(); });
+    // 勾配を全て 0 にするのは最初だけで、以降は更新した要素だけを 0 に戻す。
+    evaluatorGradient->clear();
+    std::mt19937_64 saltRandom(std::chrono::system_clock::now().time_since_epoch().count());
     Timer t;
     // 教師データ全てから学習した時点で終了する。
-    for (s64 iteration = 0; NodesPerIteration * iteration + nodes < MaxNodes; ++iteration, teacherBuffers.setAnotherBuffer()) {
+    for (s64 iteration = 0; learnedNodes < MaxNodes; ++iteration) {
         t.restart();
         nodes = 0;
-        std::cout << "iteration: " << iteration << ", nodes: " << NodesPerIteration * iteration + nodes << "/" << MaxNodes
-                  << " (" << std::fixed << std::setprecision(2) << static_cast<double>(NodesPerIteration * iteration + nodes) * 100 / MaxNodes << "%)" << std::endl;
+        std::cout << "iteration: " << iteration << ", nodes: " << learnedNodes << "/" << MaxNodes
+                  << " (" << std::fixed << std::setprecision(2) << static_cast<double>(learnedNodes) * 100 / MaxNodes << "%)" << std::endl;
         std::vector<std::thread> threads(threadNum);
         std::vector<double> losses(threadNum, 0.0);
 
-        // データが使用可能になるまで待つ。
-        // ファイル末端で 1 iteration 分のデータが無くても、TeacherBuffer::WaitUsing になるので、これで問題無い。
-        while (teacherBuffers.currentBuffer().state != TeacherBuffer::WaitUsing)
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
-
-        evaluatorGradient->clear();
         for (int i = 0; i < threadNum; ++i)
-            threads[i] = std::thread([&positions, i, &func, &evaluatorGradient, &losses, &nodes, &iteration, &MaxNodes] { func(positions[i], *evaluatorGradient, losses[i], nodes, iteration, MaxNodes); });
+            threads[i] = std::thread([&positions, i, &func, &gradientBuffers, &losses, &nodes] { func(positions[i], *gradientBuffers[i], losses[i], nodes); });
         for (int i = 0; i < threadNum; ++i)
             threads[i].join();
-        teacherBuffers.currentBuffer().state = TeacherBuffer::WaitFilling;
-        if (nodes < NodesPerIteration)
+        EvaluatorGradientBuffer::mergeAll(gradientBuffers);
+        if (stream.failed()) {
+            std::cerr << "Error: stopped learning because the teacher files could not be read." << std::endl;
+            break; // 読めなかった局面を飛ばしたイテレーションでは、パラメータ更新しない。
+        }
+        learnedNodes += nodes;
+        if (nodes < batchSize)
             break; // パラメータ更新するにはデータが足りなかったので、パラメータ更新せずに終了する。
 
-        evaluatorGradient->sumMirror();
-        updateEval(*evalBase, *evaluatorGradient, *meanSquareOfEvaluatorGradient);
+        evaluatorGradient->sumMirror(touchedBlocks);
+        const std::vector<size_t> blocks = touchedBlocks.blocks();
+        updateEval(*evalBase, *evaluatorGradient, *meanSquareOfEvaluatorGradient, blocks);
         //averageEval(*averagedEvalBase, *evalBase); // 平均化する。
-        copyEvalToInteger(*evalBase); // 整数の評価値にコピー
-        g_evalTable.clear(); // 評価関数のハッシュテーブルも更新しないと、これまで探索した評価値と矛盾が生じる。
+        copyEvalToInteger(*evalBase, blocks); // 整数の評価値にコピー
+        // 評価関数のハッシュテーブルも更新しないと、これまで探索した評価値と矛盾が生じる。
+        // テーブルを消す代わりに salt を変えて、更新前の評価値を使わないようにする。
+        g_evalHashSalt = saltRandom() >> 1;
+        clearGradient(*evaluatorGradient, blocks);
+        touchedBlocks.clear(blocks);
         if (iteration != 0 && iteration % 1000 == 0) {
             //writeEval();
             writeSyn();
@@ -976,7 +1150,6 @@ void use_teacher(Position& pos, std::istringstream& ssCmd) {
         std::cout << "loss: " << std::accumulate(std::begin(losses), std::end(losses), 0.0) << std::endl;
         printEvalTable(SQ88, f_gold + SQ78, f_gold, false);
     }
-    readThread.join();
     //writeEval();
     writeSyn();
 }
@@ -1022,38 +1195,39 @@ void check_teacher(std::istringstream& ssCmd) {
 }
 #endif
 
-Move usiToMoveBody(const Position& pos, const std::string& moveStr) {
+// [first, last) の USI 形式の指し手を読む。文字列のコピーは作らない。
+Move usiToMoveBody(const Position& pos, const char* first, const char* last) {
+    const std::ptrdiff_t size = last - first;
+    if (size != 4 && size != 5)
+        return Move::moveNone();
     Move move;
-    if (g_charToPieceUSI.isLegalChar(moveStr[0])) {
+    if (g_charToPieceUSI.isLegalChar(first[0])) {
         // drop
-        const PieceType ptTo = pieceToPieceType(g_charToPieceUSI.value(moveStr[0]));
-        if (moveStr[1] != '*')
+        const PieceType ptTo = pieceToPieceType(g_charToPieceUSI.value(first[0]));
+        if (first[1] != '*' || size != 4)
             return Move::moveNone();
-        const File toFile = charUSIToFile(moveStr[2]);
-        const Rank toRank = charUSIToRank(moveStr[3]);
+        const File toFile = charUSIToFile(first[2]);
+        const Rank toRank = charUSIToRank(first[3]);
         if (!isInSquare(toFile, toRank))
             return Move::moveNone();
         const Square to = makeSquare(toFile, toRank);
         move = makeDropMove(ptTo, to);
     }
     else {
-        const File fromFile = charUSIToFile(moveStr[0]);
-        const Rank fromRank = charUSIToRank(moveStr[1]);
+        const File fromFile = charUSIToFile(first[0]);
+        const Rank fromRank = charUSIToRank(first[1]);
         if (!isInSquare(fromFile, fromRank))
             return Move::moveNone();
         const Square from = makeSquare(fromFile, fromRank);
-        const File toFile = charUSIToFile(moveStr[2]);
-        const Rank toRank = charUSIToRank(moveStr[3]);
+        const File toFile = charUSIToFile(first[2]);
+        const Rank toRank = charUSIToRank(first[3]);
         if (!isInSquare(toFile, toRank))
             return Move::moveNone();
         const Square to = makeSquare(toFile, toRank);
-        if (moveStr[4] == '\0')
+        if (size == 4)
             move = makeNonPromoteMove<Capture>(pieceToPieceType(pos.piece(from)), from, to, pos);
-        else if (moveStr[4] == '+') {
-            if (moveStr[5] != '\0')
-                return Move::moveNone();
+        else if (first[4] == '+')
             move = makePromoteMove<Capture>(pieceToPieceType(pos.piece(from)), from, to, pos);
-        }
         else
             return Move::moveNone();
     }
@@ -1082,11 +1256,14 @@ Move csaToMoveDebug(const Position& pos, const std::string& moveStr) {
     return Move::moveNone();
 }
 #endif
-Move usiToMove(const Position& pos, const std::string& moveStr) {
-    const Move move = usiToMoveBody(pos, moveStr);
-    assert(move == usiToMoveDebug(pos, moveStr));
+Move usiToMove(const Position& pos, const char* first, const char* last) {
+    const Move move = usiToMoveBody(pos, first, last);
+    assert(move == usiToMoveDebug(pos, std::string(first, last)));
     return move;
 }
+Move usiToMove(const Position& pos, const std::string& moveStr) {
+    return usiToMove(pos, moveStr.data(), moveStr.data() + moveStr.size());
+}
 
 Move csaToMoveBody(const Position& pos, const std::string& moveStr) {
     if (moveStr.size() != 6)
@@ -1135,34 +1312,59 @@ Move csaToMove(const Position& pos, const std::string& moveStr) {
 }
 
 void setPosition(Position& pos, std::istringstream& ssCmd) {
-    std::string token;
-    std::string sfen;
+    // 長い棋譜でも指し手毎に文字列を作らないよう、残りをまとめて取り出して読む。
+    std::string str;
+    std::getline(ssCmd, str);
+    setPosition(pos, str.data(), str.data() + str.size());
+}
 
-    ssCmd >> token;
+bool setPosition(Position& pos, const char* first, const char* last) {
+    auto isSpace = [](const char c) { return isspace(static_cast<unsigned char>(c)) != 0; };
+    const char* tokenFirst = first;
+    const char* tokenLast = first;
+    // 次の空白区切りの語を [tokenFirst, tokenLast) にする。無ければ false。
+    auto nextToken = [&] {
+        for (tokenFirst = tokenLast; tokenFirst != last && isSpace(*tokenFirst); ++tokenFirst) {}
+        for (tokenLast = tokenFirst; tokenLast != last && !isSpace(*tokenLast); ++tokenLast) {}
+        return tokenFirst != tokenLast;
+    };
+    auto tokenIs = [&](const char* str) {
+        const size_t size = strlen(str);
+        return static_cast<size_t>(tokenLast - tokenFirst) == size && std::equal(tokenFirst, tokenLast, str);
+    };
 
-    if (token == "startpos") {
-        sfen = DefaultStartPositionSFEN;
-        ssCmd >> token; // "moves" が入力されるはず。
+    bool isValid = true; // SFEN が不正なら、指し手は進めるが false を返す。
+    if (!nextToken())
+        return false;
+    if (tokenIs("startpos")) {
+        pos.set(DefaultStartPositionSFEN, pos.searcher()->threads.main());
+        nextToken(); // "moves" が入力されるはず。
     }
-    else if (token == "sfen") {
-        while (ssCmd >> token && token != "moves")
-            sfen += token + " ";
+    else if (tokenIs("sfen")) {
+        const char* sfenFirst = tokenLast;
+        const char* sfenLast = tokenLast;
+        while (nextToken() && !tokenIs("moves"))
+            sfenLast = tokenLast;
+        if (!pos.set(sfenFirst, sfenLast, pos.searcher()->threads.main())) {
+            std::cout << "incorrect SFEN string : " << std::string(sfenFirst, sfenLast) << std::endl;
+            isValid = false;
+        }
     }
     else
-        return;
+        return false;
 
-    pos.set(sfen, pos.searcher()->threads.main());
     pos.searcher()->states = StateListPtr(new std::deque<StateInfo>(1));
 
     Ply currentPly = pos.gamePly();
-    while (ssCmd >> token) {
-        const Move move = usiToMove(pos, token);
+    while (nextToken()) {
+        const Move move = usiToMove(pos, tokenFirst, tokenLast);
         if (!move) break;
         pos.searcher()->states->emplace_back();
         pos.doMove(move, pos.searcher()->states->back());
         ++currentPly;
     }
     pos.setStartPosPly(currentPly);
+    return isValid;
 }
 
 bool setPosition(Position& pos, const HuffmanCodedPos& hcp) {
@@ -1229,6 +1431,107 @@ void measureGenerateMoves(const Position& pos) {
         std::cout << legalMoves[i].move.toCSA() << ", ";
     std::cout << std::endl;
 }
+
+// 局面ファイルの全局面を evaluateBatch() でまとめて評価し、手番側から見た評価値を 1 行に 1 つずつ書き出す。
+// bulk_eval <sfen|hcp|hcpe> <input> <output>
+// sfen の場合は 1 行に position コマンドの引数 ("startpos moves ..." や "sfen ... moves ...") を 1 つ書く。
+// 局面として不正なものは "none" を書き出す。
+void bulkEval(Position& pos, std::istringstream& ssCmd) {
+    std::string format;
+    std::string inFileName;
+    std::string outFileName;
+    ssCmd >> format >> inFileName >> outFileName;
+    if (format != "sfen" && format != "hcp" && format != "hcpe") {
+        std::cerr << "Error: unknown format " << format << std::endl;
+        return;
+    }
+    std::ifstream ifs(inFileName.c_str(), std::ios::binary);
+    if (!ifs) {
+        std::cerr << "Error: cannot open " << inFileName << std::endl;
+        return;
+    }
+    std::ofstream ofs(outFileName.c_str());
+    if (!ofs) {
+        std::cerr << "Error: cannot open " << outFileName << std::endl;
+        return;
+    }
+
+    const size_t ChunkSize = EvalBatchSize * 1024; // これだけ読み込む毎にまとめて評価して書き出す。
+    std::vector<HuffmanCodedPos> hcps(ChunkSize);
+    std::vector<Score> scores(ChunkSize);
+    std::vector<Position> positions; // sfen の時だけ使う。
+    std::vector<bool> isValid;
+    std::vector<const Position*> ps;
+    s64 count = 0;
+    s64 invalidCount = 0; // 評価せずに飛ばした不正な局面の数。
+    const Timer t = Timer::currentTime();
+    while (true) {
+        size_t n = 0;
+        if (format == "sfen") {
+            Position tmp(pos);
+            std::string line;
+            positions.clear();
+            isValid.clear();
+            ps.clear();
+            while (n < ChunkSize && std::getline(ifs, line)) {
+                if (line.empty())
+                    continue;
+                tmp.set(DefaultStartPositionSFEN, pos.searcher()->threads.main());
+                // 盤面の整合性までは見ず、hcp と同じく駒の枚数が丁度 1 組分ある局面だけを評価する。
+                const bool valid = (setPosition(tmp, line.data(), line.data() + line.size()) && tmp.pieceNumIsOK(true));
+                isValid.push_back(valid);
+                if (valid)
+                    positions.push_back(tmp); // コピーした局面は自分の StateInfo を持つので、tmp を変更しても影響しない。
+                ++n;
+            }
+            for (auto& p : positions)
+                ps.push_back(&p);
+            std::vector<Score> batchScores(ps.size());
+            for (size_t begin = 0; begin < ps.size(); begin += EvalBatchSize)
+                evaluateBatch(&ps[begin], std::min(EvalBatchSize, ps.size() - begin), &batchScores[begin]);
+            for (size_t i = 0, j = 0; i < n; ++i)
+                scores[i] = (isValid[i] ? batchScores[j++] : ScoreNotEvaluated);
+        }
+        else {
+            const size_t recordSize = (format == "hcp" ? sizeof(HuffmanCodedPos) : sizeof(HuffmanCodedPosAndEval));
+            HuffmanCodedPosAndEval record;
+            while (n < ChunkSize && ifs.read(reinterpret_cast<char*>(&record), recordSize))
+                hcps[n++] = record.hcp; // hcp は先頭にあるので、どちらの形式でも同じように取り出せる。
+            evaluateBatch(pos, hcps.data(), n, scores.data());
+        }
+        if (n == 0)
+            break;
+        for (size_t i = 0; i < n; ++i) {
+            if (scores[i] == ScoreNotEvaluated) {
+                ofs << "none\n";
+                ++invalidCount;
+            }
+            else
+                ofs << static_cast<int>(scores[i]) << "\n";
+        }
+        count += n;
+    }
+    const int elapsed = t.elapsed();
+    std::cout << "positions = " << count << std::endl;
+    std::cout << "invalid positions = " << invalidCount << std::endl;
+    std::cout << "elapsed = " << elapsed << " [msec]" << std::endl;
+    if (elapsed != 0)
+        std::cout << "positions/s = " << count * 1000 / elapsed << " [positions/sec]" << std::endl;
+}
+
+namespace {
+    // ベンチマークは setPosition() で局面と searcher()->states を作り直すので、
+    // position コマンドで設定した対局中の局面を壊さないよう、別の Position と StateInfo の列で func を呼ぶ。
+    template <typename T>
+    void runOnBenchPosition(Position& pos, T func) {
+        StateListPtr states = std::move(pos.searcher()->states);
+        {
+            Position benchPos(DefaultStartPositionSFEN, pos.searcher()->threads.main(), pos.searcher()->thisptr);
+            func(benchPos);
+        }
+        pos.searcher()->states = std::move(states);
+    }
+}
 #endif
 
 void Searcher::doUSICommandLoop(int argc, char* argv[]) {
@@ -1269,11 +1572,38 @@ void Searcher::doUSICommandLoop(int argc, char* argv[]) {
         else if (token == "isready"  ) { // 対局開始前の準備。
             tt.clear();
             threads.main()->previousScore = ScoreInfinite;
+            bool evalIsReloaded = false;
             if (!evalTableIsRead) {
                 // 一時オブジェクトを生成して Evaluator::init() を呼んだ直後にオブジェクトを破棄する。
                 // 評価関数の次元下げをしたデータを格納する分のメモリが無駄な為、
-                Evaluator::init(options["Eval_Dir"]);
-                evalTableIsRead = true;
+                // 読み込みに失敗した時は評価関数は変わらないので、次の isready で読み込み直す。
+                if (Evaluator::init(options["Eval_Dir"])) {
+                    evalTableIsRead = true;
+                    evalIsReloaded = true; // 読み込み直したので複製も作り直す。古い複製は replicate() で解放する。
+                }
+                else
+                    SYNCCOUT << "info string Failed to read eval files in " << std::string(options["Eval_Dir"]) << SYNCENDL;
+            }
+            // 定跡は対局が始まる前に読み込んでおき、各手の探索開始時にファイルを読まないようにする。
+            if (options["OwnBook"] || options["Book_In_Search"])
+                book.open(options["Book_File"]);
+            if (options["Book_In_Search"]) {
+                const Ply maxPly = std::min<int>(options["Max_Book_Ply"], MaxPly);
+                const Depth depth = static_cast<Depth>(static_cast<int>(options["Book_In_Search_Depth"]) * OnePly);
+                const size_t num = bookHash.init(book, pos, maxPly, depth);
+                SYNCCOUT << "info string book positions in search " << num << SYNCENDL;
+            }
+            else
+                bookHash.clear();
+            const size_t replicaNum = (options["Eval_NUMA_Replication"] ? numaNodeNum() : 1);
+            if (evalIsReloaded || std::max<size_t>(Evaluator::replicas.size(), 1) != replicaNum || Evaluator::replicas.empty()) {
+                Evaluator::replicate(replicaNum);
+                threads.assignNumaNodes(thisptr);
+            }
+            if (options["Eval_NUMA_Replication"]) {
+                for (Thread* th : threads)
+                    SYNCCOUT << "info string thread " << th->idx << " numa node " << th->numaNode
+                             << " eval replica " << (th->evalTables.kpp == Evaluator::KPP ? 0 : th->numaNode) << SYNCENDL;
             }
             SYNCCOUT << "readyok" << SYNCENDL;
         }
@@ -1282,7 +1612,14 @@ void Searcher::doUSICommandLoop(int argc, char* argv[]) {
         else if (token == "write_eval") { // 対局で使う為の評価関数バイナリをファイルに書き出す。
             if (!evalTableIsRead)
                 Evaluator::init(options["Eval_Dir"]);
-            Evaluator::writeEvalFile(options["Eval_Dir"]);
+            if (!Evaluator::writeEvalFile(options["Eval_Dir"]))
+                std::cerr << "Error: failed to write the eval files." << std::endl;
+        }
+        else if (token == "write_eval_container") { // KPP.bin, KKP.bin をヘッダ付きの形式に変換して書き出す。
+            if (!evalTableIsRead)
+                Evaluator::init(options["Eval_Dir"]);
+            if (!Evaluator::writeEvalContainerFile(options["Eval_Dir"]))
+                std::cerr << "Error: failed to write the eval container file." << std::endl;
         }
 #if defined LEARN
         else if (token == "make_teacher") {
@@ -1311,7 +1648,50 @@ void Searcher::doUSICommandLoop(int argc, char* argv[]) {
                 Evaluator::init(options["Eval_Dir"]);
                 evalTableIsRead = true;
             }
-            benchmark(pos);
+            runOnBenchPosition(pos, [](Position& p) { benchmark(p); });
+        }
+        else if (token == "bench_eval") { // 評価関数の速度を計測し、SIMD を使う経路を検証する。
+            if (!evalTableIsRead) {
+                Evaluator::init(options["Eval_Dir"]);
+                evalTableIsRead = true;
+            }
+            runOnBenchPosition(pos, [&](Position& p) { benchmarkEval(p, ssCmd); });
+        }
+        else if (token == "bench_hcp") runOnBenchPosition(pos, [&](Position& p) { benchmarkHuffmanCodedPos(p, ssCmd); }); // HuffmanCodedPos の符号化、復号の速度を計測する。
+        else if (token == "bench_sfen") runOnBenchPosition(pos, [&](Position& p) { benchmarkSFEN(p, ssCmd); }); // SFEN と position コマンドの読み書きの速度を計測する。
+        else if (token == "bench_book") runOnBenchPosition(pos, [&](Position& p) { benchmarkBook(p, ssCmd); }); // 定跡の検索の速度を計測する。
+        else if (token == "bench_perft") runOnBenchPosition(pos, [&](Position& p) { benchmarkPerft(p, ssCmd); }); // 指し手生成の速度を perft で計測し、局面数を確認する。
+        else if (token == "bench_search") { // 固定の深さで探索し、探索局面数と速度を計測する。
+            if (!evalTableIsRead) {
+                Evaluator::init(options["Eval_Dir"]);
+                evalTableIsRead = true;
+            }
+            runOnBenchPosition(pos, [&](Position& p) { benchmarkSearch(p, ssCmd); });
+        }
+        else if (token == "bench_book_search") { // 定跡を探索中に使う時と使わない時の探索結果を比べる。
+            if (!evalTableIsRead) {
+                Evaluator::init(options["Eval_Dir"]);
+                evalTableIsRead = true;
+            }
+            runOnBenchPosition(pos, [&](Position& p) { benchmarkBookInSearch(p, ssCmd); });
+        }
+        else if (token == "bench_movegen") runOnBenchPosition(pos, [&](Position& p) { benchmarkMoveGeneration(p, ssCmd); }); // 合法手生成の速度を計測し、参照実装と比較する。
+        else if (token == "bench_checks") runOnBenchPosition(pos, [&](Position& p) { benchmarkQuietChecks(p, ssCmd); }); // 駒を取らない王手の生成の速度を計測し、参照実装と比較する。
+        else if (token == "bench_gradient") runOnBenchPosition(pos, [&](Position& p) { benchmarkGradient(p, ssCmd); }); // 学習の勾配の足し込みの速度をスレッド数毎に計測する。
+        else if (token == "bulk_eval") { // ファイル中の局面をまとめて評価する。
+            if (!evalTableIsRead) {
+                Evaluator::init(options["Eval_Dir"]);
+                evalTableIsRead = true;
+            }
+            runOnBenchPosition(pos, [&](Position& p) { bulkEval(p, ssCmd); });
+        }
+        else if (token == "eval_hash_stats") { // 評価値のハッシュテーブルのヒット率を表示してリセットする。
+            const s64 hits = threads.evalHashHits();
+            const s64 misses = threads.evalHashMisses();
+            SYNCCOUT << "info string eval hash mode " << std::string(options["Eval_Hash_Mode"])
+                     << " hits " << hits << " misses " << misses
+                     << " hit rate " << (hits + misses ? hits * 100.0 / (hits + misses) : 0.0) << "%" << SYNCENDL;
+            threads.resetEvalHashStats();
         }
         else if (token == "key"      ) SYNCCOUT << pos.getKey() << SYNCENDL;
         else if (token == "tosfen"   ) SYNCCOUT << pos.toSFEN() << SYNCENDL;
@@ -1320,6 +1700,21 @@ void Searcher::doUSICommandLoop(int argc, char* argv[]) {
         else if (token == "s"        ) measureGenerateMoves(pos);
         else if (token == "t"        ) std::cout << pos.mateMoveIn1Ply().toCSA() << std::endl;
         else if (token == "b"        ) makeBook(pos, ssCmd);
+        else if (token == "make_book") { // 大量の棋譜から並列に定跡を作る。
+            if (!evalTableIsRead) {
+                Evaluator::init(options["Eval_Dir"]);
+                evalTableIsRead = true;
+            }
+            makeBookParallel(pos, ssCmd);
+        }
+        else if (token == "book_think") { // 定跡の末端の局面を探索して定跡を伸ばす。
+            if (!evalTableIsRead) {
+                Evaluator::init(options["Eval_Dir"]);
+                evalTableIsRead = true;
+            }
+            bookThink(pos, ssCmd);
+        }
+        else if (token == "convert_book") convertBook(pos, ssCmd); // 定跡を compact 形式に変換する。
 #endif
         else                           SYNCCOUT << "unknown command: " << cmd << SYNCENDL;
     } while (token != "quit" && argc == 1);
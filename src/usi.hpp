@@ -79,8 +79,12 @@ void go(const Position& pos, const Ply depth, const Move move);
 void go(const Position& pos, const Ply depth);
 #endif
 void setPosition(Position& pos, std::istringstream& ssCmd);
+// position コマンドの引数 ("startpos moves ..." 又は "sfen ... moves ...") を [first, last) から読む。
+// "startpos" と "sfen" のどちらでも始まらないか、SFEN が不正なら false を返す。
+bool setPosition(Position& pos, const char* first, const char* last);
 bool setPosition(Position& pos, const HuffmanCodedPos& hcp);
 Move csaToMove(const Position& pos, const std::string& moveStr);
 Move usiToMove(const Position& pos, const std::string& moveStr);
+Move usiToMove(const Position& pos, const char* first, const char* last);
 
 #endif // #ifndef APERY_USI_HPP
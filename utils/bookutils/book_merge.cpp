@@ -19,123 +19,214 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <iostream>
-#include <fstream>
-#include <cinttypes>
-#include <vector>
-#include <map>
-#include <algorithm>
-
-struct BookEntry {
-	uint64_t key;
-	uint16_t fromToPro;
-	uint16_t count;
-	int score;
-};
-
-template <typename T>
-struct comp {
-	explicit comp(const T& a) : a_(a) {}
-	bool operator () (const T& b) const {
-		return a_.key == b.key && a_.fromToPro == b.fromToPro;
+// 定跡ファイルを先頭から 1 度だけ読みながらマージする。
+// 入力の定跡ファイルは key の順に並んでいること (makeBook(), make_book で作ったものはそうなっている)。
+// 同じ key の定跡手はまとめて読むので、使うメモリは入力の数と 1 局面の定跡手の数にしか依らない。
+//
+// book_merge [options] <出力する定跡ファイル> <入力の定跡ファイル> ...
+//   --count sum|max|first  同じ定跡手の出現回数の扱い。(default: sum)
+//   --score first|nonzero|max|min|last
+//                          同じ定跡手の点数の選び方。nonzero は最初の 0 で無い点数。(default: first)
+//   --join                 最初の入力にある定跡手だけを出力し、残りの入力からは点数などを取るだけにする。
+//                          (例) 点数を付けた定跡の点数を、別の定跡に付ける。
+//                          book_merge --join --count first --score nonzero book.bin tai_doukaku_book.bin searched_book.bin
+//
+// 出力では、同じ key の定跡手は出現回数の降順に並べる。
+// 出力の定跡ファイルは入力と別のファイルにすること。compact 形式 (convert_book で変換したもの) の定跡は入力に出来ない。
+
+#include "../../src/book.hpp"
+#include <sys/stat.h>
+
+namespace {
+	enum CountPolicy { CountSum, CountMax, CountFirst };
+	enum ScorePolicy { ScoreFirst, ScoreNonZero, ScoreMax, ScoreMin, ScoreLast };
+
+	// 定跡ファイルを少しずつ読む。
+	class BookReader {
+	public:
+		explicit BookReader(const std::string& fileName)
+			: fileName_(fileName), ifs_(fileName.c_str(), std::ios::binary), buf_(1 << 16), pos_(0), size_(0) { fill(); }
+		bool isOpen() const { return ifs_.is_open(); }
+		// compact 形式の定跡ファイルかどうか。BookEntry の列としては読めない。開いた直後だけ使える。
+		bool isCompact() const {
+			return sizeof(CompactBookMagic) <= size_ * sizeof(BookEntry)
+				&& std::equal(std::begin(CompactBookMagic), std::end(CompactBookMagic), reinterpret_cast<const char*>(buf_.data()));
+		}
+		bool empty() const { return pos_ == size_; }
+		const BookEntry& front() const { return buf_[pos_]; }
+		void pop() {
+			if (++pos_ == size_)
+				fill();
+		}
+		const std::string& fileName() const { return fileName_; }
+
+	private:
+		void fill() {
+			ifs_.read(reinterpret_cast<char*>(buf_.data()), buf_.size() * sizeof(BookEntry));
+			size_ = static_cast<size_t>(ifs_.gcount()) / sizeof(BookEntry);
+			pos_ = 0;
+		}
+
+		std::string fileName_;
+		std::ifstream ifs_;
+		std::vector<BookEntry> buf_;
+		size_t pos_;
+		size_t size_;
+	};
+
+	// マージ途中の定跡手。input はその定跡手を読んだ入力の番号。
+	struct GroupEntry {
+		BookEntry entry;
+		size_t input;
+	};
+
+	void mergeCount(BookEntry& dst, const BookEntry& src, const CountPolicy policy) {
+		switch (policy) {
+		case CountSum  : dst.count = static_cast<u16>(std::min<int>(dst.count + src.count, std::numeric_limits<u16>::max())); break;
+		case CountMax  : dst.count = std::max(dst.count, src.count); break;
+		case CountFirst: break;
+		}
+	}
+
+	void mergeScore(BookEntry& dst, const BookEntry& src, const ScorePolicy policy) {
+		switch (policy) {
+		case ScoreFirst  : break;
+		case ScoreNonZero: if (dst.score == ScoreZero) dst.score = src.score; break;
+		case ScoreMax    : dst.score = std::max(dst.score, src.score); break;
+		case ScoreMin    : dst.score = std::min(dst.score, src.score); break;
+		case ScoreLast   : dst.score = src.score; break;
+		}
+	}
+
+	// 同じファイルを指しているか。パスの書き方が違っても、inode が同じなら同じファイルとする。
+	bool isSameFile(const std::string& lhs, const std::string& rhs) {
+		if (lhs == rhs)
+			return true;
+		struct stat lst, rst;
+		if (stat(lhs.c_str(), &lst) != 0 || stat(rhs.c_str(), &rst) != 0)
+			return false;
+		return lst.st_ino != 0 && lst.st_dev == rst.st_dev && lst.st_ino == rst.st_ino;
 	}
-	const T& a_;
-};
 
-inline bool countCompare(const BookEntry& b1, const BookEntry& b2) {
-	return b1.count < b2.count;
+	void printUsage() {
+		std::cerr << "Usage: book_merge [--count sum|max|first] [--score first|nonzero|max|min|last] [--join] <output> <input> ..." << std::endl;
+	}
 }
 
 int main(int argc, char *argv[]) {
-	std::ifstream ifs0("bookbin/0book.bin", std::ios::binary);
-	std::ifstream ifs1("bookbin/1book.bin", std::ios::binary);
-	std::ifstream ifs2("bookbin/2book.bin", std::ios::binary);
-	std::ifstream ifs3("bookbin/3book.bin", std::ios::binary);
-	std::ifstream ifs4("bookbin/4book.bin", std::ios::binary);
-	std::ifstream ifs5("bookbin/5book.bin", std::ios::binary);
-	std::ifstream ifs6("bookbin/6book.bin", std::ios::binary);
-	std::ifstream ifs7("bookbin/7book.bin", std::ios::binary);
-
-	const size_t fileSize0 = static_cast<size_t>(ifs0.seekg(0, std::ios::end).tellg());
-	const size_t fileSize1 = static_cast<size_t>(ifs1.seekg(0, std::ios::end).tellg());
-	const size_t fileSize2 = static_cast<size_t>(ifs2.seekg(0, std::ios::end).tellg());
-	const size_t fileSize3 = static_cast<size_t>(ifs3.seekg(0, std::ios::end).tellg());
-	const size_t fileSize4 = static_cast<size_t>(ifs4.seekg(0, std::ios::end).tellg());
-	const size_t fileSize5 = static_cast<size_t>(ifs5.seekg(0, std::ios::end).tellg());
-	const size_t fileSize6 = static_cast<size_t>(ifs6.seekg(0, std::ios::end).tellg());
-	const size_t fileSize7 = static_cast<size_t>(ifs7.seekg(0, std::ios::end).tellg());
-
-	ifs0.seekg(0, std::ios::beg);
-	ifs1.seekg(0, std::ios::beg);
-	ifs2.seekg(0, std::ios::beg);
-	ifs3.seekg(0, std::ios::beg);
-	ifs4.seekg(0, std::ios::beg);
-	ifs5.seekg(0, std::ios::beg);
-	ifs6.seekg(0, std::ios::beg);
-	ifs7.seekg(0, std::ios::beg);
-
-	std::vector<BookEntry> vec0(fileSize0/sizeof(BookEntry));
-	std::vector<BookEntry> vec1(fileSize1/sizeof(BookEntry));
-	std::vector<BookEntry> vec2(fileSize2/sizeof(BookEntry));
-	std::vector<BookEntry> vec3(fileSize3/sizeof(BookEntry));
-	std::vector<BookEntry> vec4(fileSize4/sizeof(BookEntry));
-	std::vector<BookEntry> vec5(fileSize5/sizeof(BookEntry));
-	std::vector<BookEntry> vec6(fileSize6/sizeof(BookEntry));
-	std::vector<BookEntry> vec7(fileSize7/sizeof(BookEntry));
-
-	ifs0.read(reinterpret_cast<char*>(&vec0[0]), fileSize0);
-	ifs1.read(reinterpret_cast<char*>(&vec1[0]), fileSize1);
-	ifs2.read(reinterpret_cast<char*>(&vec2[0]), fileSize2);
-	ifs3.read(reinterpret_cast<char*>(&vec3[0]), fileSize3);
-	ifs4.read(reinterpret_cast<char*>(&vec4[0]), fileSize4);
-	ifs5.read(reinterpret_cast<char*>(&vec5[0]), fileSize5);
-	ifs6.read(reinterpret_cast<char*>(&vec6[0]), fileSize6);
-	ifs7.read(reinterpret_cast<char*>(&vec7[0]), fileSize7);
-
-	std::map<uint64_t, std::vector<BookEntry> > map0;
-	std::map<uint64_t, std::vector<BookEntry> > map1;
-	std::map<uint64_t, std::vector<BookEntry> > map2;
-	std::map<uint64_t, std::vector<BookEntry> > map3;
-	std::map<uint64_t, std::vector<BookEntry> > map4;
-	std::map<uint64_t, std::vector<BookEntry> > map5;
-	std::map<uint64_t, std::vector<BookEntry> > map6;
-	std::map<uint64_t, std::vector<BookEntry> > map7;
-
-	for (auto elem : vec0) map0[elem.key].push_back(elem);
-	for (auto elem : vec1) map1[elem.key].push_back(elem);
-	for (auto elem : vec2) map2[elem.key].push_back(elem);
-	for (auto elem : vec3) map3[elem.key].push_back(elem);
-	for (auto elem : vec4) map4[elem.key].push_back(elem);
-	for (auto elem : vec5) map5[elem.key].push_back(elem);
-	for (auto elem : vec6) map6[elem.key].push_back(elem);
-	for (auto elem : vec7) map7[elem.key].push_back(elem);
-
-#define FOO(mapn) \
-	for (auto& elem : mapn) {					\
-		for (const auto& elel : elem.second) {							\
-			auto it = std::find_if(std::begin(map0[elel.key]), std::end(map0[elel.key]), comp<BookEntry>(elel)); \
-			if (it != std::end(map0[elel.key])) {						\
-				it->count += elel.count;								\
-			}															\
-			else														\
-				map0[elel.key].push_back(elel);							\
-		}																\
+	CountPolicy countPolicy = CountSum;
+	ScorePolicy scorePolicy = ScoreFirst;
+	bool join = false;
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (arg == "--count" && i + 1 < argc) {
+			const std::string value = argv[++i];
+			if      (value == "sum"  ) countPolicy = CountSum;
+			else if (value == "max"  ) countPolicy = CountMax;
+			else if (value == "first") countPolicy = CountFirst;
+			else { printUsage(); return EXIT_FAILURE; }
+		}
+		else if (arg == "--score" && i + 1 < argc) {
+			const std::string value = argv[++i];
+			if      (value == "first"  ) scorePolicy = ScoreFirst;
+			else if (value == "nonzero") scorePolicy = ScoreNonZero;
+			else if (value == "max"    ) scorePolicy = ScoreMax;
+			else if (value == "min"    ) scorePolicy = ScoreMin;
+			else if (value == "last"   ) scorePolicy = ScoreLast;
+			else { printUsage(); return EXIT_FAILURE; }
+		}
+		else if (arg == "--join")
+			join = true;
+		else if (arg.compare(0, 2, "--") == 0) {
+			printUsage();
+			return EXIT_FAILURE;
+		}
+		else
+			files.push_back(arg);
+	}
+	if (files.size() < 2) {
+		printUsage();
+		return EXIT_FAILURE;
+	}
+
+	// 出力を開くとファイルが空になるので、入力を全て確かめてから開く。
+	std::vector<std::unique_ptr<BookReader> > readers;
+	for (size_t i = 1; i < files.size(); ++i) {
+		if (isSameFile(files[0], files[i])) {
+			std::cerr << "Error: output " << files[0] << " is the same file as input " << files[i] << "." << std::endl;
+			return EXIT_FAILURE;
+		}
+		readers.emplace_back(new BookReader(files[i]));
+		if (!readers.back()->isOpen()) {
+			std::cerr << "Error: cannot open " << files[i] << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (readers.back()->isCompact()) {
+			std::cerr << "Error: " << files[i] << " is a compact book. book_merge reads only books of BookEntry records." << std::endl;
+			return EXIT_FAILURE;
+		}
 	}
-	FOO(map1);
-	FOO(map2);
-	FOO(map3);
-	FOO(map4);
-	FOO(map5);
-	FOO(map6);
-	FOO(map7);
-
-	for (auto& elem : map0)
-		std::sort(elem.second.rbegin(), elem.second.rend(), countCompare);
-
-	std::ofstream ofs("book.bin", std::ios::binary);
-	for (auto& elem : map0) {
-		for (auto& elel : elem.second) {
-			ofs.write(reinterpret_cast<char*>(&elel), sizeof(BookEntry));
+	std::ofstream ofs(files[0].c_str(), std::ios::binary);
+	if (!ofs) {
+		std::cerr << "Error: cannot open " << files[0] << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<s64> inputNums(readers.size(), 0);
+	s64 outputNum = 0;
+	std::vector<GroupEntry> group;
+	while (true) {
+		// 全ての入力の先頭の中で一番小さい key の定跡手を、各入力から全て取り出す。
+		bool found = false;
+		Key key = 0;
+		for (auto& reader : readers) {
+			if (!reader->empty() && (!found || reader->front().key < key)) {
+				key = reader->front().key;
+				found = true;
+			}
 		}
+		if (!found)
+			break;
+		group.clear();
+		for (size_t i = 0; i < readers.size(); ++i) {
+			BookReader& reader = *readers[i];
+			for (; !reader.empty() && reader.front().key == key; reader.pop(), ++inputNums[i])
+				group.push_back({reader.front(), i});
+			if (!reader.empty() && reader.front().key < key) {
+				std::cerr << "Error: " << reader.fileName() << " is not sorted by key." << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+
+		// 同じ指し手を入力の順にまとめる。
+		std::stable_sort(std::begin(group), std::end(group), [](const GroupEntry& lhs, const GroupEntry& rhs) {
+				return lhs.entry.fromToPro < rhs.entry.fromToPro;
+			});
+		size_t n = 0;
+		for (size_t i = 0; i < group.size(); ++i) {
+			if (n != 0 && group[n - 1].entry.fromToPro == group[i].entry.fromToPro) {
+				mergeCount(group[n - 1].entry, group[i].entry, countPolicy);
+				mergeScore(group[n - 1].entry, group[i].entry, scorePolicy);
+			}
+			else if (!join || group[i].input == 0)
+				group[n++] = group[i];
+		}
+		group.resize(n);
+
+		std::stable_sort(std::begin(group), std::end(group), [](const GroupEntry& lhs, const GroupEntry& rhs) {
+				return lhs.entry.count > rhs.entry.count;
+			});
+		for (auto& elem : group)
+			ofs.write(reinterpret_cast<const char*>(&elem.entry), sizeof(BookEntry));
+		outputNum += group.size();
+	}
+
+	for (size_t i = 0; i < readers.size(); ++i)
+		std::cout << readers[i]->fileName() << ": " << inputNums[i] << " entries" << std::endl;
+	std::cout << files[0] << ": " << outputNum << " entries" << std::endl;
+	if (!ofs) {
+		std::cerr << "Error: cannot write " << files[0] << std::endl;
+		return EXIT_FAILURE;
 	}
 }